@@ -0,0 +1,18 @@
+; Emulator speed benchmark, two nested countdown loops that never end:
+;   wr80asm -me examples/bench.asm --steps 100000000
+; the MIPS of the run are printed when the steps limit stops it
+
+outer:
+	std 200
+	ld r1
+inner:
+	stl r1
+	decr
+	ld r1
+	jz next
+	jp inner
+next:
+	stl r2
+	incr
+	ld r2
+	jp outer
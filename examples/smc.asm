@@ -0,0 +1,35 @@
+; Self modifying code check of the emulator:
+;   wr80asm -me examples/smc.asm --steps 1000
+; halts at 'ok' when the call after the patch runs the new ST 7, and reaches
+; the steps limit in 'fail' (exit code 1) when the decoded block was kept.
+; It runs 23 instructions, so --steps 22 stops at 'ok' before its jump
+
+	call sub		; DR = 1, the block of sub is decoded
+	ld r1
+	std 1
+	bt r1
+	jz patch
+	jp fail
+patch:
+	std 0			; P0:P1 = address of the ST in sub
+	out p0
+	std value
+	out p1
+	std 0x67		; ST 7 written through P2
+	out p2
+	call sub		; DR = 7 if the block was decoded again
+	ld r1
+	std 7
+	bt r1
+	jz ok
+fail:
+	cdr
+	jp fail
+ok:
+	jp ok
+
+sub:
+	cdr
+value:
+	st 1
+	ret
@@ -11,9 +11,11 @@
 #include <stdbool.h>
 #endif
 
-const char *input;
-const char *input_save;
-bool is_asm_proc = false;
+WR80_TLS const char *input;
+WR80_TLS const char *input_save;
+WR80_TLS bool is_asm_proc = false;
+WR80_TLS bool is_cond_parse = false;		// IF conditions grammar: operands kept as names
+WR80_TLS bool parse_failed = false;
 
 typedef enum {
     NODE_NUM,
@@ -38,7 +40,9 @@ typedef enum {
     NODE_AND_BIT,
     NODE_NOT_BIT,
     NODE_NOT,
-    NODE_EXP
+    NODE_EXP,
+    NODE_DEFINED,
+    NODE_NAN
 } NodeType;
 
 typedef struct AST {
@@ -118,6 +122,9 @@ int parse_number() {
 	if (*input == '@') {
         input++;
         value = code_index;
+        #ifdef __WR80ASM_H__
+        	memo_pure = false;
+        #endif
     }
 	// 'A'
 	else if(*input == '\''){
@@ -184,6 +191,55 @@ char *parse_ident() {
 
 
 
+// operand of the IF conditions: the raw name, number or macro argument
+char *parse_operand() {
+    const char *start = input;
+    if (*input == '#' && *(input+1) != '\0')
+        input += 2;
+    else if (*input == '%' || *input == '-')
+        input++;
+    while (*input != '\0' && strchr(" \t()=!<>&|^%+-*/~", *input) == NULL)
+        input++;
+
+    int len = input - start;
+    if (len == 0)
+        parse_failed = true;
+    char *name = malloc(len + 1);
+    memcpy(name, start, len);
+    name[len] = '\0';
+
+    return name;
+}
+
+AST *parse_condition_primary() {
+    // #$ (NaN)
+    if (*input == '#' && *(input+1) == '$') {
+        input += 2;
+        return new_op(NODE_NAN, NULL, NULL);
+    }
+
+    // defined(NAME)
+    if (strncmp(input, "DEFINED", 7) == 0 && !is_alnum(input[7])) {
+        input += 7;
+        skip_spaces();
+        if (*input != '(') {
+            parse_failed = true;
+            return new_num(0);
+        }
+        input++;
+        skip_spaces();
+        AST *name = new_ident(parse_operand());
+        skip_spaces();
+        if (*input != ')')
+            parse_failed = true;
+        else
+            input++;
+        return new_op(NODE_DEFINED, NULL, name);
+    }
+
+    return new_ident(parse_operand());
+}
+
 AST *parse_primary() {
     skip_spaces();
 
@@ -192,10 +248,16 @@ AST *parse_primary() {
         input++; // '('
         AST *node = parse_logical_or();
         skip_spaces();
-        input++; // ')'
+        if (*input != ')')
+            parse_failed = true;
+        else
+            input++; // ')'
         return node;
     }
 
+    if (is_cond_parse)
+        return parse_condition_primary();
+
     // identificador
     if (is_alpha(*input) && !is_hexa(input)) {
         char *name = parse_ident();
@@ -360,6 +422,19 @@ AST *parse(const char *str) {
     return parse_logical_or();
 }
 
+// parse_condition: parse the IF conditions, where the operands are names
+// resolved by the assembler on each evaluation
+AST *parse_condition(const char *str) {
+    is_cond_parse = true;
+    parse_failed = false;
+    AST *node = parse(str);
+    skip_spaces();
+    if (*input != '\0')
+        parse_failed = true;
+    is_cond_parse = false;
+    return node;
+}
+
 int eval(AST *node, bool* state) {
 	// TODO: Criar mais operaes e fazer parsing de hexadecimais
     switch (node->type) {
@@ -385,6 +460,8 @@ int eval(AST *node, bool* state) {
         case NODE_NOT_BIT: 	 return ~eval(node->right, state);
         case NODE_NOT: 		 return !eval(node->right, state);
         case NODE_EXP: 		 return (int)pow(eval(node->left, state), eval(node->right, state));
+        case NODE_DEFINED:
+        case NODE_NAN: 		 return 0;
         case NODE_IDENT: {
         	int number_res = 0;
         	#ifdef __WR80ASM_H__
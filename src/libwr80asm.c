@@ -0,0 +1,19 @@
+/*
+	WR80 Assembler Shared Library
+	Created by Wender Francis (KiddieOS.Community)
+	Date: 20/08/2025
+
+*/
+
+/*
+	Translation unit of libwr80asm, exporting only the functions declared in
+	libwr80asm.h. The contexts created by the library capture the messages
+	as diagnostics instead of printing them.
+
+	Windows:	make -f Makefile.win lib
+	Linux:		gcc -shared -fPIC -fvisibility=hidden -o libwr80asm.so src/libwr80asm.c -lm -lpthread
+*/
+
+#define WR80_BUILD_LIB
+#include "libwr80asm.h"
+#include "wr80asm.h"
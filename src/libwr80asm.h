@@ -0,0 +1,95 @@
+/*
+	WR80 Assembler Embedding Library
+	Created by Wender Francis (KiddieOS.Community)
+	Date: 20/08/2025
+
+*/
+
+#ifndef __LIBWR80ASM_H__
+#define __LIBWR80ASM_H__
+
+/*
+	Public interface of libwr80asm, the assembler as a shared library. Each
+	context assembles in the calling thread, keeping the machine code, the
+	symbols and the messages of its last assembly until the next one. The
+	library never prints and never ends the process: the messages are
+	returned as diagnostics.
+
+	The assembly states are kept per thread, not in the context: a thread
+	has at most one context alive and uses only that one. wr80_create
+	returns NULL while the calling thread has another context alive, until
+	its wr80_destroy. Parallel assemblies use one thread for each context.
+
+	Wr80Assembler* as = wr80_create();
+	if(wr80_assemble_buffer(as, "ld r1\r\nst 5\r\n")){
+		Wr80Image image = wr80_image(as);
+		...
+	}
+	wr80_destroy(as);
+*/
+// -----------------------------------------------------------------------------
+#ifndef _STDBOOL_H
+#include <stdbool.h>
+#endif
+
+#if defined(WR80_BUILD_LIB) && defined(_WIN32)
+#define WR80_API __declspec(dllexport)
+#elif defined(WR80_BUILD_LIB)
+#define WR80_API __attribute__((visibility("default")))
+#else
+#define WR80_API
+#endif
+
+// SEVERITIES OF THE DIAGNOSTICS
+// -----------------------------------------------------
+#define WR80_NOTE		0
+#define WR80_WARNING	1
+#define WR80_ERROR		2
+
+// KINDS OF THE SYMBOLS
+// -----------------------------------------------------
+#define WR80_LABEL		0
+#define WR80_DEFINE		1
+
+typedef struct wr80_assembler Wr80Assembler;
+
+// Machine code of the last assembly, owned by the context
+typedef struct {
+	const unsigned char* code;
+	int size;
+} Wr80Image;
+
+// Label with its address or define with its numeric value
+typedef struct {
+	const char* name;
+	int value;
+	int line;
+	int kind;
+} Wr80Symbol;
+
+// Message of the assembly with the file (NULL for buffers) and the line
+typedef struct {
+	int severity;
+	const char* file;
+	int line;
+	const char* message;
+} Wr80Diagnostic;
+
+// Reader of the files of the assembly: the sources, INCLUDE, INCLUDEB and
+// IMPORT files. Returns the content of the file with its size, owned by the
+// embedder until the assembly ends, or NULL to read the file from the disk
+typedef const char* (*Wr80Reader)(void* user, const char* path, long* size);
+
+WR80_API Wr80Assembler* wr80_create(void);
+WR80_API void wr80_configure(Wr80Assembler* assembler, bool alloc, int depth);
+WR80_API void wr80_set_reader(Wr80Assembler* assembler, Wr80Reader reader, void* user);
+WR80_API void wr80_add_path(Wr80Assembler* assembler, const char* directory);
+WR80_API bool wr80_assemble_buffer(Wr80Assembler* assembler, const char* source);
+WR80_API bool wr80_assemble_file(Wr80Assembler* assembler, const char* filename);
+WR80_API Wr80Image wr80_image(const Wr80Assembler* assembler);
+WR80_API const Wr80Symbol* wr80_symbols(const Wr80Assembler* assembler, int* count);
+WR80_API const Wr80Diagnostic* wr80_diagnostics(const Wr80Assembler* assembler, int* count);
+WR80_API void wr80_destroy(Wr80Assembler* assembler);
+// -----------------------------------------------------------------------------
+
+#endif
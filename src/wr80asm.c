@@ -7,8 +7,223 @@
 
 #include "../wr80asm_private.h"
 #include "wr80asm.h"
+
+// Output writer of this executable, also called by the watch mode
+void write_output(const char*, const char*, Wr80Assembler*, bool);
+
+#include "wr80serv.h"	// WR80 Assembler server and client over Unix domain sockets
+#include "wr80watch.h"	// WR80 Assembler watch mode over Linux inotify
+#include "wr80cache.h"	// WR80 Assembler build cache of the assembled sources
+#include "wr80emu.h"	// WR80 Assembler emulator of the machine code
 //#include "memdebug.h"  // descomente se for depurar heaps/leaks (use -DDEBUG_MEMORY no GCC)
 
+// Batch of sources assembled by a pool of threads, each thread takes the
+// next source of the batch until all are assembled
+// -----------------------------------------------------------------------------
+typedef struct {
+	char** sources;
+	int count;
+	volatile int next;
+	char** reports;		// captured messages of each source
+	bool* results;
+	bool verbose;
+	bool alloc;
+	bool hexdump;
+	bool bin;
+	int depth;
+	char** paths;		// search paths of the included files
+	int npaths;
+	BuildCache* cache;	// build cache (NULL if disabled)
+	bool deps;			// write the dependency file of each output (-MD)
+	bool check;			// compare the outputs without writing them
+	volatile int differ;	// outputs that differ from the assembled code
+} BatchJobs;
+// -----------------------------------------------------------------------------
+
+// write_output: Write the assembled code in the hexa or binary file, named as
+// the source when output is NULL
+// -----------------------------------------------------------------------------
+void write_output(const char* source, const char* output, Wr80Assembler* assembler, bool bin){
+	char* binary = (output == NULL) ? changeExtension(source, (bin) ? ".bin" : ".hex") : (char*) output;
+	int size_file;
+	if(!bin){
+		size_file = writeHex(binary, assembler->code, assembler->size);
+	}else{
+		size_file = (writeBin(binary, assembler->code, assembler->size)) ? assembler->size : -1;
+	}
+	if(size_file >= 0)
+		diag_printf("\nThe hexa file '%s' was assembled successfully with %d bytes!\n", binary, size_file);
+	if(output == NULL)
+		free(binary);
+}
+// -----------------------------------------------------------------------------
+
+// check_output: Compare the assembled code with the hexa or binary file on
+// disk without writing it. Returns false when the file differs
+// -----------------------------------------------------------------------------
+bool check_output(const char* source, const char* output, Wr80Assembler* assembler, bool bin){
+	char* binary = (output == NULL) ? changeExtension(source, (bin) ? ".bin" : ".hex") : (char*) output;
+	long length = assembler->size;
+	char* text = (bin) ? (char*) assembler->code : formatHex(assembler->code, assembler->size, &length);
+	bool same = text != NULL && sameOutput(binary, text, length, !bin);
+	if(same)
+		diag_printf("\nThe file '%s' is up to date.\n", binary);
+	else
+		diag_error(stdout, "\n%s -> Error: the file '%s' differs from the assembled code\n", source, binary);
+	if(!bin)
+		free(text);
+	if(output == NULL)
+		free(binary);
+	return same;
+}
+// -----------------------------------------------------------------------------
+
+// write_depname: Write the file name escaped for the make rules
+// -----------------------------------------------------------------------------
+void write_depname(FILE* file, const char* name){
+	for(; *name != '\0'; name++){
+		if(*name == ' ' || *name == '#')
+			fputc('\\', file);
+		else if(*name == '$')
+			fputc('$', file);
+		fputc(*name, file);
+	}
+}
+// -----------------------------------------------------------------------------
+
+// write_deps: Write the make rule of the output depending on the files read
+// by the last assembly of the thread, in the order they were read. The rule
+// goes to the depfile, or to the output name with the .d extension
+// -----------------------------------------------------------------------------
+bool write_deps(const char* source, const char* output, const char* depfile, bool bin){
+	char* target = (output == NULL) ? changeExtension(source, (bin) ? ".bin" : ".hex") : (char*) output;
+	char* path = (depfile == NULL) ? changeExtension(target, ".d") : (char*) depfile;
+	int count = 0;
+	for(SourceList* src = source_list; src != NULL; src = src->next)
+		count++;
+	SourceList** files = (SourceList**) malloc((count + 1) * sizeof(SourceList*));
+	int i = count;
+	for(SourceList* src = source_list; src != NULL; src = src->next)
+		files[--i] = src;
+	
+	FILE* file = fopen(path, "w");
+	bool written = file != NULL;
+	if(written){
+		write_depname(file, target);
+		fputc(':', file);
+		for(i = 0; i < count; i++){
+			fputs(" \\\n ", file);
+			write_depname(file, files[i]->path);
+		}
+		fputc('\n', file);
+		written = !ferror(file);
+		written = fclose(file) == 0 && written;
+	}
+	if(!written)
+		diag_error(stderr, "Error: can't write the dependency file '%s'\n", path);
+	free(files);
+	if(depfile == NULL)
+		free(path);
+	if(output == NULL)
+		free(target);
+	return written;
+}
+// -----------------------------------------------------------------------------
+
+// batch_worker: Assemble the sources of the batch with an own assembler
+// context, capturing the messages of each source in its report
+// -----------------------------------------------------------------------------
+void batch_worker(BatchJobs* batch){
+	Wr80Assembler* assembler = wr80_create();
+	assembler->verbose = batch->verbose;
+	assembler->alloc = batch->alloc;
+	assembler->depth = batch->depth;
+	for(int p = 0; p < batch->npaths; p++)
+		wr80_add_path(assembler, batch->paths[p]);
+	
+	int i;
+	while((i = __sync_fetch_and_add(&batch->next, 1)) < batch->count){
+		diag_begin();
+		bool mounted = (batch->cache != NULL) ? cache_assemble(batch->cache, assembler, batch->sources[i], batch->bin)
+											: wr80_assemble_file(assembler, batch->sources[i]);
+		if(mounted && batch->hexdump)
+			hex_dump(assembler->code);
+		if(mounted && batch->verbose)
+			show_stats();
+		if(mounted && batch->check && !check_output(batch->sources[i], NULL, assembler, batch->bin))
+			__sync_fetch_and_add(&batch->differ, 1);
+		else if(mounted && !batch->check)
+			write_output(batch->sources[i], NULL, assembler, batch->bin);
+		if(mounted && batch->deps && !batch->check)
+			write_deps(batch->sources[i], NULL, NULL, batch->bin);
+		batch->results[i] = mounted;
+		batch->reports[i] = diag_end();
+	}
+	wr80_destroy(assembler);
+}
+// -----------------------------------------------------------------------------
+
+#ifdef _WIN32
+DWORD WINAPI batch_thread(LPVOID batch){
+	batch_worker((BatchJobs*) batch);
+	return 0;
+}
+#else
+void* batch_thread(void* batch){
+	batch_worker((BatchJobs*) batch);
+	return NULL;
+}
+#endif
+// -----------------------------------------------------------------------------
+
+// assemble_batch: Assemble the sources in parallel and print their messages
+// in the command line order. Returns the number of failed sources and, in
+// the check mode, of the outputs that differ
+// -----------------------------------------------------------------------------
+int assemble_batch(BatchJobs* batch, int jobs){
+	if(jobs < 1)
+		jobs = 1;
+	if(jobs > batch->count)
+		jobs = batch->count;
+	batch->next = 0;
+	batch->differ = 0;
+	batch->reports = (char**) calloc(batch->count, sizeof(char*));
+	batch->results = (bool*) calloc(batch->count, sizeof(bool));
+	
+	Wr80Thread* threads = (Wr80Thread*) malloc(jobs * sizeof(Wr80Thread));
+#ifdef _WIN32
+	for(int t = 0; t < jobs; t++)
+		threads[t] = CreateThread(NULL, 0, batch_thread, batch, 0, NULL);
+	for(int t = 0; t < jobs; t++){
+		WaitForSingleObject(threads[t], INFINITE);
+		CloseHandle(threads[t]);
+	}
+#else
+	for(int t = 0; t < jobs; t++)
+		pthread_create(&threads[t], NULL, batch_thread, batch);
+	for(int t = 0; t < jobs; t++)
+		pthread_join(threads[t], NULL);
+#endif
+	free(threads);
+	
+	int failed = 0;
+	for(int i = 0; i < batch->count; i++){
+		fputs(batch->reports[i], stdout);
+		free(batch->reports[i]);
+		if(!batch->results[i]){
+			printf("%s -> Error: the source was not assembled\n", batch->sources[i]);
+			failed++;
+		}
+	}
+	printf("\n%d of %d sources assembled successfully.\n", batch->count - failed, batch->count);
+	if(batch->check)
+		printf("%d of %d outputs are up to date.\n", batch->count - failed - batch->differ, batch->count);
+	free(batch->reports);
+	free(batch->results);
+	return failed + batch->differ;
+}
+// -----------------------------------------------------------------------------
+
 int main(int argc, char *argv[]) {
 	if (argc == 1) {
 		const char* description = FILE_DESCRIPTION;
@@ -19,7 +234,7 @@ int main(int argc, char *argv[]) {
 		printf("Created by %s\n\n", author);
 		printf("********************************************************************************\n");
         printf("Usage:\n");
-        printf (" -m | --mount <source_file> : Assemble the source file\n" \
+        printf (" -m | --mount <source_file> ... : Assemble the source files\n" \
 			 	" -e | --emulate <binary_file> : Emulate the binary file\n" \
 				" -me | --mount-emulate <source_file> : Assemble and emulate the file\n\n");
 		printf("Extra parameters:\n");
@@ -30,7 +245,21 @@ int main(int argc, char *argv[]) {
 				" -h | --hexdump <binary_file> : Show the hexa code from binary file\n" \
 				" -b | --binary : Assemble the file in binary format\n" \
 				" -v | --verbose : Print assembler steps information\n" \
-				" -a | --alloc : Allocate bytes when using ORG directive\n");
+				" -a | --alloc : Allocate bytes when using ORG directive\n" \
+				" -x | --depth <levels> : Max nested macro, REP and IF expansions (default 256, up to 2048)\n" \
+				" -j | --jobs <threads> : Threads to assemble many source files (use -m before)\n" \
+				" -I <directory> : Search the included files also in the directory\n" \
+				" -MD : Write the make dependencies of the output in a .d file (use -m before)\n" \
+				" -MF <dep_file> : Write the make dependencies in the file (use -m before)\n" \
+				" --check : Compare the output file with the assembled code, without writing (use -m before)\n" \
+				" --server <socket_path> : Run the assembler server keeping the includes warm\n" \
+				" --client <socket_path> : Assemble in the server of the socket (use -m before)\n" \
+				" --watch : Rebuild the sources when they or their included files change (use -m before)\n" \
+				" --cache <directory> : Reuse the machine code of unchanged sources (use -m before)\n" \
+				" --cache-max <kbytes> : Size limit of the build cache (default 65536)\n" \
+				" --cache-stats : Show the statistics of the build cache (use --cache before)\n" \
+				" --precompile <include_file> : Write the snapshot of the include symbols (.wpch)\n" \
+				" --steps <count> : Stop the emulation after the instructions (use -e or -me before)\n");
         return EXIT_FAILURE;
     }
 
@@ -39,9 +268,28 @@ int main(int argc, char *argv[]) {
 	bool output = false;
 	bool bin = false;
 	bool verb = false;
+	bool watch = false;
+	bool stats = false;
+	bool deps = false;
+	bool check = false;
+	bool debug = false;
+	bool write = false;
+	unsigned long long steps = 0;
+	BuildCache cache = {0};
+	cache.max = CACHE_MAX_SIZE * 1024L;
 	
+	Wr80Assembler* assembler = wr80_create();
 	char* source = NULL;
 	char* binary = NULL;
+	char* server = NULL;
+	char* client = NULL;
+	char* precompile = NULL;
+	char* depfile = NULL;
+	char* emulate = NULL;
+	char* assemble = NULL;
+	char** sources = (char**) malloc(argc * sizeof(char*));
+	int count = 0;
+	int jobs = 1;
 	
 	for(int i = 1; i < argc; i++){
 		mount = (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mount") == 0) || mount;
@@ -49,13 +297,134 @@ int main(int argc, char *argv[]) {
 		output = (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) || output;
 		bin = (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--binary") == 0) || bin;
 		verb = (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) || verb;
-		alloc = (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--alloc") == 0) || alloc;
+		assembler->alloc = (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--alloc") == 0) || assembler->alloc;
 		if(source == NULL && mount)
 			source = argv[i + 1];
 		if(binary == NULL && output)
 			binary = argv[i + 1];
+		if((strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "--depth") == 0) && i + 1 < argc)
+			assembler->depth = atoi(argv[i + 1]);
+		if((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc)
+			jobs = atoi(argv[i + 1]);
+		if(strcmp(argv[i], "-I") == 0 && i + 1 < argc)
+			wr80_add_path(assembler, argv[i + 1]);
+		else if(strncmp(argv[i], "-I", 2) == 0 && argv[i][2] != '\0')
+			wr80_add_path(assembler, &argv[i][2]);
+		if(strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mount") == 0)
+			for(int j = i + 1; j < argc && argv[j][0] != '-'; j++)
+				sources[count++] = argv[j];
+		if(strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+			server = argv[i + 1];
+		if(strcmp(argv[i], "--client") == 0 && i + 1 < argc)
+			client = argv[i + 1];
+		if(strcmp(argv[i], "--precompile") == 0 && i + 1 < argc)
+			precompile = argv[i + 1];
+		watch = strcmp(argv[i], "--watch") == 0 || watch;
+		stats = strcmp(argv[i], "--cache-stats") == 0 || stats;
+		deps = strcmp(argv[i], "-MD") == 0 || deps;
+		check = strcmp(argv[i], "--check") == 0 || check;
+		if(strcmp(argv[i], "-MF") == 0 && i + 1 < argc)
+			depfile = argv[i + 1];
+		if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+			cache.dir = argv[i + 1];
+		if(strcmp(argv[i], "--cache-max") == 0 && i + 1 < argc)
+			cache.max = atol(argv[i + 1]) * 1024L;
+		if((strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--emulate") == 0) && i + 1 < argc)
+			emulate = argv[i + 1];
+		if((strcmp(argv[i], "-me") == 0 || strcmp(argv[i], "--mount-emulate") == 0) && i + 1 < argc)
+			assemble = argv[i + 1];
+		debug = (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) || debug;
+		write = (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--write") == 0) || write;
+		if(strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+			steps = strtoull(argv[i + 1], NULL, 10);
 	}
 	
+	if(emulate != NULL){
+		free(sources);
+		wr80_destroy(assembler);
+		return emu_main(emulate, debug, steps);
+	}
+	
+	// the code runs in the memory of the assembly, written only with -w
+	if(assemble != NULL){
+		free(sources);
+		assembler->verbose = verb;
+		bool mounted = wr80_assemble_file(assembler, assemble);
+		if(mounted && hexdump)
+			hex_dump(assembler->code);
+		if(mounted && write)
+			write_output(assemble, (output) ? binary : NULL, assembler, bin);
+		int result = (mounted) ? emu_assembly(assembler, debug, steps) : EXIT_FAILURE;
+		wr80_destroy(assembler);
+		return result;
+	}
+	
+	if(server != NULL){
+		free(sources);
+		wr80_destroy(assembler);
+		return server_main(server);
+	}
+	
+	if(precompile != NULL){
+		assembler->verbose = verb;
+		char* snapshot = (output) ? binary : changeExtension(precompile, ".wpch");
+		bool written = wr80_precompile(assembler, precompile, snapshot);
+		if(written)
+			printf("\nThe include '%s' was precompiled successfully in '%s'!\n", precompile, snapshot);
+		if(!output)
+			free(snapshot);
+		free(sources);
+		wr80_destroy(assembler);
+		return (written) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	
+	if(watch && count > 0){
+		assembler->verbose = verb;
+		int result = watch_main(sources, count, (output) ? binary : NULL, assembler, bin);
+		free(sources);
+		wr80_destroy(assembler);
+		return result;
+	}
+	
+	if(stats && cache.dir != NULL && count == 0){
+		cache_stats(&cache);
+		free(sources);
+		wr80_destroy(assembler);
+		return EXIT_SUCCESS;
+	}
+	
+	if(count > 1 && depfile != NULL){
+		fprintf(stderr, "Error: -MF writes the dependencies of one source, use -MD for many\n");
+		free(sources);
+		wr80_destroy(assembler);
+		return EXIT_FAILURE;
+	}
+	
+	if(count > 1){
+		BatchJobs batch = {0};
+		batch.sources = sources;
+		batch.count = count;
+		batch.verbose = verb;
+		batch.alloc = assembler->alloc;
+		batch.hexdump = hexdump;
+		batch.bin = bin;
+		batch.depth = assembler->depth;
+		batch.paths = assembler->paths;
+		batch.npaths = assembler->npaths;
+		batch.cache = (cache.dir != NULL) ? &cache : NULL;
+		batch.deps = deps;
+		batch.check = check;
+		int failed = assemble_batch(&batch, jobs);
+		if(cache.dir != NULL)
+			cache_finish(&cache);
+		if(cache.dir != NULL && stats)
+			cache_stats(&cache);
+		free(sources);
+		wr80_destroy(assembler);
+		return (failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	free(sources);
+	
 	/*
 	char *source_code = load_file_to_buffer(source);
 	if (!source_code) {
@@ -76,35 +445,39 @@ int main(int argc, char *argv[]) {
 	hex_dump(machine_code);
 	*/
 	
-	unsigned char* machinecode = NULL;
-	bool mounted = (mount) ? assemble_file(source, &machinecode, verb) : false;	// LEAK: Fluxo
+	assembler->verbose = verb;
+	bool mounted = false;
+	if(mount && client != NULL)
+		mounted = client_main(client, source, assembler);
+	else if(mount && cache.dir != NULL)
+		mounted = cache_assemble(&cache, assembler, source, bin);
+	else if(mount)
+		mounted = wr80_assemble_file(assembler, source);	// LEAK: Fluxo
+	unsigned char* machinecode = assembler->code;
 	//source = "getchar_ex.asm";
 	//bool mounted = assemble_file(source, &machinecode, true);
 	
-	if(mounted && hexdump)
+	// the states of the assembly are in the server for the client mode
+	if(mounted && hexdump && client == NULL)
 		hex_dump(machinecode);
+	if(mounted && verb && client == NULL)
+		show_stats();
 		
-	if(mounted){
-		int length = get_code_size();
-		int size_file;
-		if(!bin){
-			if(!output)
-				binary = changeExtension(source, ".hex");
-			size_file = writeHex(binary, machinecode, length);
-		}else{
-			if(!output)
-				binary = changeExtension(source, ".bin");
-			writeBin(binary, machinecode, length);
-			size_file = length;
-		}
-		printf("\nThe hexa file '%s' was assembled successfully with %d bytes!\n", binary, size_file);
-	}
+	bool same = true;
+	if(mounted && check)
+		same = check_output(source, (output) ? binary : NULL, assembler, bin);
+	else if(mounted)
+		write_output(source, (output) ? binary : NULL, assembler, bin);
+	if(mounted && !check && (deps || depfile != NULL))
+		write_deps(source, (output) ? binary : NULL, depfile, bin);
+	if(cache.dir != NULL)
+		cache_finish(&cache);
+	if(cache.dir != NULL && stats)
+		cache_stats(&cache);
 	
-	if(machinecode != NULL)
-		free(machinecode);
-	if(binary != NULL)
-		free(binary);
-	close_lists();
+	wr80_destroy(assembler);
 	
+	if(check && (!mounted || !same))
+		return EXIT_FAILURE;
     return EXIT_SUCCESS;
 }
@@ -15,6 +15,9 @@
 	the wr80list.h and wr80data.h outside, except for new assembler versions.
 */
 // -----------------------------------------------------------------------------
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700		// strtok_r, fileno, realpath and clock_gettime under -std=c99
+#endif
 #ifndef _INC_STDIO
 #include <stdio.h>
 #endif
@@ -33,36 +36,185 @@
 #ifndef _MATH_H_
 #include <math.h>
 #endif
+#ifndef _STDARG_H
+#include <stdarg.h>
+#endif
+#ifndef _INC_ERRNO
+#include <errno.h>
+#endif
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Threads of the batch assembly and of the includes prefetch
+#ifdef _WIN32
+#ifndef _WINDOWS_
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+typedef HANDLE Wr80Thread;
+#else
+#include <pthread.h>
+typedef pthread_t Wr80Thread;
+#endif
 
 bool calc(const char*, int*, bool);
 
+#include "libwr80asm.h"	// WR80 Assembler embedding interface
 #include "wr80list.h"	// WR80 list Structures for labels, defines and DBs
 #include "wr80data.h"	// WR80 Variables, Structs and Data for Assembler
 #include "astlib.h"		// WR80 AST Library for math expression evaluations
 // -----------------------------------------------------------------------------
 
 
+// FUNCTIONS TO CAPTURE THE MESSAGES OF AN ASSEMBLY
+// -----------------------------------------------------------------------------
+
+// diag_record: Keep the message as a diagnostic of the severity, with the file
+// and the line being assembled when it was printed
+// -----------------------------------------------------------------------------
+void diag_record(int severity, const char* text, int length){
+	while(length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r'))
+		length--;
+	if(length == 0)
+		return;
+	if(diag_count == diag_room){
+		diag_room = (diag_room) ? diag_room * 2 : 16;
+		diag_list = (Wr80Diagnostic*) realloc(diag_list, diag_room * sizeof(Wr80Diagnostic));
+	}
+	char* message = (char*) malloc(length + 1);
+	memcpy(message, text, length);
+	message[length] = '\0';
+	
+	Wr80Diagnostic* diag = &diag_list[diag_count++];
+	diag->severity = severity;
+	diag->file = (!isBuffer && currentfile != NULL) ? strdup(currentfile) : NULL;
+	diag->line = linenum;
+	diag->message = message;
+}
+// -----------------------------------------------------------------------------
+
+// diag_vprint: Print the message or append it to the captured text of the
+// thread, so the batch assemblies show their messages file by file
+// -----------------------------------------------------------------------------
+int diag_vprint(FILE* stream, int severity, const char* format, va_list args){
+	if(!diag_capture || (stream != stdout && stream != stderr))
+		return vfprintf(stream, format, args);
+	
+	va_list copy;
+	va_copy(copy, args);
+	int length = vsnprintf(NULL, 0, format, copy);
+	va_end(copy);
+	if(length < 0)
+		return length;
+	if(diag_size + length + 1 > diag_alloc){
+		diag_alloc = (diag_size + length + 1) * 2;
+		diag_text = (char*) realloc(diag_text, diag_alloc);
+	}
+	vsnprintf(&diag_text[diag_size], length + 1, format, args);
+	if(diag_records)
+		diag_record(severity, &diag_text[diag_size], length);
+	diag_size += length;
+	return length;
+}
+// -----------------------------------------------------------------------------
+
+int diag_printf(const char* format, ...){
+	va_list args;
+	va_start(args, format);
+	int length = diag_vprint(stdout, WR80_NOTE, format, args);
+	va_end(args);
+	return length;
+}
+
+int diag_fprintf(FILE* stream, const char* format, ...){
+	va_list args;
+	va_start(args, format);
+	int length = diag_vprint(stream, WR80_NOTE, format, args);
+	va_end(args);
+	return length;
+}
+
+int diag_warning(FILE* stream, const char* format, ...){
+	va_list args;
+	va_start(args, format);
+	int length = diag_vprint(stream, WR80_WARNING, format, args);
+	va_end(args);
+	return length;
+}
+
+int diag_error(FILE* stream, const char* format, ...){
+	va_list args;
+	va_start(args, format);
+	int length = diag_vprint(stream, WR80_ERROR, format, args);
+	va_end(args);
+	return length;
+}
+
+void diag_perror(const char* msg){
+	diag_error(stderr, "%s: %s\n", msg, strerror(errno));
+}
+// -----------------------------------------------------------------------------
+
+// diag_begin: Start capturing the messages of the thread
+// -----------------------------------------------------------------------------
+void diag_begin(){
+	diag_capture = true;
+	diag_size = 0;
+	if(diag_text != NULL)
+		diag_text[0] = '\0';
+}
+// -----------------------------------------------------------------------------
+
+// diag_end: Stop the capture, returning the captured text (freed by caller)
+// -----------------------------------------------------------------------------
+char* diag_end(){
+	char* text = (diag_text != NULL) ? diag_text : strdup("");
+	diag_capture = false;
+	diag_text = NULL;
+	diag_size = diag_alloc = 0;
+	return text;
+}
+// -----------------------------------------------------------------------------
+
+
 // FUNCTIONS TO WARNING AND ERROR MESSAGES
 // -----------------------------------------------------------------------------
 void printerr(const char* msg){
+	memo_pure = false;
 	if(!isBuffer)
-		printf("%s -> Error: Syntax error at line %d - %s\n", currentfile, linenum, msg);
+		diag_error(stdout, "%s -> Error: Syntax error at line %d - %s\n", currentfile, linenum, msg);
 	else
-		printf("Error: Syntax error at line %d - %s\n", linenum, msg);
+		diag_error(stdout, "Error: Syntax error at line %d - %s\n", linenum, msg);
 }
 
 void printwarn(const char* msg){
+	memo_pure = false;
 	if(!isBuffer)
-		printf("%s -> Warning: %s at line %d.\n", currentfile, msg, linenum);
+		diag_warning(stdout, "%s -> Warning: %s at line %d.\n", currentfile, msg, linenum);
 	else
-		printf("Warning: %s at line %d.\n", msg, linenum);
+		diag_warning(stdout, "Warning: %s at line %d.\n", msg, linenum);
 }
 
 void error(const char* msg){
+	memo_pure = false;
 	if(!isBuffer)
-		printf("%s -> %s: error at line %d - %s\n", currentfile, mnemonic, linenum, msg);
+		diag_error(stdout, "%s -> %s: error at line %d - %s\n", currentfile, mnemonic, linenum, msg);
 	else
-		printf("%s: error at line %d - %s\n", mnemonic, linenum, msg);
+		diag_error(stdout, "%s: error at line %d - %s\n", mnemonic, linenum, msg);
+}
+// -----------------------------------------------------------------------------
+
+// code_room: Check if the bytes fit in the 64K of the code memory, reporting
+// the line that would write past it
+// -----------------------------------------------------------------------------
+bool code_room(long length){
+	if(code_index + length <= MEMORY_EMULATOR)
+		return true;
+	printerr("The code exceeds the 64K of memory");
+	return false;
 }
 // -----------------------------------------------------------------------------
 
@@ -73,18 +225,22 @@ bool create_label(char* label, int addr){
 		if(lab == NULL){
 			label_list = insertlab(label_list, linenum, label, addr);	// 0x0000
 			label_list->refs = NULL;
+			symbol_created(label);
+			memo_pure = false;
+			if(pch_recording)
+				pch_list = insertpch(pch_list, PCH_LABEL, linenum, label, NULL, NULL);
 		}else{
 			if(!isBuffer)
-				printf("%s -> Error: This label '%s' at line %d is already defined at line %d.", currentfile, lab->name, linenum, lab->line);
+				diag_error(stdout, "%s -> Error: This label '%s' at line %d is already defined at line %d.", currentfile, lab->name, linenum, lab->line);
 			else
-				printf("Error: This label '%s' at line %d is already defined at line %d.", lab->name, linenum, lab->line);
+				diag_error(stdout, "Error: This label '%s' at line %d is already defined at line %d.", lab->name, linenum, lab->line);
 			return false;
 		}
 	}else{
 		if(!isBuffer)
-			printf("%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, def->name, linenum, def->line);
+			diag_error(stdout, "%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, def->name, linenum, def->line);
 		else
-			printf("Error: This name '%s' at line %d is already defined at line %d.", def->name, linenum, def->line);
+			diag_error(stdout, "Error: This name '%s' at line %d is already defined at line %d.", def->name, linenum, def->line);
 		return false;
 	}
 	return true;
@@ -112,26 +268,31 @@ void free_operand(){
 
 // FUNCTIONS TO FORMAT LINE AND OPERANDS
 // -----------------------------------------------------------------------------
-// format_line: This function convert tab in spaces, lowercase to uppercase and
-// clear the lines break char
-void format_line(){
-	int pos = strcspn(line, "\n");
-	if(isBuffer && line[pos-1] == 0x0D){
-		line[pos] = '\0';
-		line[pos-1] = '\0';	
+// format_text: This function convert tab in spaces, lowercase to uppercase and
+// clear the lines break char (with the CR char if it's a buffer line)
+void format_text(char* text, bool crlf){
+	int pos = strcspn(text, "\n");
+	if(crlf && pos > 0 && text[pos-1] == 0x0D){
+		text[pos] = '\0';
+		text[pos-1] = '\0';	
 	}else{
-		line[pos] = '\0';
+		text[pos] = '\0';
 	}
 	bool isQuote = false;
-	for(int i = 0; i < strlen(line); i++){
-		isQuote = line[i] == '"' ^ isQuote;
-		if(line[i] == 0x09)
-			line[i] = 0x20;
-		else if(line[i] > 0x60 && line[i] < 0x7B && !isQuote)
-				line[i] -= 0x20;
+	for(int i = 0; text[i] != '\0'; i++){
+		isQuote = (text[i] == '"') ^ isQuote;
+		if(text[i] == 0x09)
+			text[i] = 0x20;
+		else if(text[i] > 0x60 && text[i] < 0x7B && !isQuote)
+				text[i] -= 0x20;
 	}
 }
 
+// format_line: format the current line read
+void format_line(){
+	format_text(line, isBuffer);
+}
+
 void line_to_upper(){
 	int linesize = strlen(line);
 	for(int i = 0; i < linesize; i++){
@@ -179,8 +340,13 @@ void free_vector(char** vector, int size){
 // proc_org: Organize and Allocate memory intervals filling with Zeros (alignment)
 // -----------------------------------------------------------------------------
 void proc_org(){
+	memo_pure = false;
 	if(alloc){
 		org_num = 0;
+		if(code_index <= number && !code_room(number - code_index)){
+			directive_error = true;
+			return;
+		}
 		if(code_index <= number){
 			for(; code_index < number; code_index++){
 				code_address[code_index] = 0x00;
@@ -195,6 +361,9 @@ void proc_org(){
 }
 // -----------------------------------------------------------------------------
 
+// proc_rep: Repeat the block assembling its compiled body. When the first
+// iteration is position independent, the others are copies of its bytes
+// -----------------------------------------------------------------------------
 void proc_rep(){
 	int linetmp1 = linenum + 1;	// 2
 	
@@ -202,33 +371,60 @@ void proc_rep(){
 	char* repcode = (isBuffer) 	? get_code_buffer(block[REP_I].begin, block[REP_I].end, &bufferget)
 								: get_code(block[REP_I].begin, block[REP_I].end);
 	
+	MacroTemplate tmpl;
+	bool compiled = compile_template(&tmpl, repcode, NULL);
+	free(repcode);
+	
 	linenum = linetmp1;
-	unsigned char* code;
 	int codesize = number;
+	ExpansionList* exp = NULL;
+	bool memoize = !memo_recording && curr_refer == NULL && !isExport;
+	
 	for(int i = 0; i < codesize; i++){
-		int linetmp = linenum;
+		if(!push_context(CTX_REP)){
+			directive_error = true;
+			break;
+		}
 		linebegin = linetmp1;
 		linesrc = linenum;
-		const char* buffer = bufferget;
-		//printf("repcode: %s\n", repcode);
-		bool assembled = (repcode != NULL) 	? assemble_buffer(repcode, &code, false)
-											: false;
-		repstate = true;
-		bufferget = buffer;
+		bool ifstate_tmp = ifstate;
+		bool assembled = false;
 		
-		linenum = linetmp;
+		if(exp != NULL && memo_replay(exp)){
+			assembled = true;
+			isBuffer = false;
+		}else if(tmpl.body != NULL && compiled){
+			int code_start = code_index;
+			if(memoize && i == 0)
+				memo_begin();
+			assembled = assemble_template(&tmpl, false);
+			if(memoize && i == 0){
+				exp = memo_capture(0, NULL, code_start, assembled);
+				// the copies need the same states that the first iteration found
+				if(exp != NULL && (ifstate != ifstate_tmp || curr_refer != NULL)){
+					freeexp(exp);
+					exp = NULL;
+				}
+			}
+		}
+		repstate = true;
+		pop_context();
 		if(!assembled){
 			directive_error = !assembled;
-			return;
+			break;
 		}
 	}
+	
+	freeexp(exp);
+	freetmpl(&tmpl);
 }
+// -----------------------------------------------------------------------------
 
 // proc_dcb: Allocate data byte or data word
 // -----------------------------------------------------------------------------
 /*
 void proc_dcb(){
-	token = strtok(NULL, " ");
+	token = strtok_r(NULL, " ", &strtok_save);
 	operand = token;
 	
 	int comm_index = strcspn(token, ";");
@@ -329,7 +525,7 @@ void proc_dcb(){
 
 void proc_dcb()
 {
-    token = strtok(NULL, "");
+    token = strtok_r(NULL, "", &strtok_save);
     if (!token) return;
 
     operand = token;
@@ -338,12 +534,18 @@ void proc_dcb()
     int comm = strcspn(token, ";");
     token[comm] = '\0';
 
+    /* Argumentos da macro */
+    char args[MAX_LINE_LENGTH];
+    int argstate = get_arg(token, args, sizeof(args));
+    if (!argstate) return;
+    if (argstate != -1) token = args;
+
     char value[1024] = {0};
     int length = 0;
 
     bool isDW = (mnemonic_index == 53);
 
-    char *item = strtok(token, ",");
+    char *item = strtok_r(token, ",", &strtok_save);
 
     while (item)
     {
@@ -356,7 +558,7 @@ void proc_dcb()
         }
 
         if (*item == '\0') {
-            item = strtok(NULL, ",");
+            item = strtok_r(NULL, ",", &strtok_save);
             continue;
         }
 
@@ -369,7 +571,7 @@ void proc_dcb()
                 value[length++] = *item++;
             }
 
-            item = strtok(NULL, ",");
+            item = strtok_r(NULL, ",", &strtok_save);
             continue;
         }
 
@@ -390,14 +592,6 @@ void proc_dcb()
         /* Trim novamente aps < ou > */
         while (*item == ' ' || *item == '\t') item++;
 
-        /* get_arg (mantido conforme pedido) */
-        int argstate = get_arg(item);
-        if (argstate != -1) {
-            if (!argstate) return;
-            item = strtok(NULL, ",");
-            continue;
-        }
-		
         /* Avaliao da expresso */
         int result = 0;
         if (!calc(item, &result, true)) {
@@ -426,7 +620,7 @@ void proc_dcb()
                 value[length++] = result & 0xFF;
         }
 
-        item = strtok(NULL, ",");
+        item = strtok_r(NULL, ",", &strtok_save);
     }
 
 	dcb_index = length;
@@ -441,11 +635,15 @@ void proc_define(){
 	int pos = 1;
 	char* name = NULL;
 	char* value = NULL;
+	char args[MAX_LINE_LENGTH];
 	
 	while(token != NULL){
-		token = strtok(NULL, " ");
-		if(token != NULL && isMacroScope) 
-			if(!get_arg(token)) return;
+		token = strtok_r(NULL, " ", &strtok_save);
+		if(token != NULL && isMacroScope){
+			int argstate = get_arg(token, args, sizeof(args));
+			if(!argstate) return;
+			if(argstate != -1) token = args;
+		}
 		
 		switch(pos){
 			case 1:	name = strdup(token);
@@ -479,7 +677,14 @@ void proc_define(){
 			
 		pos++;
 	}
-	
+	define_symbol(name, value);
+}
+// -----------------------------------------------------------------------------
+
+// define_symbol: Check the name and store the definition with its value
+// calculated when possible. The name and the value are freed
+// -----------------------------------------------------------------------------
+void define_symbol(char* name, char* value){
 	bool isNum = name[0] > 0x30 && name[0] <= 0x39;
 	bool isSymbol = false;
 	for(int i = 0; i < strlen(name); i++)
@@ -494,32 +699,34 @@ void proc_define(){
 	DefineList* def = getdef(define_list, name);
 	if(def != NULL){
 		if(!isBuffer)
-			printf("%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, def->name, linenum, def->line);
+			diag_error(stdout, "%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, def->name, linenum, def->line);
 		else
-			printf("Error: This name '%s' at line %d is already defined at line %d.", def->name, linenum, def->line);
+			diag_error(stdout, "Error: This name '%s' at line %d is already defined at line %d.", def->name, linenum, def->line);
 		directive_error = true;
 		return;
 	}else{
 		LabelList* lab = getLabelByName(label_list, name);
 		if(lab != NULL){
 			if(!isBuffer)
-				printf("%s -> Error: This label '%s' at line %d is already defined at line %d.", currentfile, lab->name, linenum, lab->line);
+				diag_error(stdout, "%s -> Error: This label '%s' at line %d is already defined at line %d.", currentfile, lab->name, linenum, lab->line);
 			else
-				printf("Error: This label '%s' at line %d is already defined at line %d.", lab->name, linenum, lab->line);
+				diag_error(stdout, "Error: This label '%s' at line %d is already defined at line %d.", lab->name, linenum, lab->line);
 			directive_error = true;
 			return;
 		}else{
 			MacroList* macro = getMacroByName(macro_list, name);
 			if(macro != NULL){
 				if(!isBuffer)
-					printf("%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, macro->name, linenum, macro->line);
+					diag_error(stdout, "%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, macro->name, linenum, macro->line);
 				else
-					printf("Error: This name '%s' at line %d is already defined at line %d.", macro->name, linenum, macro->line);
+					diag_error(stdout, "Error: This name '%s' at line %d is already defined at line %d.", macro->name, linenum, macro->line);
 				directive_error = true;
 				return;
 			}
 		}
 	}
+	if(pch_recording)
+		pch_list = insertpch(pch_list, PCH_DEFINE, linenum, name, value, NULL);
 		
 	bool finish = false;
 	
@@ -535,6 +742,8 @@ void proc_define(){
 
 			if(!calc(value, &number_res, false)) {
 				define_list = insertdef(define_list, linenum, name, NULL, value);
+				symbol_created(name);
+				memo_pure = false;
 				finish = true;
 			}else{
 				char result[10] = {0};
@@ -550,6 +759,8 @@ void proc_define(){
 		return;
 	}
 	define_list = insertdef(define_list, linenum, name, value, NULL);
+	symbol_created(name);
+	memo_pure = false;
 	free(name);
 	free(value);
 }
@@ -559,30 +770,49 @@ void proc_define(){
 // -----------------------------------------------------------------------------
 void proc_include(){
 	char file_name[128] = {0};
-	token = strtok(NULL, "\"");
+	memo_pure = false;
+	token = strtok_r(NULL, "\"", &strtok_save);
+	
+	// INCLUDE ONCE "file": the word is before the quoted name
+	const char* word = (token != NULL && token[-1] != '"') ? token + strspn(token, " \r") : NULL;
+	bool once = word != NULL && strncmp(word, "ONCE", 4) == 0 && word[4 + strspn(&word[4], " \r")] == '\0';
+	if(once)
+		token = strtok_r(NULL, "\"", &strtok_save);
 
 	if (token == NULL) {
-		fprintf(stderr, "Error: empty file name in include directive.\n");
+		diag_error(stderr, "Error: empty file name in include directive.\n");
 		directive_error = true;
 		return;
 	}
 
-	int result = get_arg(token);
+	char args[MAX_LINE_LENGTH];
+	int result = get_arg(token, args, sizeof(args));
 	if(!result){
 		return;
 	}else if(result != -1){
-		token = strtok(token, "\"");	
+		token = strtok_r(args, "\"", &strtok_save);	
+	}
+	strncpy(file_name, resolve_path(token), sizeof(file_name) - 1);
+	if(once_skip(file_name, once)){
+		isInclude = false;
+		return;
 	}
-	strncpy(file_name, token, strlen(token) + 1);
+	if(pch_recording && !isInclude)
+		pch_list = insertpch(pch_list, PCH_INCLUDE, linenum, file_name, (once) ? "ONCE" : NULL, NULL);
 
     long file_size = 0;
 	int linetemp = linenum;
 	char* filetemp = currentfile;
 	bool mounted = false;
-	if(!isInclude){
+	currentfile = file_name;
+	int snapshot = pch_include(file_name, isInclude);
+	if(snapshot != -1){
+		mounted = snapshot == 1;
+		isInclude = false;
+	}else if(!isInclude){
 		if(isBuffer){
 			linebegin = 1;
-			char *source_code = load_file_to_buffer(file_name, &file_size);
+			char *source_code = load_source(file_name, &file_size);
 			if(file_size)
 			    mounted = preprocess_buffer(source_code, isVerbose);
 			free(source_code);
@@ -593,9 +823,13 @@ void proc_include(){
 		}
 	}else{
 		unsigned char* machinecode = NULL;
-		if(isBuffer){
+		RegionMark mark;
+		if(region_enter(file_name, &mark)){
+			mounted = true;
+			machinecode = code_address;
+		}else if(isBuffer){
 			linebegin = 1;
-			char *source_code = load_file_to_buffer(file_name, &file_size);
+			char *source_code = load_source(file_name, &file_size);
 			if(file_size)
 			    mounted = assemble_buffer(source_code, &machinecode, isVerbose);
 			free(source_code);
@@ -604,17 +838,18 @@ void proc_include(){
 			mounted = assemble_file(file_name, &machinecode, isVerbose);
 			//printf("assembled? = %d\n", mounted);
 		}
+		region_leave(file_name, &mark, mounted);
 		isInclude = false;
 		if(isVerbose) {
 			hex_dump(machinecode);
-			printf("\n");	
+			diag_printf("\n");	
 		}
 	}
 	linenum = linetemp;
 	currentfile = filetemp;
 	
 	if (!mounted) {
-		fprintf(stderr, "Error: error in assemble the included file: %s\n", file_name);
+		diag_error(stderr, "Error: error in assemble the included file: %s\n", file_name);
 		directive_error = true;
 	}
 }
@@ -625,23 +860,31 @@ void proc_include(){
 void proc_includeb(){
 	char file_name[128] = {0};
 	long file_size = 0;
-	token = strtok(NULL, "\"");
+	memo_pure = false;
+	token = strtok_r(NULL, "\"", &strtok_save);
 
 	if (token == NULL) {
-		fprintf(stderr, "Error: empty file name in include directive.\n");
+		diag_error(stderr, "Error: empty file name in include directive.\n");
 		directive_error = true;
 		return;
 	}
 
-	int result = get_arg(token);
+	char args[MAX_LINE_LENGTH];
+	int result = get_arg(token, args, sizeof(args));
 	if(!result){
 		return;
 	}else if(result != -1){
-		token = strtok(token, "\"");	
+		token = strtok_r(args, "\"", &strtok_save);	
 	}
 	
-	strncpy(file_name, token, strlen(token) + 1);
+	strncpy(file_name, resolve_path(token), sizeof(file_name) - 1);
+	add_source(file_name, SRC_BINARY);
 	char *binary_data = load_file_to_buffer(file_name, &file_size);
+	if(binary_data != NULL && !code_room(file_size)){
+		free(binary_data);
+		directive_error = true;
+		return;
+	}
 	memcpy(&code_address[code_index], binary_data, file_size);
 	code_index += file_size;
 	free(binary_data);
@@ -651,7 +894,8 @@ void proc_includeb(){
 // proc_export: Export a label function externally
 // -----------------------------------------------------------------------------
 void proc_export(){
-	token = strtok(NULL, " ");
+	memo_pure = false;
+	token = strtok_r(NULL, " ", &strtok_save);
 	
 	if(token != NULL){
 		int size_str = strlen(token) + 1;
@@ -660,20 +904,42 @@ void proc_export(){
 		wll_counter++;
 		label_pointer = (char**) realloc(label_pointer, wll_counter * sizeof(char*));
 		label_pointer[wll_counter - 1] = strdup(token);
+		if(pch_recording)
+			pch_list = insertpch(pch_list, PCH_EXPORT, linenum, token, NULL, NULL);
 	}else{
-		fprintf(stderr, "Error: empty label name for export\n");
+		diag_error(stderr, "Error: empty label name for export\n");
+		directive_error = true;
+	}
+}
+// -----------------------------------------------------------------------------
+
+// proc_pragma: Option of the file for the preprocessor. PRAGMA ONCE includes
+// the file only once, skipping its next includes
+// -----------------------------------------------------------------------------
+void proc_pragma(){
+	token = strtok_r(NULL, " \r;", &strtok_save);
+	
+	if(token == NULL || strcmp(token, "ONCE") != 0){
+		diag_error(stderr, "Error: unknown pragma '%s'\n", (token != NULL) ? token : "");
 		directive_error = true;
+		return;
 	}
+	if(currentfile == NULL)
+		return;
+	once_file(currentfile)->pragma = true;
+	if(pch_recording)
+		pch_list = insertpch(pch_list, PCH_ONCE, linenum, currentfile, NULL, NULL);
 }
 // -----------------------------------------------------------------------------
 
 // proc_import: Import a label function externally
 // -----------------------------------------------------------------------------
 void proc_import(){
-	token = strtok(NULL, "\" ,\t\r\n");
+	memo_pure = false;
+	token = strtok_r(NULL, "\" ,\t\r\n", &strtok_save);
 	
 	if (token == NULL) {
-		fprintf(stderr, "Error: empty label name for import\n");
+		diag_error(stderr, "Error: empty label name for import\n");
 		directive_error = true;
 		return;
 	}
@@ -692,8 +958,8 @@ void proc_import(){
 	
 	while(token != NULL){
 		imported_files = (char**) realloc(imported_files, ++files_counter * sizeof(char*));
-		imported_files[files_counter - 1] = strdup(token);
-		token = strtok(NULL, "\" ,\t\r\n");
+		imported_files[files_counter - 1] = strdup(resolve_path(token));
+		token = strtok_r(NULL, "\" ,\t\r\n", &strtok_save);
 		//printf("file: '%s'\n", imported_files[files_counter - 1]);
 	}
 	file_data = (char**) malloc(files_counter * sizeof(char*));
@@ -703,10 +969,10 @@ void proc_import(){
 	char* import_data = get_code(block[IMP_I].begin, block[IMP_I].end);
 	linenum = linetmp;
 	
-	token = strtok(import_data, " ,\t\r\n");
+	token = strtok_r(import_data, " ,\t\r\n", &strtok_save);
 	while(token != NULL){
 		if(strcmp(token, "AS") == 0){
-			token = strtok(NULL, " ,\t\r\n");
+			token = strtok_r(NULL, " ,\t\r\n", &strtok_save);
 			is_as_command = true;
 			continue;		
 		}
@@ -722,7 +988,7 @@ void proc_import(){
 			is_as_command = false;
 		}
 		
-		token = strtok(NULL, " ,\t\r\n");
+		token = strtok_r(NULL, " ,\t\r\n", &strtok_save);
 	}
 	
 	symbols_found = (int*) malloc(symbols_counter * sizeof(int));
@@ -734,8 +1000,10 @@ void proc_import(){
 		for(int i = 0; i < files_counter; ){
 			bool func_found = false;
 			
-			if(!file_data[i])
+			if(!file_data[i]){
+				add_source(imported_files[i], SRC_LIBRARY);
 				file_data[i] = load_file_to_buffer(imported_files[i], &size);
+			}
 				
 			if(file_data[i][0] == 'W' && file_data[i][1] == 'L' && file_data[i][2] == 'L'){
 				int funcs_count = file_data[i][3];
@@ -767,6 +1035,10 @@ void proc_import(){
 						}
 						int code_addr = ((file_data[i][index + 3] & 0xFF) << 8) | (file_data[i][index + 2] & 0xFF);
 						int code_size = ((file_data[i][index + 5] & 0xFF) << 8) | (file_data[i][index + 4] & 0xFF);
+						if(!code_room(code_size)){
+							directive_error = true;
+							return;
+						}
 						memcpy(&code_address[code_index], &file_data[i][code_addr], code_size);
 						code_index += code_size;
 						break;
@@ -778,7 +1050,7 @@ void proc_import(){
 					continue;
 				
 			}else{
-				printf("Error: Invalid WLL File - No Signature.");
+				diag_error(stdout, "Error: Invalid WLL File - No Signature.");
 				directive_error = true;
 				return;
 			} // if signature valid
@@ -787,7 +1059,7 @@ void proc_import(){
 				break;
 			}else{
 				if(i == files_counter - 1){
-					printf("Error: Symbol '%s' not found in '%s' file", imported_symbols[j], imported_files[i]);
+					diag_error(stdout, "Error: Symbol '%s' not found in '%s' file", imported_symbols[j], imported_files[i]);
 					directive_error = true;
 					return;
 				}
@@ -821,6 +1093,7 @@ void proc_import(){
 // proc_endx: Finish export command
 // -----------------------------------------------------------------------------
 void proc_endx(){
+	memo_pure = false;
 	int code_size = (code_index + org_num) - wll_code_start;
 	code_address[4 + 6 * wll_index + 4] = (code_size & 0xFF);
 	code_address[4 + 6 * wll_index + 5] = (code_size & 0xFF00) >> 8;
@@ -829,6 +1102,43 @@ void proc_endx(){
 }
 // -----------------------------------------------------------------------------
 
+// macro_conflict: Check if the macro name is already used by a macro with the
+// same arguments count, a label or a define, printing the error
+// -----------------------------------------------------------------------------
+bool macro_conflict(char* name, int argc){
+	MacroList* macro = getMacroByNameA(macro_list, name, argc);
+	if(macro != NULL){
+		if(!isBuffer)
+			diag_error(stdout, "%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, macro->name, linenum, macro->line);
+		else
+			diag_error(stdout, "Error: This name '%s' at line %d is already defined at line %d.", macro->name, linenum, macro->line);
+		directive_error = true;
+		return true;
+	}else{
+		LabelList* lab = getLabelByName(label_list, name);
+		if(lab != NULL){
+			if(!isBuffer)
+				diag_error(stdout, "%s -> Error: This label '%s' at line %d is already defined at line %d.", currentfile, lab->name, linenum, lab->line);
+			else
+				diag_error(stdout, "Error: This label '%s' at line %d is already defined at line %d.", lab->name, linenum, lab->line);
+			directive_error = true;
+			return true;
+		}else{
+			DefineList* def = getdef(define_list, name);
+			if(def != NULL){
+				if(!isBuffer)
+					diag_error(stdout, "%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, def->name, linenum, def->line);
+				else
+					diag_error(stdout, "Error: This name '%s' at line %d is already defined at line %d.", def->name, linenum, def->line);
+				directive_error = true;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+// -----------------------------------------------------------------------------
+
 // proc_macro: Store Macros in lists for replacement
 // -----------------------------------------------------------------------------
 void proc_macro(){
@@ -846,7 +1156,7 @@ void proc_macro(){
 		
 		switch(pos){
 			case 1:{
-				token = strtok(NULL, " ");
+				token = strtok_r(NULL, " ", &strtok_save);
 				if(token == NULL) break;
 				int len = strlen(token);
 				name = malloc(len + 1);
@@ -878,7 +1188,7 @@ void proc_macro(){
 			}
 		}
 		
-		token = strtok(NULL, ",");
+		token = strtok_r(NULL, ",", &strtok_save);
 		pos++;
 	}
 	
@@ -899,38 +1209,23 @@ void proc_macro(){
 		return;
 	}
 	
-	MacroList* macro = getMacroByNameA(macro_list, name, argc);
-	if(macro != NULL){
-		if(!isBuffer)
-			printf("%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, macro->name, linenum, macro->line);
-		else
-			printf("Error: This name '%s' at line %d is already defined at line %d.", macro->name, linenum, macro->line);
-		directive_error = true;
+	if(macro_conflict(name, argc))
 		return;
-	}else{
-		LabelList* lab = getLabelByName(label_list, name);
-		if(lab != NULL){
-			if(!isBuffer)
-				printf("%s -> Error: This label '%s' at line %d is already defined at line %d.", currentfile, lab->name, linenum, lab->line);
-			else
-				printf("Error: This label '%s' at line %d is already defined at line %d.", lab->name, linenum, lab->line);
-			directive_error = true;
-			return;
-		}else{
-			DefineList* def = getdef(define_list, name);
-			if(def != NULL){
-				if(!isBuffer)
-					printf("%s -> Error: This name '%s' at line %d is already defined at line %d.", currentfile, def->name, linenum, def->line);
-				else
-					printf("Error: This name '%s' at line %d is already defined at line %d.", def->name, linenum, def->line);
-				directive_error = true;
-				return;
-			}
-		}
-	}
 
 	code = get_code(block[MACRO_I].begin, block[MACRO_I].end);
 	macro_list = insertmac(macro_list, argc, name, pnames, code, linen);	// LEAK: Fluxo
+	symbol_created(name);
+	memo_pure = false;
+	if(macro_list != NULL){
+		if(!compile_template(&macro_list->tmpl, macro_list->content, macro_list)){
+			printerr("Cannot compile the macro body");
+			directive_error = true;
+		}
+		free(macro_list->content);
+		macro_list->content = NULL;
+		if(pch_recording)
+			pch_list = insertpch(pch_list, PCH_MACRO, linen, name, NULL, macro_list);
+	}
 	if(name != NULL) free(name);
 	if(code != NULL) free(code);
 }
@@ -953,76 +1248,223 @@ void assemble_if(int cmd_i){
 	
 	//if(isMacroScope) printf("Assemblando IF... code -> %s\n", ifcode); //debug
 	linenum = linetmp1;
-	int linetmp = linenum;
 	linebegin = linetmp1;
 	linesrc = linenum;
 	unsigned char* code;
-	const char* buffer = bufferget;
-
-	bool assembled = (ifcode != NULL) 	? assemble_buffer(ifcode, &code, isVerbose)
-										: false;
+	
+	bool assembled = false;
+	if(push_context(CTX_IF)){
+		assembled = (ifcode != NULL) ? assemble_buffer(ifcode, &code, isVerbose) : false;
+		pop_context();
+	}
 	ifstate = true;
 	hasif = true;
-	bufferget = buffer;
-	linenum = linetmp;
 	//printf("assembled: %d\n", assembled); //debug
 	directive_error = !assembled;
 	free(ifcode);
 	ifcode = NULL;
 }
 
-bool getIfValue(char** name1) {
-	token = *name1;
-	int i = (token[0] == '!') ? 1 : 0;
-			
-	get_arg(&token[i]);
+bool check_number(const char* name, int* num){
+	*num = strtol(name, &endptr, 10);
+	if(*endptr != '\0') return false;
+	return true;
+}
+
+// resolve_cond: Resolve an IF operand as the define, label, macro or argument
+// value. The operand is defined when it is any of these names
+// -----------------------------------------------------------------------------
+void resolve_cond(const char* name, CondValue* value){
+	char args[MAX_LINE_LENGTH];
+	const char* text = name;
+	if(get_arg(text, args, sizeof(args)) == 1)
+		text = args;
 
-	i = (token[0] == '!') ? 1 : 0;
-	
 	int param = -1;
 	if (isMacroScope)
-		param = getArgIndex(&token[i]);
-		
-	DefineList* defines = getdef(define_list, (char*)&token[i]);
-	LabelList* labels = (defines == NULL) ? getLabelByName(label_list, (char*)&token[i]) : NULL;
-	MacroList* macros = (labels == NULL) ? getMacroByName(macro_list, (char*)&token[i]) : NULL;
-	
-	char* new_value = NULL;
+		param = getArgIndex(text);
+
+	DefineList* defines = getdef(define_list, (char*)text);
+	LabelList* labels = (defines == NULL) ? getLabelByName(label_list, (char*)text) : NULL;
+	MacroList* macros = (labels == NULL) ? getMacroByName(macro_list, (char*)text) : NULL;
+
+	char number[32];
+	const char* new_value = text;
 	if (defines != NULL) {
-		new_value = (defines->refs[0] == 0) ? strdup(defines->value) : strdup(defines->refs);
+		new_value = (defines->refs[0] == 0) ? defines->value : defines->refs;
 	}
 	else if (macros != NULL) {
-		new_value = strdup(macros->name);
+		new_value = macros->name;
 	}
 	else if (labels != NULL) {
-		new_value = strdup(itoa(labels->addr, endptr, 10));
+		memo_pure = false;
+		snprintf(number, sizeof(number), "%d", labels->addr);
+		new_value = number;
 	}
 	else if (param != -1) {
-		new_value = strdup(currmacro->pvalues[param]);
+		new_value = currframe->args[param];
 	}
-	else {
-		new_value = strdup(&token[i]);
+
+	if(get_arg(new_value, value->text, MAX_LINE_LENGTH) != 1)
+		snprintf(value->text, MAX_LINE_LENGTH, "%s", new_value);
+
+	value->isNum = check_number(value->text, &value->num);
+	value->isNaN = strcmp(value->text, "#$") == 0;
+	value->defined = defines != NULL || labels != NULL || macros != NULL || param != -1;
+}
+// -----------------------------------------------------------------------------
+
+// emit_cond: Write the condition tree in postfix order, moving its names
+// -----------------------------------------------------------------------------
+int emit_cond(AST* node, CondCode* code, int index){
+	if(node == NULL)
+		return index;
+	if(node->type == NODE_DEFINED){
+		code[index].op = NODE_DEFINED;
+		code[index].ident = node->right->ident;
+		node->right->ident = NULL;
+		return index + 1;
 	}
-	
-	// Libera o valor antigo e substitui por new_value
-	if (*name1 != NULL)
-		free(*name1);
-	
-	token = new_value;
-	get_arg(token);
-	*name1 = strdup(token);
-	
-	//printf("MACRO : %s, VALUE: %s\n", currmacro->name, *name1);
+	index = emit_cond(node->left, code, index);
+	index = emit_cond(node->right, code, index);
+	int num = 0;
+	code[index].op = (node->type == NODE_IDENT && check_number(node->ident, &num)) ? NODE_NUM : node->type;
+	code[index].ident = node->ident;
+	node->ident = NULL;
+	return index + 1;
+}
+// -----------------------------------------------------------------------------
+
+int count_cond(AST* node){
+	if(node == NULL)
+		return 0;
+	if(node->type == NODE_DEFINED)
+		return 1;
+	return count_cond(node->left) + count_cond(node->right) + 1;
+}
+// -----------------------------------------------------------------------------
+
+// compile_cond: Get the compiled IF condition, parsing it only on the first
+// evaluation of the text. Returns NULL on syntax errors
+// -----------------------------------------------------------------------------
+CondList* compile_cond(const char* text){
+	unsigned int hash = 5381;
+	for(const char* c = text; *c != '\0'; c++)
+		hash = hash * 33 + (unsigned char) *c;
+
+	CondList* cond = getcond(cond_list, hash, text);
+	if(cond != NULL)
+		return cond;
+
+	AST* tree = parse_condition(text);
+	if(parse_failed){
+		free_ast(tree);
+		return NULL;
+	}
+	int count = count_cond(tree);
+	CondCode* code = (CondCode*) malloc(count * sizeof(CondCode));
+	emit_cond(tree, code, 0);
+	free_ast(tree);
+
+	cond_list = insertcond(cond_list, hash, text, code, count);
+	cond_list->stack = (CondValue*) malloc(count * sizeof(CondValue));
+	cond_list->texts = (char*) malloc(count * MAX_LINE_LENGTH);
+	return cond_list;
+}
+// -----------------------------------------------------------------------------
+
+// set_cond: Store an integer result of the condition operations
+// -----------------------------------------------------------------------------
+void set_cond(CondValue* value, int num){
+	value->num = num;
+	value->isNum = true;
+	value->isNaN = false;
+	value->defined = num != 0;
+	snprintf(value->text, MAX_LINE_LENGTH, "%d", num);
+}
+// -----------------------------------------------------------------------------
+
+// run_cond: Evaluate the compiled condition on a values stack. The names are
+// compared as text, the other operations need both numbers decimal. The stack
+// and its texts belong to the compiled condition
+// -----------------------------------------------------------------------------
+bool run_cond(CondList* cond){
+	CondValue* stack = cond->stack;
+	int top = 0;
+
+	for(int i = 0; i < cond->count; i++){
+		CondCode* code = &cond->code[i];
+
+		if(code->op == NODE_IDENT || code->op == NODE_NUM || code->op == NODE_DEFINED || code->op == NODE_NAN){
+			CondValue* value = &stack[top];
+			value->text = &cond->texts[(top++) * MAX_LINE_LENGTH];
+			if(code->op == NODE_NUM){
+				snprintf(value->text, MAX_LINE_LENGTH, "%s", code->ident);
+				value->isNum = check_number(value->text, &value->num);
+				value->isNaN = false;
+				value->defined = false;
+			}else if(code->op == NODE_NAN){
+				snprintf(value->text, MAX_LINE_LENGTH, "#$");
+				value->isNum = false;
+				value->isNaN = true;
+				value->defined = false;
+			}else{
+				resolve_cond(code->ident, value);
+				if(code->op == NODE_DEFINED)
+					set_cond(value, value->defined);
+			}
+			continue;
+		}
 
-	// Condio booleana
-	bool nameCondition = (!i)
-		? (defines != NULL || labels != NULL || macros != NULL || param != -1)
-		: (defines == NULL && labels == NULL && macros == NULL && param == -1);
+		if(code->op == NODE_NOT || code->op == NODE_NOT_BIT){
+			CondValue* value = &stack[top-1];
+			if(code->op == NODE_NOT)
+				set_cond(value, !value->defined);
+			else
+				set_cond(value, (value->isNum) ? ~value->num : 0);
+			continue;
+		}
+
+		CondValue* a = &stack[top-2];
+		CondValue* b = &stack[--top];
+		bool both_num = a->isNum && b->isNum;
+		int n1 = a->num, n2 = b->num;
+
+		if(a->isNaN || b->isNaN){
+			bool isNum = (a->isNaN) ? b->isNum : a->isNum;
+			set_cond(a, (code->op == NODE_EQUAL) ? !isNum : isNum);
+			continue;
+		}
+
+		switch(code->op){
+			case NODE_EQUAL:	set_cond(a, strcmp(a->text, b->text) == 0); break;
+			case NODE_DIFF:		set_cond(a, strcmp(a->text, b->text) != 0); break;
+			case NODE_AND:		set_cond(a, (both_num && (n1 && n2)) || (a->defined && b->defined)); break;
+			case NODE_OR:		set_cond(a, (both_num && (n1 || n2)) || (a->defined || b->defined)); break;
+			case NODE_GREAT_EQ:	set_cond(a, both_num && (n1 >= n2)); break;
+			case NODE_LESS_EQ:	set_cond(a, both_num && (n1 <= n2)); break;
+			case NODE_GREAT:	set_cond(a, both_num && (n1 > n2)); break;
+			case NODE_LESS:		set_cond(a, both_num && (n1 < n2)); break;
+			case NODE_MOD:		set_cond(a, both_num && n2 != 0 && !(n1 % n2)); break;
+			case NODE_AND_BIT:	set_cond(a, (both_num) ? (n1 & n2) : 0); break;
+			case NODE_OR_BIT:	set_cond(a, (both_num) ? (n1 | n2) : 0); break;
+			case NODE_XOR_BIT:	set_cond(a, (both_num) ? (n1 ^ n2) : 0); break;
+			case NODE_ADD:		set_cond(a, (both_num) ? (n1 + n2) : 0); break;
+			case NODE_SUB:		set_cond(a, (both_num) ? (n1 - n2) : 0); break;
+			case NODE_MUL:		set_cond(a, (both_num) ? (n1 * n2) : 0); break;
+			case NODE_DIV:		set_cond(a, (both_num && n2 != 0) ? (n1 / n2) : 0); break;
+			case NODE_SHT_LEFT:	set_cond(a, (both_num) ? (n1 << n2) : 0); break;
+			case NODE_SHT_RIGHT:set_cond(a, (both_num) ? (n1 >> n2) : 0); break;
+			case NODE_EXP:		set_cond(a, (both_num) ? (int)pow(n1, n2) : 0); break;
+			default:			set_cond(a, 0); break;
+		}
+	}
 
-	return nameCondition;
+	return stack[0].defined;
 }
+// -----------------------------------------------------------------------------
 
-char* tokentmp;
+WR80_TLS char* tokentmp;
 void check_if(bool condition, int cmd_i){
 	if(condition){
 		assemble_if(cmd_i);
@@ -1032,21 +1474,11 @@ void check_if(bool condition, int cmd_i){
 	}
 }
 
-bool check_number(const char* name, int* num){
-	*num = strtol(name, &endptr, 10);
-	if(*endptr != '\0') return false;
-	return true;
-}
-
 // -----------------------------------------------------------------------------
 // IF function
 void proc_if(){
-	int pos = 1;
-	char* name1 = NULL;
-	char* op = NULL;
-	char* name2 = NULL;
 	tokentmp = token;
-	
+
 	if(ifstate){
 		if(isELSE){
 			skip_if(ELSE_I);
@@ -1054,7 +1486,7 @@ void proc_if(){
 			ifstate = false;
 			return;
 		}else{
-			ifstate = false;	
+			ifstate = false;
 		}
 	}else{
 		if(isELSE){
@@ -1064,74 +1496,21 @@ void proc_if(){
 			return;
 		}
 	}
-	
+
 	ifdepth++;
-	while((token = strtok(NULL, " ")) != NULL){
-		switch(pos){
-			case 1: name1 = strdup(token);
-					break;
-			case 2: op = strdup(token);
-					break;
-			case 3: name2 = strdup(token);
-					break;
-		}
-		pos++;
-	}
-//	if(isMacroScope) printf("name1: %s, op: %s, name2: %s\n", name1, op, name2); //debug
-	if(name1 != NULL && op != NULL && name2 != NULL){
-		
-		bool hasName1 = getIfValue(&name1);
-		bool hasName2 = getIfValue(&name2);
-		token = tokentmp;
-		
-		int num1 = 0, num2 = 0;
-		bool both_num = check_number(name1, &num1) && check_number(name2, &num2);
-		
-		if(strcmp(name1, "#$") == 0){
-			bool isNaN = (strcmp(op, "==") == 0) ? !check_number(name2, &num2) : check_number(name2, &num2);
-			check_if(isNaN, IF_I);
-		}else if(strcmp(name2, "#$") == 0){
-			bool isNaN = (strcmp(op, "==") == 0) ? !check_number(name1, &num1) : check_number(name1, &num1);
-			check_if(isNaN, IF_I);
-		}else if(strcmp(op, "==") == 0){
-			check_if(strcmp(name1, name2) == 0, IF_I);
-		}else if(strcmp(op, "!=") == 0){
-			check_if(strcmp(name1, name2) != 0, IF_I);
-		}else if(strcmp(op, ">=") == 0){
-			check_if(both_num && (num1 >= num2), IF_I);
-		}else if(strcmp(op, "<=") == 0){
-			check_if(both_num && (num1 <= num2), IF_I);
-		}else if(strcmp(op, ">") == 0){
-			check_if(both_num && (num1 > num2), IF_I);
-		}else if(strcmp(op, "<") == 0){
-			check_if(both_num && (num1 < num2), IF_I);
-		}else if(strcmp(op, "%") == 0){
-			check_if(both_num && !(num1 % num2), IF_I);
-		}else if(strcmp(op, "&") == 0){
-			check_if(both_num && (num1 & num2), IF_I);
-		}else if(strcmp(op, "&&") == 0){
-			check_if((both_num && (num1 && num2)) || (hasName1 && hasName2), IF_I);
-		}else if(strcmp(op, "|") == 0){
-			check_if(both_num && (num1 | num2), IF_I);
-		}else if(strcmp(op, "||") == 0){
-			check_if((both_num && (num1 || num2)) || (hasName1 || hasName2), IF_I);
-		}else if(strcmp(op, "^") == 0){
-			check_if(both_num && (num1 ^ num2), IF_I);
-		}
-		
-		
-		free(name1);
-		free(op);
-		free(name2);
-	}else{
-		if(op == NULL && name1 != NULL){
-			check_if(getIfValue(&name1), IF_I);
-			free(name1);
-		}else{
-			printerr("Invalid IF operation syntax");
-			return;
-		}
+	char* text = strtok_r(NULL, "", &strtok_save);
+	if(text != NULL)
+		text[strcspn(text, ";")] = '\0';
+
+	CondList* cond = (text != NULL) ? compile_cond(text) : NULL;
+	if(cond == NULL || cond->count == 0){
+		printerr("Invalid IF operation syntax");
+		return;
 	}
+
+	bool condition = run_cond(cond);
+	token = tokentmp;
+	check_if(condition, IF_I);
 }
 // -----------------------------------------------------------------------------
 // dcb_process: allocate physically bytes in code memory by DCB commands
@@ -1139,6 +1518,10 @@ void proc_if(){
 bool dcb_process(){
 	if(isAllocator){
 		DcbList* dcb = getdcb(dcb_list, linenum);
+		if(!code_room(dcb->length)){
+			directive_error = true;
+			return true;
+		}
 		memcpy(&code_address[code_index], dcb->value, dcb->length);
 		code_index += dcb->length;
 		return true;
@@ -1200,10 +1583,12 @@ bool recursive_def(char **value, int *num) {
             label->refs = insertaddr(label->refs, addr_index, isRel, isIMM, isHigh, isDW);
             curr_refer = label->refs;
             curr_refer->isExpression = true;
+            memo_label(label, curr_refer);
             sprintf(buffer, "%d", 0);
         }else{
         	sprintf(buffer, "%d", label->addr);
         	curr_refer = NULL;
+        	memo_label(label, NULL);
 		}
         
 		*value = strdup(buffer);
@@ -1216,8 +1601,8 @@ bool recursive_def(char **value, int *num) {
 // -----------------------------------------------------------------------------
 
 char* replace(const char* token, const char* old_substr, const char* new_substr) {
-    static char* buffer = NULL;
-    static size_t buffer_capacity = 0;
+    static WR80_TLS char* buffer = NULL;
+    static WR80_TLS size_t buffer_capacity = 0;
 
     // Se token aponta para dentro do buffer esttico, precisamos copi-lo
     // para um local temporrio antes de potencialmente free() o buffer.
@@ -1300,7 +1685,10 @@ int replace_name(char* name){
             if(label->addr == 0xFFFF){
                 int addr_index = code_index + dcb_index;
                 label->refs = insertaddr(label->refs, addr_index, isRel, isIMM, isHigh, isDW);
-            }
+                memo_label(label, label->refs);
+            }else{
+            	memo_label(label, NULL);
+			}
             
             curr_refer = label->refs;
 
@@ -1348,19 +1736,18 @@ int replace_name(char* name){
 
 // -----------------------------------------------------------------------------
 
-int getParamIndex(const char* param){
-	if(currmacro->pnames == NULL) return -1;
-	for(int i = 0; i < currmacro->pcount; i++)
-		if(strcmp(currmacro->pnames[i], param) == 0)
+int getParamIndex(MacroList* macro, const char* param){
+	if(macro->pnames == NULL) return -1;
+	for(int i = 0; i < macro->pcount; i++)
+		if(strcmp(macro->pnames[i], param) == 0)
 			return i;
 	return -1;
 }
 
 int getArgIndex(const char* arg){
-	if(currmacro->pvalues == NULL) return -1;
-	int size = (currmacro->pcount == -1) ? currmacro->argsc : currmacro->pcount;
-	for(int i = 0; i < size; i++)
-		if(strcmp(currmacro->pvalues[i], arg) == 0)
+	if(currframe == NULL) return -1;
+	for(int i = 0; i < currframe->argc; i++)
+		if(strcmp(currframe->args[i], arg) == 0)
 			return i;
 	return -1;
 }
@@ -1375,91 +1762,430 @@ int check_register(bool is_gas_syntax){
 	return -1;
 }
 
-char* check_symbol(const char* name){
-	static char argument[32] = {0};
-	memset(argument, 0, 32);
-	int param = 0;
-	switch(name[1]){
-		case '*': 	param = (currmacro->pcount != -1) ? currmacro->pcount : currmacro->argsc;
-					snprintf(argument, sizeof(argument), "%d", param);
-					break;
-		case '+':	param = (currmacro->pcount != -1) ? currmacro->pcount + 1 : currmacro->argsc + 1;
-					snprintf(argument, sizeof(argument), "%d", param);
-					break;
-		case '-':	param = (currmacro->pcount != -1) ? currmacro->pcount - 1 : currmacro->argsc - 1;
-					snprintf(argument, sizeof(argument), "%d", param);
-					break;
-		case '.': {
-			int size = (currmacro->pcount != -1) ? currmacro->pcount : currmacro->argsc;
-			currmacro->indexp = (currmacro->indexp >= size) ? 0 : currmacro->indexp;
-			snprintf(argument, sizeof(argument), "%s", currmacro->pvalues[currmacro->indexp++]);
-			break;
+// subst_put: Append a string on the substitution buffer, return false on overflow
+// -----------------------------------------------------------------------------
+static bool subst_put(char* dest, size_t size, size_t* len, const char* text, size_t textlen){
+	if(*len + textlen >= size){
+		printerr("Line too long after macro arguments substitution");
+		return false;
+	}
+	memcpy(&dest[*len], text, textlen);
+	*len += textlen;
+	dest[*len] = '\0';
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// subst_args: Scan the text once writing to dest all the macro substitutions:
+// #N and #name arguments, the #*, #+, #- counts, the #. and #% cursors and
+// the ## local label counter. The frame is the macro invocation (NULL out of
+// the macro scope leaves the arguments untouched) and counter is the ## sequence
+// (NULL leaves the ## untouched). Quoted texts and #$ are kept as they are.
+// -----------------------------------------------------------------------------
+bool subst_args(const char* src, char* dest, size_t size, MacroFrame* frame, int* counter){
+	char number[32];
+	size_t len = 0;
+	char quote = 0;
+	dest[0] = '\0';
+
+	while(*src != '\0'){
+		if(quote != 0 || *src == '"' || *src == '\'' || *src != '#'){
+			if(quote == 0 && (*src == '"' || *src == '\''))
+				quote = *src;
+			else if(quote == *src)
+				quote = 0;
+			size_t span = (quote != 0) ? 1 : strcspn(src, "#\"'");
+			if(span == 0) span = 1;
+			if(!subst_put(dest, size, &len, src, span)) return false;
+			src += span;
+			continue;
 		}
-		case '#': {
-			snprintf(argument, sizeof(argument), "%d", ((isMacroScope) ? ++currmacro->ilabelB : ++ilabelB));
-			break;
+
+		const char* value = NULL;
+		size_t skip = 2;
+		char symbol = src[1];
+
+		if(symbol == '#'){
+			if(counter != NULL){
+				memo_pure = false;
+				snprintf(number, sizeof(number), "%d", ++(*counter));
+				value = number;
+			}
+		}else if(frame != NULL && symbol != '$' && symbol != '\0'){
+			int argc = frame->argc;
+			if(symbol == '*' || symbol == '+' || symbol == '-'){
+				int count = argc + ((symbol == '+') ? 1 : (symbol == '-') ? -1 : 0);
+				snprintf(number, sizeof(number), "%d", count);
+				value = number;
+			}else if(symbol == '.' || symbol == '%'){
+				memo_pure = false;
+				frame->indexp = (frame->indexp >= argc) ? 0 : frame->indexp;
+				value = frame->args[frame->indexp];
+				if(symbol == '.') frame->indexp++;
+			}else if(symbol >= '0' && symbol <= '9'){
+				char* end = NULL;
+				int arg = strtol(&src[1], &end, 10);
+				skip = end - src;
+				if(arg < 1) arg = 1;
+				if(arg > argc){
+					diag_error(stdout, "%s -> Error at line %d: arg #%d is out of limit bound specified by line %d!\n", currentfile, linenum, arg, linesrc);
+					return false;
+				}
+				value = frame->args[arg-1];
+			}else if(isalpha((unsigned char) symbol) || symbol == '_'){
+				size_t namelen = 1;
+				while(isalnum((unsigned char) src[namelen+1]) || src[namelen+1] == '_')
+					namelen++;
+				char name[namelen+1];
+				memcpy(name, &src[1], namelen);
+				name[namelen] = '\0';
+				int param = getParamIndex(frame->macro, name);
+				if(param == -1){
+					diag_error(stdout, "%s -> Error at line %d: Param '%s' does not exist!\n", currentfile, linenum, name);
+					return false;
+				}
+				value = frame->args[param];
+				skip = namelen + 1;
+			}
 		}
-		case '$': {
-			snprintf(argument, sizeof(argument), "%s", name);
-			break;
+
+		if(value == NULL){
+			// Not a substitution: keep the '#' and its symbol
+			if(!subst_put(dest, size, &len, src, (symbol == '\0') ? 1 : 2)) return false;
+			src += (symbol == '\0') ? 1 : 2;
+			continue;
 		}
-		case '%': {
-			int size = (currmacro->pcount != -1) ? currmacro->pcount : currmacro->argsc;
-			currmacro->indexp = (currmacro->indexp >= size) ? 0 : currmacro->indexp;
-			snprintf(argument, sizeof(argument), "%s", currmacro->pvalues[currmacro->indexp]);
-			break;
+		if(!subst_put(dest, size, &len, value, strlen(value))) return false;
+		src += skip;
+	}
+
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// get_arg: Substitute the macro arguments of the directive parameters in the
+// caller buffer. Returns -1 if there isn't arguments, 0 on error and 1 if ok
+// -----------------------------------------------------------------------------
+int get_arg(const char* name, char* dest, size_t size){
+	if(strchr(name, '#') == NULL || currframe == NULL)
+		return -1;
+	directive_error = !subst_args(name, dest, size, currframe, NULL);
+	return (directive_error) ? 0 : 1;
+}
+// -----------------------------------------------------------------------------
+
+
+// **********************************************************************************
+
+// FUNCTIONS TO INDEX THE BLOCKS BEGIN AND END
+// **********************************************************************************
+
+// block_word: first word of an uppercase line as the block scanning reads it,
+// the buffers don't split ';' and compare only the length of the end command
+// -----------------------------------------------------------------------------
+char* block_word(char* text, bool buffered){
+	const char* delims[] = {"\n", " ", "\t", ";"};
+	int steps = (buffered) ? 3 : 4;
+	char* word = text;
+	for(int i = 0; i < steps; i++){
+		word += strspn(word, delims[i]);
+		if(*word == '\0')
+			return NULL;
+		word[strcspn(word, delims[i])] = '\0';
+	}
+	return word;
+}
+// -----------------------------------------------------------------------------
+
+// block_match: compare the word with a block command
+// -----------------------------------------------------------------------------
+bool block_match(const char* word, const char* cmd, int type, bool buffered){
+	if(!buffered)
+		return strcmp(word, cmd) == 0;
+	int len = strlen(word);
+	if(len > (int) strlen(block[type].end))
+		len = strlen(block[type].end);
+	return (int) strlen(cmd) == len && strncmp(word, cmd, len) == 0;
+}
+// -----------------------------------------------------------------------------
+
+// open_blocks: Prepare the index of a buffer or file, built on the first use
+// -----------------------------------------------------------------------------
+void open_blocks(BlockIndex* index, const char* buffer, FILE* file){
+	index->base = buffer;
+	index->length = (buffer != NULL) ? strlen(buffer) : 0;
+	index->file = file;
+	index->text = NULL;
+	index->lines = NULL;
+	index->count = 0;
+	index->spans = NULL;
+	index->nspans = 0;
+	index->eof = 0;
+	index->built = false;
+	index->quiet = false;
+}
+// -----------------------------------------------------------------------------
+
+// push_blocks: Activate the index of the buffer being read. The positions out
+// of the active buffers fall back to the lines scanning
+// -----------------------------------------------------------------------------
+void push_blocks(BlockIndex* index){
+	if(blocks_depth < MAX_BLOCKS_DEPTH)
+		buffer_blocks[blocks_depth] = index;
+	blocks_depth++;
+}
+// -----------------------------------------------------------------------------
+
+void pop_blocks(){
+	if(blocks_depth > 0)
+		blocks_depth--;
+}
+// -----------------------------------------------------------------------------
+
+// build_blocks: Read all the lines once, matching each block begin with its
+// end command in a stack for each block type
+// -----------------------------------------------------------------------------
+bool build_blocks(BlockIndex* index){
+	char text[MAX_LINE_LENGTH];
+	int capacity = 0;
+	long text_size = 0, text_alloc = 0;
+	const char* bufptr = index->base;
+	long cur = (index->file != NULL) ? ftell(index->file) : 0;
+	bool buffered = index->base != NULL;
+
+	index->built = true;
+	if(index->file != NULL)
+		fseek(index->file, 0, SEEK_SET);
+
+	while(true){
+		long pos = (index->file != NULL) ? ftell(index->file) : 0;
+		const char* start = bufptr;
+		if(buffered){
+			if(!buffer_fgets(text, sizeof(text), &bufptr)) break;
+		}else{
+			if(!fgets(text, sizeof(text), index->file)) break;
+		}
+		if(index->count == capacity){
+			capacity = (capacity) ? capacity * 2 : 64;
+			index->lines = (BlockLine*) realloc(index->lines, capacity * sizeof(BlockLine));
+		}
+		BlockLine* bl = &index->lines[index->count++];
+		bl->pos = pos;
+		bl->span = -1;
+		if(buffered){
+			bl->offset = start - index->base;
+			bl->length = bufptr - start;
+		}else{
+			bl->length = strlen(text);
+			if(text_size + bl->length + 1 > text_alloc){
+				text_alloc = (text_size + bl->length + 1) * 2;
+				index->text = (char*) realloc(index->text, text_alloc);
+			}
+			memcpy(&index->text[text_size], text, bl->length + 1);
+			bl->offset = text_size;
+			text_size += bl->length;
 		}
 	}
-	
-	return argument;
+	index->eof = (index->file != NULL) ? ftell(index->file) : index->length;
+	if(index->file != NULL)
+		fseek(index->file, cur, SEEK_SET);
+	if(index->count == 0)
+		return true;
+
+	int types = sizeof(block) / sizeof(block[0]) - 1;
+	int* stacks = (int*) malloc(types * index->count * sizeof(int));
+	int tops[types];
+	memset(tops, 0, sizeof(tops));
+	index->spans = (BlockSpan*) malloc(index->count * sizeof(BlockSpan));
+
+	const char* source = (buffered) ? index->base : index->text;
+	for(int j = 0; j < index->count; j++){
+		BlockLine* bl = &index->lines[j];
+		memcpy(text, &source[bl->offset], bl->length);
+		text[bl->length] = '\0';
+		for(int i = 0; i < bl->length; i++)
+			if(text[i] > 0x60 && text[i] < 0x7B)
+				text[i] -= 0x20;
+		char* word = block_word(text, buffered);
+		bl->stored = word != NULL;
+		if(word == NULL)
+			continue;
+
+		for(int t = 0; t < types; t++){
+			if(word[0] != block[t].begin[0] && word[0] != block[t].end[0])
+				continue;
+			int* stack = &stacks[t * index->count];
+			if(block_match(word, block[t].begin, t, buffered)){
+				BlockSpan* span = &index->spans[index->nspans];
+				span->type = t;
+				span->first = j + 1;
+				span->last = index->count;
+				span->reported = false;
+				bl->span = index->nspans;
+				stack[tops[t]++] = index->nspans++;
+			}else if(block_match(word, block[t].end, t, buffered) && tops[t] > 0){
+				index->spans[stack[--tops[t]]].last = j;
+			}
+		}
+	}
+	free(stacks);
+	return true;
 }
+// -----------------------------------------------------------------------------
 
-int get_named_arg(const char* name){
-	char* argument = check_symbol(name);
-	if(argument[0] == 0){
-		int param = getParamIndex(&name[1]);
-		if(param == -1){
-			printf("%s -> Error at line %d: Param '%s' does not exist!\n", currentfile, linenum, &name[1]);
-			return 0;
+// find_block: Get the indexed block which body starts at the current reading
+// position, for O(1) skip and capture. NULL if the position isn't indexed
+// -----------------------------------------------------------------------------
+BlockSpan* find_block(const char* begin, const char** buffer, BlockIndex** owner){
+	BlockIndex* index = NULL;
+	long key = 0;
+	if(buffer != NULL){
+		int depth = (blocks_depth < MAX_BLOCKS_DEPTH) ? blocks_depth : MAX_BLOCKS_DEPTH;
+		while(depth > 0){
+			index = buffer_blocks[--depth];
+			if(*buffer >= index->base && *buffer <= index->base + index->length)
+				break;
+			index = NULL;
 		}
-		snprintf(argument, sizeof(argument), "%s", currmacro->pvalues[param]);
+		if(index == NULL)
+			return NULL;
+		key = *buffer - index->base;
+	}else{
+		index = file_blocks;
+		if(index == NULL || index->file != fileopened)
+			return NULL;
+		key = ftell(fileopened);
 	}
-	
-	token = replace(token, name, argument);
-	return 1;	
+	if(!index->built)
+		build_blocks(index);
+
+	int low = 0, high = index->count - 1, first = -1;
+	while(low <= high){
+		int mid = (low + high) / 2;
+		long at = (buffer != NULL) ? index->lines[mid].offset : index->lines[mid].pos;
+		if(at == key){
+			first = mid;
+			break;
+		}
+		if(at < key) low = mid + 1;
+		else high = mid - 1;
+	}
+	if(first == -1)
+		first = (key == ((buffer != NULL) ? index->length : index->eof)) ? index->count : -1;
+	if(first < 1 || index->lines[first - 1].span == -1)
+		return NULL;
+
+	BlockSpan* span = &index->spans[index->lines[first - 1].span];
+	if(strcmp(block[span->type].begin, begin) != 0)
+		return NULL;
+
+	// the preprocessor and the assembler read the same block, warn only once
+	if(span->last == index->count && !span->reported && !index->quiet){
+		char msg[64];
+		snprintf(msg, sizeof(msg), "Unbalanced %s block - missing %s", block[span->type].begin, block[span->type].end);
+		printwarn(msg);
+	}
+	span->reported = true;
+	*owner = index;
+	return span;
 }
+// -----------------------------------------------------------------------------
 
-int get_enum_arg(const char* name, int arg){
-	if(arg < 1) arg = 1;
-	int argc = (currmacro->pcount != -1) ? currmacro->pcount : currmacro->argsc;
-	if(arg > argc){
-		printf("%s -> Error at line %d: arg #%d is out of limit bound specified by line %d!\n", currentfile, linenum, arg, linesrc);
-		return 0;
+// leave_block: Jump after the end command of the block, counting its lines and
+// leaving the end line tokenized as the scanning did
+// -----------------------------------------------------------------------------
+void leave_block(BlockIndex* index, BlockSpan* span, const char** buffer){
+	int last = (span->last < index->count) ? span->last : index->count - 1;
+	linenum += span->last - span->first + ((span->last < index->count) ? 1 : 0);
+	if(last >= 0 && last >= span->first - 1){
+		const char* source = (buffer != NULL) ? index->base : index->text;
+		BlockLine* bl = &index->lines[last];
+		memcpy(line, &source[bl->offset], bl->length);
+		line[bl->length] = '\0';
+		line_to_upper();
+		token = block_word(line, buffer != NULL);
+	}
+
+	if(buffer != NULL){
+		*buffer = index->base + ((span->last < index->count) ? index->lines[span->last].offset + index->lines[span->last].length : index->length);
+	}else{
+		fseek(fileopened, (span->last + 1 < index->count) ? index->lines[span->last + 1].pos : index->eof, SEEK_SET);
 	}
-	
-	token = replace(token, name, currmacro->pvalues[arg-1]);	// LEAK: Fluxo
-	//printf("MACRO: %s, MNEMONIC: %s, ARGUMENT: %s\n", currmacro->name, mnemonic, currmacro->pvalues[arg-1]);
-	return 1;
 }
+// -----------------------------------------------------------------------------
 
-int get_arg(const char* name){
-	if(name[0] == '#'){
-		int arg = strtol(&name[1], &endptr, 10);
-		directive_error = (*endptr != '\0') ? !get_named_arg(name) : !get_enum_arg(name, arg);
-		if(directive_error) return 0;
-		return 1;
+// slice_block: Copy the body lines of the block in uppercase with CRLF breaks
+// -----------------------------------------------------------------------------
+char* slice_block(BlockIndex* index, BlockSpan* span, bool buffered){
+	const char* source = (buffered) ? index->base : index->text;
+	int last = (span->last < index->count) ? span->last : index->count;
+	long size = 0;
+	for(int j = span->first; j < last; j++)
+		if(index->lines[j].stored)
+			size += index->lines[j].length + 1;
+	if(size == 0)
+		return NULL;
+
+	char* code = (char*) malloc(size + 1);
+	char* out = code;
+	for(int j = span->first; j < last; j++){
+		BlockLine* bl = &index->lines[j];
+		if(!bl->stored)
+			continue;
+		for(int i = 0; i < bl->length; i++){
+			char c = source[bl->offset + i];
+			*out++ = (c > 0x60 && c < 0x7B) ? c - 0x20 : c;
+		}
+		if(bl->length > 0 && out[-1] == '\n'){
+			out[-1] = '\r';
+			*out++ = '\n';
+		}
 	}
-	return -1;
+	*out = '\0';
+	return code;
 }
+// -----------------------------------------------------------------------------
 
+// append_code: Append a captured line to the block body, turning its line
+// break in CRLF. The body grows geometrically to keep the capture linear
+// -----------------------------------------------------------------------------
+void append_code(char** code, long* size, long* alloc, const char* text){
+	int len = strlen(text);
+	if(*size + len + 2 > *alloc){
+		*alloc = (*alloc) ? *alloc * 2 : 256;
+		while(*size + len + 2 > *alloc)
+			*alloc *= 2;
+		*code = (char*) realloc(*code, *alloc);
+	}
+	memcpy(&(*code)[*size], text, len);
+	*size += len;
+	if(len > 0 && text[len - 1] == '\n'){
+		(*code)[*size - 1] = '\r';
+		(*code)[(*size)++] = '\n';
+	}
+	(*code)[*size] = '\0';
+}
+// -----------------------------------------------------------------------------
 
+// get_code: Capture the block body of the file, sliced from the block index
+// or scanning the lines when the position isn't indexed
+// -----------------------------------------------------------------------------
 char* get_code(const char* beg_cmd, const char* end_cmd) {
+    BlockIndex* index = NULL;
+    BlockSpan* span = find_block(beg_cmd, NULL, &index);
+    if (span != NULL) {
+        linenum++;
+        linebegin = linenum;
+        char* code = slice_block(index, span, false);
+        leave_block(index, span, NULL);
+        return code;
+    }
+
     char* code = NULL;
-    int total_size = 0;
+    long total_size = 0, alloc_size = 0;
     int depth = 1; // j estamos dentro do bloco principal
     linenum++;
     linebegin = linenum;
-    char* line_tmp = NULL;
     
     while (fgets(line, sizeof(line), fileopened)) {
 		linenum++;	// 5
@@ -1473,10 +2199,10 @@ char* get_code(const char* beg_cmd, const char* end_cmd) {
 
         // tokeniza para detectar comandos
         //token = strtok(line, "\n\t ;");
-        token = strtok(line, "\n");
-		token = strtok(token, " ");
-		token = strtok(token, "\t");
-		token = strtok(token, ";");
+        token = strtok_r(line, "\n", &strtok_save);
+		token = strtok_r(token, " ", &strtok_save);
+		token = strtok_r(token, "\t", &strtok_save);
+		token = strtok_r(token, ";", &strtok_save);
         if (!token) continue;
 
         if (strcmp(token, beg_cmd) == 0) {
@@ -1489,29 +2215,30 @@ char* get_code(const char* beg_cmd, const char* end_cmd) {
         }
 
         // armazena a linha no buffer
-        int len = strlen(line_tmp);
-        int new_size = total_size + len + 1 + 1;
-        code = realloc(code, new_size);
-        if (total_size == 0) code[0] = '\0';
-        if (line_tmp[len - 1] == '\n') {
-		    line_tmp[len - 1] = '\r'; // troca \n por \r
-			line_tmp[len] = '\n';     // coloca \n depois
-		    line_tmp[len + 1] = '\0'; // encerra string
-		}
-        strcat(code, line_tmp);
-        //total_size += len;
-        total_size = strlen(code);
+        append_code(&code, &total_size, &alloc_size, line_tmp);
     }
     return code;
 }
 
+// get_code_buffer: Capture the block body of the buffer, sliced from the
+// block index or scanning the lines when the position isn't indexed
+// -----------------------------------------------------------------------------
 char* get_code_buffer(const char* beg_cmd, const char* end_cmd, const char** buffer) {
+    BlockIndex* index = NULL;
+    BlockSpan* span = find_block(beg_cmd, buffer, &index);
+    if (span != NULL) {
+        linenum++;
+        linebegin = linenum;
+        char* code = slice_block(index, span, true);
+        leave_block(index, span, buffer);
+        return code;
+    }
+
     char* code = NULL;
-    int total_size = 0;
+    long total_size = 0, alloc_size = 0;
     int depth = 1; // j estamos dentro do bloco principal
     linenum++;
     linebegin = linenum;
-    char* line_tmp = NULL;
 
     while (buffer_fgets(line, sizeof(line), buffer)) {
 		linenum++;
@@ -1525,12 +2252,12 @@ char* get_code_buffer(const char* beg_cmd, const char* end_cmd, const char** buf
 
         // tokeniza para detectar comandos
         //token = strtok(line, "\n\t ;");
-        token = strtok(line, "\n");
-		token = strtok(token, " ");
-		token = strtok(token, "\t");
-		token = strtok(token, ";");
-		token[strlen(end_cmd)] = '\0';
+        token = strtok_r(line, "\n", &strtok_save);
+		token = strtok_r(token, " ", &strtok_save);
+		token = strtok_r(token, "\t", &strtok_save);
+		token = strtok_r(token, ";", &strtok_save);
         if (!token) continue;
+		token[strlen(end_cmd)] = '\0';
 
         if (strcmp(token, beg_cmd) == 0) {
             depth++; // achamos rep aninhado
@@ -1542,34 +2269,31 @@ char* get_code_buffer(const char* beg_cmd, const char* end_cmd, const char** buf
         }
 
         // armazena a linha no buffer
-        int len = strlen(line_tmp);
-        int new_size = total_size + len + 1 + 1;
-        code = realloc(code, new_size);
-        if (total_size == 0) code[0] = '\0';
-        if (line_tmp[len - 1] == '\n') {
-		    line_tmp[len - 1] = '\r'; // troca \n por \r
-			line_tmp[len] = '\n';     // coloca \n depois
-		    line_tmp[len + 1] = '\0'; // encerra string
-		}
-        strcat(code, line_tmp);
-        //total_size += len;
-        total_size = strlen(code);
+        append_code(&code, &total_size, &alloc_size, line_tmp);
     }
     return code;
 }
 
+// skip_block: Jump over the block of the file if the token begins it
+// -----------------------------------------------------------------------------
 bool skip_block(const char* begin, const char* end) {
     if (strcmp(token, begin) == 0) {
+        BlockIndex* index = NULL;
+        BlockSpan* span = find_block(begin, NULL, &index);
+        if (span != NULL) {
+            leave_block(index, span, NULL);
+            return true;
+        }
         int depth = 1; // j estamos dentro de um rep
         while (fgets(line, sizeof(line), fileopened)) {
         	line_to_upper();
             linenum++;		// 6
 
             //token = strtok(line, "\n\t ;");
-            token = strtok(line, "\n");
-			token = strtok(token, " ");
-			token = strtok(token, "\t");
-			token = strtok(token, ";");
+            token = strtok_r(line, "\n", &strtok_save);
+			token = strtok_r(token, " ", &strtok_save);
+			token = strtok_r(token, "\t", &strtok_save);
+			token = strtok_r(token, ";", &strtok_save);
             if (!token) continue;
 
             if (strcmp(token, begin) == 0) {
@@ -1587,17 +2311,25 @@ bool skip_block(const char* begin, const char* end) {
     return false;
 }
 
+// skip_block_buffer: Jump over the block of the buffer if the token begins it
+// -----------------------------------------------------------------------------
 bool skip_block_buffer(const char* begin, const char* end, const char** buffer) {
     if (strcmp(token, begin) == 0) {
+        BlockIndex* index = NULL;
+        BlockSpan* span = find_block(begin, buffer, &index);
+        if (span != NULL) {
+            leave_block(index, span, buffer);
+            return true;
+        }
         int depth = 1; // j estamos dentro de um rep
         while (buffer_fgets(line, sizeof(line), buffer)) {
         	line_to_upper();
             linenum++;
 
             //token = strtok(line, "\n\t ;");
-            token = strtok(line, "\n");
-			token = strtok(token, " ");
-			token = strtok(token, "\t");
+            token = strtok_r(line, "\n", &strtok_save);
+			token = strtok_r(token, " ", &strtok_save);
+			token = strtok_r(token, "\t", &strtok_save);
 			//token = strtok(token, ";");
 			token[strlen(end)] = '\0';
             //if (!token) continue;
@@ -1621,7 +2353,11 @@ bool skip_block_buffer(const char* begin, const char* end, const char** buffer)
 // -----------------------------------------------------------------------------
 int check_definition(){
 	int index = 0;
-	bool isMacroArg = token[index] == '#';
+	if(token[index] == '#'){
+		directive_error = true;
+		printerr("Invalid macro argument - use it inside a macro with a valid param");
+		return -1;
+	}
 	if(token[index] == '$')
 		index += 1;
 	else if((token[index] == '0' && token[index+1] == 'X') || (token[index] == 'H' && token[index+1] == '\''))
@@ -1635,39 +2371,25 @@ int check_definition(){
 		namelen -= 1;
 	}
 
-	if(!isMacroArg)
-		if(name[0] >= 0x30 && name[0] <= 0x39)
-			return 0;
+	if(name[0] >= 0x30 && name[0] <= 0x39)
+		return 0;
 		
 	name[namelen] = 0;
-	int i = (isMacroArg) ? 1 : 0;
-	int arg = strtol(&name[i], &endptr, 10);
+	strtol(name, &endptr, 10);
 	
 	if(*endptr != '\0'){
-		if(!isMacroArg){
-			strtol(&name[0], &endptr, 16);
-			bool isNotHexa = (!index && (token[index] != '$' 
-									&& (token[index] != '0' && token[index+1] != 'X') 
-									&& (token[index] != 'H' && token[index+1] != '\'')));
-			if(*endptr != '\0' || isNotHexa){
-				if(replace_name(name) != -1){
-					return check_definition();
-				}else{
-					directive_error = true;
-					return -1;
-				}
-			}	
-		}else{
-			if(!get_named_arg(name)) return -1;
-			int reg_index = check_register(token[0] == '%');
-			if(reg_index == -1) check_definition();
-			return 1;
-		}
-	}else if(isMacroArg){
-		if(!get_enum_arg(name, arg)) return -1;
-		int reg_index = check_register(token[0] == '%');
-		if(reg_index == -1) check_definition();
-		return 1;
+		strtol(&name[0], &endptr, 16);
+		bool isNotHexa = (!index && (token[index] != '$' 
+								&& (token[index] != '0' && token[index+1] != 'X') 
+								&& (token[index] != 'H' && token[index+1] != '\'')));
+		if(*endptr != '\0' || isNotHexa){
+			if(replace_name(name) != -1){
+				return check_definition();
+			}else{
+				directive_error = true;
+				return -1;
+			}
+		}	
 	}
 
 	return 0;
@@ -1713,23 +2435,20 @@ int get_mnemonic(){
 // get_label: read label and store in list on preprocessor
 // -----------------------------------------------------------------------------
 bool get_label(int length){
-	//if(isMacroScope){
-	int pos = find(label, "##");
-	if(pos != -1){
-		char argument[32] = {0};
-		memset(argument, 0, 32);
-		int ilabA = (isMacroScope) ? ++currmacro->ilabelA : ++ilabelA;
-		snprintf(argument, sizeof(argument), "%d", ilabA);
-		label = replace(label, "##", argument);
+	char args[MAX_LINE_LENGTH];
+	if(strstr(label, "##") != NULL){
+		int* ilabA = (isMacroScope && currmacro != NULL) ? &currmacro->ilabelA : &ilabelA;
+		if(!subst_args(label, args, sizeof(args), NULL, ilabA))
+			return false;
+		label = args;
 	}
-	//}
 		
 	MacroList* macro = getMacroByName(macro_list, label);
 	while(token != NULL && macro == NULL){		
 		
 		int pos = strcspn(&label[0], ":");
 		if(label[pos] == ':'){
-			token = strtok(NULL, " ");
+			token = strtok_r(NULL, " ", &strtok_save);
 			if(token != NULL || label[pos+1] != '\0'){
 				printerr("Invalid label name - incorrect char");
 				return false;
@@ -1757,7 +2476,7 @@ bool get_label(int length){
 				return false;
 										
 		}else{
-			token = strtok(NULL, " ");
+			token = strtok_r(NULL, " ", &strtok_save);
 			if(token != NULL){
 				strcat(label, &token[0]);
 				int x = (strlen(label) == length) ? 1 : 0;
@@ -1776,73 +2495,98 @@ bool get_label(int length){
 }
 // -----------------------------------------------------------------------------
 
-char** parse_parameters(int *argc_out) {
-    char **pvalues = NULL;
-    *argc_out = 0; // zera o contador que ser retornado
-	char* tmp = NULL;
-    // Continua a partir de onde strtok parou (aps _mov)
-    //char *token = token;
+// frame_alloc: Reserve aligned memory on top of the macro frames arena. The
+// arena is a stack released by restoring the frame_top mark
+// -----------------------------------------------------------------------------
+void* frame_alloc(size_t size){
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	if(frame_top + size > FRAME_ARENA_SIZE){
+		printerr("Macro frames arena overflow - too deep macro invocations");
+		return NULL;
+	}
+	void* ptr = (char*) frame_arena + frame_top;
+	frame_top += size;
+	return ptr;
+}
+// -----------------------------------------------------------------------------
 
-    while (token != NULL) {
-        // Remove espaos no incio
-        while (*token == ' ' || *token == '\t') token++;
-		
+// parse_arguments: Read the comma separated arguments on top of the frames
+// arena, without heap allocations. Returns the views of each argument
+// -----------------------------------------------------------------------------
+char** parse_arguments(int *argc_out) {
+	char* base = (char*) frame_arena + frame_top;
+	size_t size = 0;
+	*argc_out = 0;
+
+	while (token != NULL) {
+		// Remove espacos no inicio
+		while (*token == ' ' || *token == '\t') token++;
 		token[strcspn(token, " ")] = '\0';
-		
+
 		DefineList *defines = getdef(define_list, token);
-		if(defines != NULL){
-			if(tmp != NULL) free(tmp);
-			tmp = (defines->refs[0] == 0) ? strdup(defines->value) : strdup(defines->refs);
-			token = tmp;
-		}
-		
-		int result = get_arg(token);
-		//if(!result)
-		//	return NULL;
-			
-		int pos = find(token, "##");
-		if(pos != -1){
-			char argument[32] = {0};
-			memset(argument, 0, 32);
-			int ilabB = (isMacroScope) ? ++currmacro->ilabelB : ++ilabelB;
-			snprintf(argument, sizeof(argument), "%d", ilabB);
-			token = replace(token, "##", argument);
+		if(defines != NULL)
+			token = (defines->refs[0] == 0) ? defines->value : defines->refs;
+
+		char* arg = base + size;
+		size_t room = FRAME_ARENA_SIZE - frame_top - size;
+		if(strchr(token, '#') != NULL && room > 0){
+			int* ilabB = (isMacroScope && currmacro != NULL) ? &currmacro->ilabelB : &ilabelB;
+			if(!subst_args(token, arg, room, currframe, ilabB))
+				return NULL;
+		}else if(strlen(token) < room){
+			strcpy(arg, token);
+		}else{
+			printerr("Macro frames arena overflow - too deep macro invocations");
+			return NULL;
 		}
-			
-        // Remove espaos e \n no final
-        size_t len = strlen(token);
-        while (len > 0 && (token[len - 1] == ' ' || token[len - 1] == '\n' || token[len - 1] == '\r'))
-            token[--len] = '\0';
-
-        // Realoca mais espao no vetor de ponteiros
-        char **temp = realloc(pvalues, (*argc_out + 1) * sizeof(char*));	// LEAK: Raiz
-        if (temp == NULL) {
-            // Libera caso d erro
-            for (int i = 0; i < *argc_out; i++) free(pvalues[i]);
-            free(pvalues);
-            return NULL;
-        }
-        pvalues = temp;
-
-        // Copia a string do token
-        pvalues[*argc_out] = malloc(len + 1);
-        if (pvalues[*argc_out] == NULL) {
-            for (int i = 0; i < *argc_out; i++) free(pvalues[i]);
-            free(pvalues);
-            return NULL;
-        }
-        //strcpy(pvalues[*argc_out], token);
-        memcpy(pvalues[*argc_out], token, len + 1); // copia incluindo '\0'
-        (*argc_out)++;
 
-        // Prximo token separado por vrgula
-        token = strtok(NULL, ",");
-    }
+		// Remove espacos e \n no final
+		size_t len = strlen(arg);
+		while (len > 0 && (arg[len - 1] == ' ' || arg[len - 1] == '\n' || arg[len - 1] == '\r'))
+			arg[--len] = '\0';
+
+		size += len + 1;
+		(*argc_out)++;
+
+		// Proximo token separado por virgula
+		token = strtok_r(NULL, ",", &strtok_save);
+	}
 
-    return pvalues;
+	if(frame_alloc(size) == NULL)
+		return NULL;
+	char** args = (char**) frame_alloc((*argc_out + 1) * sizeof(char*));
+	if(args == NULL)
+		return NULL;
+	for(int i = 0; i < *argc_out; i++){
+		args[i] = base;
+		base += strlen(base) + 1;
+	}
+	args[*argc_out] = NULL;
+	return args;
 }
+// -----------------------------------------------------------------------------
 
+// parse_parameters: Read the parameter names of a macro definition, which
+// own heap copies of the parsed arguments. A failed substitution was already
+// reported and fails the directive
+// -----------------------------------------------------------------------------
+char** parse_parameters(int *argc_out) {
+	size_t mark = frame_top;
+	char** args = parse_arguments(argc_out);
+	char** pnames = NULL;
 
+	if(args == NULL){
+		*argc_out = 0;
+		directive_error = true;
+	}else if(*argc_out > 0){
+		pnames = (char**) malloc(*argc_out * sizeof(char*));	// LEAK: Raiz
+		for(int i = 0; i < *argc_out; i++)
+			pnames[i] = strdup(args[i]);
+	}
+	frame_top = mark;
+	return pnames;
+}
+// -----------------------------------------------------------------------------
 
 // calc_label: calculate the label address on assembler
 // -----------------------------------------------------------------------------
@@ -1851,6 +2595,9 @@ bool calc_label(unsigned char *label){
 	
 	if(list != NULL){
 		list->addr = code_index + org_num;
+		memo_pure = false;
+		if(region_recording)
+			region_defs = insertdep(region_defs, list, NULL);
 		
 		if(isExport){
 			if(strcmp(label_pointer[wll_index], label) == 0){
@@ -1880,78 +2627,921 @@ bool calc_label(unsigned char *label){
 		}else{
 			//if(isMacroScope) printf("macro: %s\n", label); // debug
 			int argc = 0;
-			token = strtok(NULL, ",");
+			size_t mark = frame_top;
+			token = strtok_r(NULL, ",", &strtok_save);
 			
 			//if(isMacroScope) printf("param: %s\n", token); // debug
-		    char **pvalues = parse_parameters(&argc); // LEAK: Fluxo
+			char **args = parse_arguments(&argc);
+			if(args == NULL){
+				frame_top = mark;
+				return false;
+			}
 
-			invoked_macro = insertargs(macro_list, macro->name, argc, pvalues); // LEAK: Fluxo
-		    
-			if(invoked_macro != NULL){
-				isMacro = true;
-				isMacroScope = isMacro;
-				return true;
-			}else{
-				printf("%s -> Error at line %d: Macro %s with %d args not found!\n", currentfile, linenum, macro->name, argc);
+			MacroList* invoked = getMacroByNameA(macro_list, macro->name, -1);
+			if(invoked == NULL)
+				invoked = getMacroByNameA(macro_list, macro->name, argc);
+			if(invoked == NULL){
+				frame_top = mark;
+				diag_error(stdout, "%s -> Error at line %d: Macro %s with %d args not found!\n", currentfile, linenum, macro->name, argc);
+				return false;
+			}
+
+			MacroFrame* frame = (MacroFrame*) frame_alloc(sizeof(MacroFrame));
+			if(frame == NULL){
+				frame_top = mark;
 				return false;
 			}
+			frame->macro = invoked;
+			frame->argc = argc;
+			frame->args = args;
+			frame->indexp = 0;
+			frame->mark = mark;
+			invoked_frame = frame;
+			
+			isMacro = true;
+			isMacroScope = isMacro;
+			return true;
 		}
 	}
 }
 // -----------------------------------------------------------------------------
 
+// block_token: first token of a raw line as the block skipping reads it
+// -----------------------------------------------------------------------------
+char* block_token(char* text, const char* end){
+	char* tok = strtok_r(text, "\n", &strtok_save);
+	tok = (tok) ? strtok_r(tok, " ", &strtok_save) : NULL;
+	tok = (tok) ? strtok_r(tok, "\t", &strtok_save) : NULL;
+	if(tok && strlen(tok) > strlen(end))
+		tok[strlen(end)] = '\0';
+	return tok;
+}
+// -----------------------------------------------------------------------------
 
-bool assemble_macro(){
-	
-	int linetmp = linenum;
-	linesrc = linenum;
-	MacroList *macrotmp = currmacro;
-	currmacro = invoked_macro;
-	linebegin = currmacro->line + 1;
-	bool ifstate_tmp = ifstate;
-	bool isELSE_tmp = isELSE;
-	bool isIF_tmp = isIF;
-	
-	const char* buffertmp = bufferget;
-	unsigned char* machinecode;
-	bool assembled = assemble_buffer(currmacro->content, &machinecode, isVerbose);	// debug
-	bufferget = buffertmp;
-	
-	isIF = isIF_tmp;
-	isELSE = isELSE_tmp;
-	ifstate = ifstate_tmp;
-	currmacro = macrotmp;
-	linenum = linetmp;
+// compile_params: Compile the #name references to the parameters of the macro
+// in their slots, the #N that subst_args reads without searching the names.
+// The quoted texts, the comments and the unknown names are kept as they are
+// -----------------------------------------------------------------------------
+void compile_params(char* text, MacroList* macro){
+	if(macro == NULL || macro->pnames == NULL || strchr(text, '#') == NULL)
+		return;
 	
-	return assembled;
+	char out[MAX_LINE_LENGTH];
+	size_t len = 0;
+	char quote = 0;
+	const char* src = text;
+	while(*src != '\0'){
+		size_t keep = 1;
+		if(quote == 0 && *src == ';'){
+			keep = strlen(src);
+		}else if(quote != 0 || *src != '#'){
+			if(quote == 0 && (*src == '"' || *src == '\''))
+				quote = *src;
+			else if(quote == *src)
+				quote = 0;
+		}else if(src[1] == '#'){
+			keep = 2;
+		}else if(isalpha((unsigned char) src[1]) || src[1] == '_'){
+			size_t namelen = 1;
+			while(isalnum((unsigned char) src[namelen+1]) || src[namelen+1] == '_')
+				namelen++;
+			char name[namelen+1];
+			memcpy(name, &src[1], namelen);
+			name[namelen] = '\0';
+			int param = getParamIndex(macro, name);
+			if(param != -1){
+				int n = snprintf(&out[len], sizeof(out) - len, "#%d", param + 1);
+				if(n < 0 || len + n >= sizeof(out))
+					return;
+				len += n;
+				src += namelen + 1;
+				continue;
+			}
+			keep = namelen + 1;
+		}
+		if(len + keep >= sizeof(out))
+			return;
+		memcpy(&out[len], src, keep);
+		len += keep;
+		src += keep;
+	}
+	out[len] = '\0';
+	strcpy(text, out);
 }
+// -----------------------------------------------------------------------------
 
-// **********************************************************************************
-
-// FUNCTIONS TO RUN EACH STEP OF THE ASSEMBLER
-// **********************************************************************************
+// parse_stmt: Parse the instruction of the statement once, its mnemonic and
+// its operand offset. Labels, directives, macro calls and the mnemonics with
+// substitutions are left to the tokenizer
+// -----------------------------------------------------------------------------
+void parse_stmt(MacroStmt* stmt, const char* text){
+	stmt->mnemonic = -1;
+	stmt->operand = -1;
+	int begin = strspn(text, " ");
+	int length = strcspn(&text[begin], " ");
+	for(int i = 0; i < MNEMONICS_CODE; i++){
+		if(strncmp(mnemonics[i], &text[begin], length) == 0 && mnemonics[i][length] == '\0'){
+			stmt->mnemonic = i;
+			break;
+		}
+	}
+	if(stmt->mnemonic == -1)
+		return;
+	int rest = begin + length + strspn(&text[begin + length], " ");
+	if(text[rest] != '\0')
+		stmt->operand = rest;
+}
+// -----------------------------------------------------------------------------
 
-bool get_operand_states(){
-	isMnemonic = false;
-	syntax_6502 = token[0] == '$';
-	syntax_PIC = (token[0] == 'H' && token[1] == '\'');
-	syntax_Intel = (token[0] == '0' && token[1] == 'X');
-	syntax_GAS = token[0] == '%';
-	isDecimal = (token[0] >= 0x30 && token[0] <= 0x39) && token[1] != 'X' || token[0] == '-';
-	isHexadecimal = syntax_6502 || syntax_PIC || syntax_Intel;
+// compile_template: Format the macro or REP body once and split it in
+// statements, marking the lines that the preprocessor needs on each run. The
+// parameters of the macro (NULL for REP) are compiled in their slots and the
+// instructions are parsed
+// -----------------------------------------------------------------------------
+bool compile_template(MacroTemplate* tmpl, const char* code, MacroList* macro){
+	tmpl->body = NULL;
+	tmpl->prep = NULL;
+	tmpl->stmts = NULL;
+	tmpl->count = 0;
+	tmpl->blocks = NULL;
+	tmpl->mapped = false;
+	if(code == NULL)
+		return true;
 	
-	reg_index = check_register(syntax_GAS);
+	int capacity = 0;
+	int body_size = 0;
+	int body_alloc = strlen(code) + 3;
+	char* body = (char*) malloc(body_alloc);
+	if(!body) return false;
 	
-	bool operand_state = isHexadecimal || syntax_GAS || isDecimal || reg_index != -1;
+	int skip_depth = 0;
+	int skip_i = 0;
+	bool prep_stop = false;
+	bool has_prep = false;
+	char text[MAX_LINE_LENGTH];
+	char tok_line[MAX_LINE_LENGTH];
+	const char* bufptr = code;
 	
-	return operand_state;
+	while(buffer_fgets(text, sizeof(text), &bufptr)){
+		if(tmpl->count == capacity){
+			capacity = (capacity) ? capacity * 2 : 16;
+			MacroStmt* tmp = (MacroStmt*) realloc(tmpl->stmts, capacity * sizeof(MacroStmt));
+			if(!tmp){
+				free(body);
+				return false;
+			}
+			tmpl->stmts = tmp;
+		}
+		MacroStmt* stmt = &tmpl->stmts[tmpl->count++];
+		stmt->flags = (text[0] == 0x0D && text[1] == 0x0A) ? STMT_BLANK : 0;
+		
+		// blocks skipped by the preprocessor (REP, IF, ELSE) are matched by raw line
+		bool skipped = skip_depth > 0;
+		if(skipped && !prep_stop){
+			strcpy(tok_line, text);
+			char* tok = block_token(tok_line, block[skip_i].end);
+			if(tok && strcmp(tok, block[skip_i].begin) == 0)
+				skip_depth++;
+			else if(tok && strcmp(tok, block[skip_i].end) == 0)
+				skip_depth--;
+		}
+		
+		format_text(text, true);
+		compile_params(text, macro);
+		stmt->offset = body_size;
+		stmt->length = strlen(text);
+		if(body_size + stmt->length + 3 > body_alloc){
+			body_alloc = (body_size + stmt->length + 3) * 2;
+			char* tmp = (char*) realloc(body, body_alloc);
+			if(!tmp){
+				free(body);
+				return false;
+			}
+			body = tmp;
+		}
+		memcpy(&body[body_size], text, stmt->length);
+		body_size += stmt->length;
+		body[body_size++] = 0x0D;
+		body[body_size++] = 0x0A;
+		
+		int i = strspn(text, " ");
+		if(text[i] == '\0' || text[i] == ';')
+			stmt->flags |= STMT_IGNORE;
+		parse_stmt(stmt, text);
+		
+		if(prep_stop || skipped || (stmt->flags & STMT_BLANK))
+			continue;
+		
+		// the same checks of preprocess_buffer for each line
+		if(text[i] == '\0'){
+			prep_stop = true;
+			continue;
+		}
+		strcpy(tok_line, text);
+		char* tok = strtok_r(tok_line, " ", &strtok_save);
+		if(tok == NULL || tok[0] == ';')
+			continue;
+		
+		bool prep = false;
+		if(strcmp(tok, block[REP_I].begin) == 0 || strcmp(tok, block[IF_I].begin) == 0 || strcmp(tok, block[ELSE_I].begin) == 0){
+			skip_i = (strcmp(tok, block[REP_I].begin) == 0) ? REP_I : (strcmp(tok, block[IF_I].begin) == 0) ? IF_I : ELSE_I;
+			skip_depth = 1;
+			continue;
+		}
+		if(strcmp(tok, block[IMP_I].begin) == 0 || strcmp(tok, "EXPORT") == 0){
+			prep = true;
+		}else{
+			bool isAlloc = strcmp(tok, "DB") == 0 || strcmp(tok, "DW") == 0 || strcmp(tok, "DCB") == 0 || strcmp(tok, ".BYTE") == 0;
+			bool isIncludeB = strcmp(tok, "INCLUDEB") == 0 || strcmp(tok, "ENDX") == 0;
+			if(isAlloc || isIncludeB)
+				continue;
+			
+			for(int d = 0; d < DIRECTIVES_SIZE && directives[d] != NULL; d++)
+				prep = strcmp(directives[d], tok) == 0 || prep;
+			
+			if(!prep){
+				bool isMnem = false;
+				for(int m = 0; m < MNEMONICS_SIZE; m++)
+					isMnem = strcmp(mnemonics[m], tok) == 0 || isMnem;
+				bool isCall = getMacroByName(macro_list, tok) != NULL && find(tok, "##") == -1;
+				prep = !isMnem && !isCall;
+			}
+		}
+		
+		if(prep){
+			stmt->flags |= STMT_PREP;
+			has_prep = true;
+		}
+	}
+	body[body_size] = '\0';
+	
+	if(has_prep){
+		tmpl->prep = (char*) malloc(body_size + 1);
+		if(!tmpl->prep){
+			free(body);
+			return false;
+		}
+		int size = 0;
+		for(int s = 0; s < tmpl->count; s++){
+			MacroStmt* stmt = &tmpl->stmts[s];
+			if(stmt->flags & STMT_PREP){
+				memcpy(&tmpl->prep[size], &body[stmt->offset], stmt->length);
+				size += stmt->length;
+			}
+			tmpl->prep[size++] = 0x0D;
+			tmpl->prep[size++] = 0x0A;
+		}
+		tmpl->prep[size] = '\0';
+	}
+	
+	tmpl->body = body;
+	tmpl->blocks = (BlockIndex*) malloc(sizeof(BlockIndex));
+	if(tmpl->blocks != NULL)
+		open_blocks(tmpl->blocks, body, NULL);
+	return true;
 }
+// -----------------------------------------------------------------------------
 
-bool get_mnemonic_states(){
-	isOrg = mnemonic_index == 54;
-	isInclude = mnemonic_index == 55;
-	isRepeat = mnemonic_index == 56;
-	isIF = mnemonic_index == 57;
+// find_stmt: get the statement index at the body offset
+// -----------------------------------------------------------------------------
+int find_stmt(MacroTemplate* tmpl, int offset){
+	int low = 0;
+	int high = tmpl->count;
+	while(low < high){
+		int mid = (low + high) / 2;
+		if(tmpl->stmts[mid].offset < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+// -----------------------------------------------------------------------------
+
+// FUNCTIONS TO MEMOIZE THE MACRO EXPANSIONS
+// **********************************************************************************
+
+// name_version: Version of the last symbol created with the name, 0 if none
+// symbol_created: Give a new version to the name of the created symbol
+// -----------------------------------------------------------------------------
+VersionList** name_bucket(const char* name){
+	unsigned int hash = 5381;
+	for(const char* c = name; *c != '\0'; c++)
+		hash = hash * 33 + (unsigned char) *c;
+	return &name_versions[hash % VERSION_BUCKETS];
+}
+
+int name_version(const char* name){
+	for(VersionList* li = *name_bucket(name); li != NULL; li = li->next)
+		if(strcmp(li->name, name) == 0)
+			return li->version;
+	return 0;
+}
+
+void symbol_created(const char* name){
+	symbol_version++;
+	VersionList** bucket = name_bucket(name);
+	for(VersionList* li = *bucket; li != NULL; li = li->next){
+		if(strcmp(li->name, name) == 0){
+			li->version = symbol_version;
+			return;
+		}
+	}
+	VersionList* node = (VersionList*) malloc(sizeof(VersionList));
+	node->name = strdup(name);
+	node->version = symbol_version;
+	node->next = *bucket;
+	*bucket = node;
+}
+// -----------------------------------------------------------------------------
+
+// memo_name: record a symbol name read by the expansion in recording, with
+// the version it has now. A name not created yet has the version 0
+// -----------------------------------------------------------------------------
+void memo_name(const char* name){
+	if(!memo_recording)
+		return;
+	for(ExpDeps* dep = memo_deps; dep != NULL; dep = dep->next)
+		if(dep->name != NULL && strcmp(dep->name, name) == 0)
+			return;
+	memo_deps = insertname(memo_deps, name, name_version(name));
+}
+// -----------------------------------------------------------------------------
+
+// memo_label: record a label used by the expansion in recording
+// -----------------------------------------------------------------------------
+void memo_label(LabelList* label, RefsAddr* ref){
+	if(memo_recording)
+		memo_deps = insertdep(memo_deps, label, ref);
+	if(region_recording)
+		region_deps = insertdep(region_deps, label, ref);
+}
+// -----------------------------------------------------------------------------
+
+// memo_lookup: search the expansion with the same arguments and IF state
+// -----------------------------------------------------------------------------
+ExpansionList* memo_lookup(MacroFrame* frame){
+	int argc = frame->argc;
+	for(ExpansionList *li = frame->macro->cache; li != NULL; li = li->next){
+		if(li->argc != argc || li->ifstate != ifstate)
+			continue;
+		int i = 0;
+		for(; i < argc; i++)
+			if(strcmp(li->args[i], frame->args[i]) != 0)
+				break;
+		if(i == argc)
+			return li;
+	}
+	return NULL;
+}
+// -----------------------------------------------------------------------------
+
+// memo_replay: copy the expansion bytes to the current code index, inserting
+// its forward references again. Fails if some used label has changed or some
+// read name was created again since. Only the names read are checked, once
+// for each new symbol version
+// -----------------------------------------------------------------------------
+bool memo_replay(ExpansionList* exp){
+	if(exp->version != symbol_version){
+		for(ExpDeps *dep = exp->deps; dep != NULL; dep = dep->next)
+			if(dep->label == NULL && name_version(dep->name) != dep->version)
+				return false;
+		exp->version = symbol_version;
+	}
+	for(ExpDeps *dep = exp->deps; dep != NULL; dep = dep->next)
+		if(dep->label != NULL && dep->label->addr != dep->addr)
+			return false;
+	if(code_index + exp->length > MEMORY_EMULATOR)
+		return false;
+	
+	int base = code_index;
+	memcpy(&code_address[base], exp->code, exp->length);
+	code_index += exp->length;
+	
+	curr_refer = NULL;
+	for(ExpDeps *dep = exp->deps; dep != NULL; dep = dep->next){
+		if(dep->label == NULL)
+			continue;
+		if(!dep->hasRef){
+			if(region_recording)
+				region_deps = insertdep(region_deps, dep->label, NULL);
+			continue;
+		}
+		LabelList* label = dep->label;
+		label->refs = insertaddr(label->refs, base + dep->ref.addr, dep->ref.relative, dep->ref.isDcb, dep->ref.isHigh, dep->ref.isDW);
+		label->refs->bitshift = dep->ref.bitshift;
+		label->refs->is8bit = dep->ref.is8bit;
+		label->refs->isExpression = dep->ref.isExpression;
+		label->refs->expression = (dep->ref.expression) ? strdup(dep->ref.expression) : NULL;
+		if(dep == exp->refer)
+			curr_refer = label->refs;
+		if(region_recording)
+			region_deps = insertdep(region_deps, label, label->refs);
+	}
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// memo_begin: start to record the bytes and labels used by an expansion
+// -----------------------------------------------------------------------------
+void memo_begin(){
+	memo_recording = true;
+	memo_pure = true;
+	memo_deps = NULL;
+}
+// -----------------------------------------------------------------------------
+
+// memo_capture: finish the recording and return the expansion from code_start
+// with its label dependencies. Returns NULL if it isn't position independent
+// -----------------------------------------------------------------------------
+ExpansionList* memo_capture(int argc, char** args, int code_start, bool assembled){
+	memo_recording = false;
+	if(!assembled || !memo_pure){
+		freedep(memo_deps);
+		memo_deps = NULL;
+		return NULL;
+	}
+	
+	ExpDeps* deps = NULL;
+	ExpDeps* refer = NULL;
+	bool valid = true;
+	
+	// the dependencies are kept in recording order for the replay
+	while(memo_deps != NULL){
+		ExpDeps* dep = memo_deps;
+		memo_deps = dep->next;
+		if(dep->hasRef){
+			dep->ref = *dep->live;
+			dep->ref.addr -= code_start;
+			dep->ref.expression = (dep->live->expression) ? strdup(dep->live->expression) : NULL;
+			dep->ref.next = NULL;
+			valid = dep->ref.addr >= 0 && valid;
+			if(dep->live == curr_refer)
+				refer = dep;
+		}
+		dep->live = NULL;
+		dep->next = deps;
+		deps = dep;
+	}
+	
+	if(!valid || (curr_refer != NULL && refer == NULL)){
+		freedep(deps);
+		return NULL;
+	}
+	
+	ExpansionList* exp = insertexp(NULL, argc, args, &code_address[code_start], code_index - code_start);
+	exp->version = symbol_version;
+	exp->ifstate = ifstate;
+	exp->deps = deps;
+	exp->refer = refer;
+	return exp;
+}
+// -----------------------------------------------------------------------------
+
+// memo_store: save the recorded macro expansion in its cache
+// -----------------------------------------------------------------------------
+void memo_store(MacroFrame* frame, int code_start, bool assembled){
+	ExpansionList* exp = memo_capture(frame->argc, frame->args, code_start, assembled);
+	if(exp != NULL){
+		exp->next = frame->macro->cache;
+		frame->macro->cache = exp;
+	}
+}
+// -----------------------------------------------------------------------------
+
+// memo_remove: delete an expansion that can't be replayed anymore
+// -----------------------------------------------------------------------------
+void memo_remove(MacroList* macro, ExpansionList* exp){
+	ExpansionList** li = &macro->cache;
+	while(*li != NULL && *li != exp)
+		li = &(*li)->next;
+	if(*li != NULL){
+		*li = exp->next;
+		exp->next = NULL;
+		freeexp(exp);
+	}
+}
+// -----------------------------------------------------------------------------
+
+// **********************************************************************************
+
+// FUNCTIONS OF THE INCLUDED REGIONS CACHE
+// **********************************************************************************
+
+// The bytes of each INCLUDE are kept as a region and copied whole when the
+// next build reaches the include at the same address and ORG with the same
+// inputs. This is a cache of include regions, not a dependency graph: the
+// preprocessor pass runs in full, any changed input reassembles the whole
+// include, and the code moved by a size change before it is reassembled,
+// not relinked, because the encoded operands don't record their labels
+
+// hash_text: Continue a hash with the text and a separator
+// -----------------------------------------------------------------------------
+unsigned int hash_text(unsigned int hash, const char* text){
+	if(text != NULL)
+		for(const char* c = text; *c != '\0'; c++)
+			hash = hash * 33 + (unsigned char) *c;
+	return hash * 33;
+}
+// -----------------------------------------------------------------------------
+
+// region_counters: Get the local label counters, the global ones followed by
+// the counters of each macro. Returns the count of counters
+// -----------------------------------------------------------------------------
+int region_counters(int** counters){
+	int count = 3;
+	for(MacroList* li = macro_list; li != NULL; li = li->next)
+		count += 3;
+	int* values = (int*) malloc(count * sizeof(int));
+	values[0] = ilabelA;
+	values[1] = ilabelB;
+	values[2] = ilabelC;
+	int i = 3;
+	for(MacroList* li = macro_list; li != NULL; li = li->next){
+		values[i++] = li->ilabelA;
+		values[i++] = li->ilabelB;
+		values[i++] = li->ilabelC;
+	}
+	*counters = values;
+	return count;
+}
+// -----------------------------------------------------------------------------
+
+// region_symbols: Hash of what an included file can read from the program:
+// the defines, the macros, the label names and the local label counters
+// -----------------------------------------------------------------------------
+unsigned int region_symbols(int* counters, int count){
+	unsigned int hash = 5381;
+	for(DefineList* li = define_list; li != NULL; li = li->next){
+		hash = hash_text(hash, li->name);
+		hash = hash_text(hash, li->value);
+		hash = hash_text(hash, li->refs);
+	}
+	for(MacroList* li = macro_list; li != NULL; li = li->next){
+		hash = hash_text(hash, li->name) + li->pcount;
+		for(int i = 0; li->pnames != NULL && i < li->pcount; i++)
+			hash = hash_text(hash, li->pnames[i]);
+		hash = hash_text(hash, li->tmpl.body);
+		hash = hash_text(hash, li->tmpl.prep);
+	}
+	for(LabelList* li = label_list; li != NULL; li = li->next)
+		hash = hash_text(hash, li->name);
+	for(int i = 0; i < count; i++)
+		hash = hash * 33 + counters[i];
+	return hash;
+}
+// -----------------------------------------------------------------------------
+
+// region_file: Record a text file read by the region in recording, with the
+// hash of the copy read. The files read without a copy can't be checked
+// -----------------------------------------------------------------------------
+void region_file(IncludeList* inc){
+	if(!region_recording)
+		return;
+	if(inc == NULL || inc->buffer == NULL){
+		region_pure = false;
+		return;
+	}
+	if(getsrc(region_files, inc->path) == NULL){
+		region_files = insertsrc(region_files, inc->path, SRC_TEXT);
+		region_files->hash = inc->hash;
+	}
+}
+// -----------------------------------------------------------------------------
+
+// region_refer: Note the use of the current reference left before the region
+// by a number operand, which reads if it's an expression and changes it for
+// the bits getter. The region can't change a reference out of its bytes
+// -----------------------------------------------------------------------------
+void region_refer(bool changed){
+	if(region_stale != NULL && changed)
+		region_pure = false;
+	if(region_use == 0)
+		region_use = (region_stale == NULL) ? 1 : (region_stale->isExpression) ? 3 : 2;
+}
+// -----------------------------------------------------------------------------
+
+// region_match: Check if the kept region can be copied at the current code
+// index: same files, symbols and used labels, and its labels not defined yet
+// -----------------------------------------------------------------------------
+bool region_match(RegionList* region, unsigned int symbols){
+	if(region->start != code_index || region->org != org_num || region->ifstate != ifstate || region->symbols != symbols)
+		return false;
+	if(code_index + region->length > MEMORY_EMULATOR)
+		return false;
+	if(region->staleUse != 0 && region->staleUse != ((curr_refer == NULL) ? 1 : (curr_refer->isExpression) ? 3 : 2))
+		return false;
+	for(SourceList* src = region->files; src != NULL; src = src->next){
+		IncludeList* inc = wait_include(src->path);
+		if(inc == NULL || inc->buffer == NULL || inc->hash != src->hash)
+			return false;
+	}
+	for(RegionLabels* rl = region->labels; rl != NULL; rl = rl->next){
+		LabelList* label = getLabelByName(label_list, rl->name);
+		if(label == NULL || label->addr != ((rl->defined) ? 0xFFFF : rl->addr))
+			return false;
+	}
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// region_replay: Copy the region to the image, defining its labels to patch
+// the references before it and inserting its forward references again
+// -----------------------------------------------------------------------------
+void region_replay(RegionList* region){
+	RefsAddr* refer = NULL;
+	int base = code_index;
+	memcpy(&code_address[base], region->code, region->length);
+	code_index += region->length;
+	
+	for(RegionLabels* rl = region->labels; rl != NULL; rl = rl->next){
+		LabelList* label = getLabelByName(label_list, rl->name);
+		if(rl->defined){
+			label->addr = rl->addr;
+			if(label->refs != NULL){
+				setref(label->refs, (char*) code_address, label->addr, org_num);
+				freeref(label->refs);
+				label->refs = NULL;
+			}
+		}else if(rl->hasRef){
+			label->refs = insertaddr(label->refs, base + rl->ref.addr, rl->ref.relative, rl->ref.isDcb, rl->ref.isHigh, rl->ref.isDW);
+			label->refs->bitshift = rl->ref.bitshift;
+			label->refs->is8bit = rl->ref.is8bit;
+			label->refs->isExpression = rl->ref.isExpression;
+			label->refs->expression = (rl->ref.expression) ? strdup(rl->ref.expression) : NULL;
+			if(rl->refer)
+				refer = label->refs;
+		}
+	}
+	
+	ilabelA += region->counters[0];
+	ilabelB += region->counters[1];
+	ilabelC += region->counters[2];
+	int i = 3;
+	for(MacroList* li = macro_list; li != NULL && i < region->ncounters; li = li->next){
+		li->ilabelA += region->counters[i++];
+		li->ilabelB += region->counters[i++];
+		li->ilabelC += region->counters[i++];
+	}
+	if(!region->keepRefer)
+		curr_refer = refer;
+}
+// -----------------------------------------------------------------------------
+
+// region_enter: Copy the kept region of the included file if its inputs are
+// unchanged, or start to record it. Returns true when the region was copied.
+// The regions are kept only between the assemblies of the watch and server
+// modes, and the nested includes belong to the region that includes them
+// -----------------------------------------------------------------------------
+bool region_enter(const char* path, RegionMark* mark){
+	mark->recording = false;
+	if(!keep_caches || region_recording || memo_recording || isExport || currmacro != NULL)
+		return false;
+	
+	mark->ncounters = region_counters(&mark->counters);
+	mark->symbols = region_symbols(mark->counters, mark->ncounters);
+	RegionList* region = getreg(region_list, path);
+	if(region != NULL && region_match(region, mark->symbols)){
+		free(mark->counters);
+		region_replay(region);
+		for(SourceList* src = region->files; src != NULL; src = src->next)
+			once_file(src->path)->passes |= ONCE_ASSEMBLY;
+		region_hits++;
+		return true;
+	}
+	
+	region_misses++;
+	mark->recording = true;
+	mark->start = code_index;
+	mark->org = org_num;
+	mark->ifstate = ifstate;
+	mark->labels = label_list;
+	mark->defines = define_list;
+	mark->macros = macro_list;
+	region_recording = true;
+	region_pure = true;
+	region_stale = curr_refer;
+	region_use = 0;
+	region_deps = region_defs = NULL;
+	region_files = NULL;
+	return false;
+}
+// -----------------------------------------------------------------------------
+
+// region_capture: Convert the recorded labels to names, the used labels keep
+// the address seen and the copy of their forward reference. The current
+// reference must be one of them, or the one left before the region
+// -----------------------------------------------------------------------------
+RegionLabels* region_capture(int start, bool* valid, bool* keepRefer){
+	bool found = curr_refer == NULL;
+	RegionLabels* labels = NULL;
+	for(ExpDeps* dep = region_defs; dep != NULL; dep = dep->next)
+		labels = insertrlab(labels, dep->label->name, dep->label->addr, true);
+	
+	for(ExpDeps* dep = region_deps; dep != NULL; dep = dep->next){
+		bool internal = false;
+		for(ExpDeps* def = region_defs; def != NULL && !internal; def = def->next)
+			internal = def->label == dep->label;
+		if(internal)
+			continue;
+		labels = insertrlab(labels, dep->label->name, dep->addr, false);
+		if(dep->hasRef){
+			labels->hasRef = true;
+			labels->ref = *dep->live;
+			labels->ref.addr -= start;
+			labels->ref.expression = (dep->live->expression) ? strdup(dep->live->expression) : NULL;
+			labels->ref.next = NULL;
+			labels->refer = !found && dep->live == curr_refer;
+			found = found || labels->refer;
+			*valid = labels->ref.addr >= 0 && *valid;
+		}
+	}
+	*keepRefer = !found && curr_refer == region_stale;
+	*valid = *valid && (found || *keepRefer);
+	return labels;
+}
+// -----------------------------------------------------------------------------
+
+// region_leave: Finish the recording of the included file, keeping the region
+// when it changed only its own bytes and labels
+// -----------------------------------------------------------------------------
+void region_leave(const char* path, RegionMark* mark, bool assembled){
+	if(!mark->recording)
+		return;
+	region_recording = false;
+	
+	bool valid = assembled && region_pure && !isExport && mark->org == org_num
+				&& mark->labels == label_list && mark->defines == define_list && mark->macros == macro_list;
+	int* counters = NULL;
+	int ncounters = region_counters(&counters);
+	valid = valid && ncounters == mark->ncounters;
+	
+	if(valid){
+		RegionList** li = &region_list;
+		while(*li != NULL && strcmp((*li)->path, path) != 0)
+			li = &(*li)->next;
+		if(*li != NULL){
+			RegionList* old = *li;
+			*li = old->next;
+			old->next = NULL;
+			freereg(old);
+		}
+		
+		RegionList* region = (RegionList*) calloc(1, sizeof(RegionList));
+		snprintf(region->path, sizeof(region->path), "%s", path);
+		region->start = mark->start;
+		region->org = mark->org;
+		region->ifstate = mark->ifstate;
+		region->symbols = mark->symbols;
+		region->labels = region_capture(mark->start, &valid, &region->keepRefer);
+		region->files = region_files;
+		region_files = NULL;
+		for(int i = 0; i < ncounters; i++)
+			counters[i] -= mark->counters[i];
+		region->counters = counters;
+		region->ncounters = ncounters;
+		region->staleUse = region_use;
+		counters = NULL;
+		region->length = code_index - mark->start;
+		region->code = (unsigned char*) malloc(region->length + 1);
+		memcpy(region->code, &code_address[mark->start], region->length);
+		
+		if(valid){
+			region->next = region_list;
+			region_list = region;
+		}else{
+			freereg(region);
+		}
+	}
+	
+	free(counters);
+	free(mark->counters);
+	freesrc(region_files);
+	freedep(region_deps);
+	freedep(region_defs);
+	region_files = NULL;
+	region_deps = region_defs = NULL;
+	region_stale = NULL;
+}
+// -----------------------------------------------------------------------------
+// **********************************************************************************
+
+// push_context: Save the reading states before expanding a macro, REP or IF
+// body. The expansions still recurse on the C stack, the expansion depth
+// bounds that recursion before the stack overflows
+// -----------------------------------------------------------------------------
+bool push_context(int kind){
+	if(context_top >= expansion_depth){
+		char msg[64];
+		snprintf(msg, sizeof(msg), "Expansion depth limit of %d exceeded", expansion_depth);
+		printerr(msg);
+		return false;
+	}
+	if(context_top == context_size){
+		context_size = (context_size) ? context_size * 2 : 16;
+		context_stack = (ExpansionContext*) realloc(context_stack, context_size * sizeof(ExpansionContext));
+	}
+	ExpansionContext* ctx = &context_stack[context_top++];
+	ctx->kind = kind;
+	ctx->linenum = linenum;
+	ctx->bufferget = bufferget;
+	ctx->ifstate = ifstate;
+	ctx->isIF = isIF;
+	ctx->isELSE = isELSE;
+	ctx->frame = currframe;
+	ctx->macro = currmacro;
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// pop_context: Restore the reading states when the expanded body ends, the
+// IF states and the frame only belong to the macro contexts
+// -----------------------------------------------------------------------------
+void pop_context(){
+	ExpansionContext* ctx = &context_stack[--context_top];
+	linenum = ctx->linenum;
+	bufferget = ctx->bufferget;
+	if(ctx->kind == CTX_MACRO){
+		ifstate = ctx->ifstate;
+		isIF = ctx->isIF;
+		isELSE = ctx->isELSE;
+		currframe = ctx->frame;
+		currmacro = ctx->macro;
+	}
+}
+// -----------------------------------------------------------------------------
+
+// assemble_macro: Expand the invoked macro frame, replaying the memoized
+// expansion when its arguments and symbols didn't change
+// -----------------------------------------------------------------------------
+bool assemble_macro(){
+	if(!push_context(CTX_MACRO)){
+		frame_top = invoked_frame->mark;
+		return false;
+	}
+	linesrc = linenum;
+	currframe = invoked_frame;
+	currmacro = currframe->macro;
+	linebegin = currmacro->line + 1;
+	
+	// expansions without labels and other side effects are memoized
+	bool memoize = !memo_recording && currmacro->tmpl.prep == NULL && curr_refer == NULL && !isExport;
+	if(memoize){
+		ExpansionList* exp = memo_lookup(currframe);
+		if(exp != NULL){
+			if(memo_replay(exp)){
+				memo_hits++;
+				isBuffer = false;
+				frame_top = currframe->mark;
+				pop_context();
+				return true;
+			}
+			memo_remove(currmacro, exp);
+		}
+		memo_misses++;
+		memo_begin();
+	}
+	int code_start = code_index;
+	
+	bool assembled = assemble_template(&currmacro->tmpl, isVerbose);
+	
+	// the expansion is stored with the IF states restored by the context,
+	// before its frame is released
+	MacroFrame* frame = currframe;
+	pop_context();
+	if(memoize)
+		memo_store(frame, code_start, assembled);
+	frame_top = frame->mark;
+	
+	return assembled;
+}
+
+// **********************************************************************************
+
+// FUNCTIONS TO RUN EACH STEP OF THE ASSEMBLER
+// **********************************************************************************
+
+bool get_operand_states(){
+	isMnemonic = false;
+	syntax_6502 = token[0] == '$';
+	syntax_PIC = (token[0] == 'H' && token[1] == '\'');
+	syntax_Intel = (token[0] == '0' && token[1] == 'X');
+	syntax_GAS = token[0] == '%';
+	isDecimal = (token[0] >= 0x30 && token[0] <= 0x39) && token[1] != 'X' || token[0] == '-';
+	isHexadecimal = syntax_6502 || syntax_PIC || syntax_Intel;
+	
+	reg_index = check_register(syntax_GAS);
+	
+	bool operand_state = isHexadecimal || syntax_GAS || isDecimal || reg_index != -1;
+	
+	return operand_state;
+}
+
+bool get_mnemonic_states(){
+	isOrg = mnemonic_index == 54;
+	isInclude = mnemonic_index == 55;
+	isRepeat = mnemonic_index == 56;
+	isIF = mnemonic_index == 57;
 	isELSE = mnemonic_index == 58;
 	isIncB = mnemonic_index == 59;
 	isExportCurr = mnemonic_index == 60;
@@ -1965,14 +3555,14 @@ bool get_mnemonic_states(){
 	return mnemonic_state;
 }
 
-char *saveptr;
+WR80_TLS char *saveptr;
 
 void initial_spaced_token(){
-	token = strtok(line, " ");
+	token = strtok_r(line, " ", &strtok_save);
 }
 
 void next_spaced_token(){
-	token = strtok(NULL, " ");
+	token = strtok_r(NULL, " ", &strtok_save);
 }
 
 bool skip_attribs_line(){
@@ -1994,21 +3584,27 @@ bool skip_line_comment(){
     return isLineComment;
 }
 
-void set_local_labels(){
-	int pos = find(token, "##");
-    if(pos != -1){
-        char argument[32] = {0};
-        int ilabB = 0;
+// set_local_labels: Substitute the ## local labels of the token and, on the
+// operand, the arguments of the current macro in a single pass, into the
+// caller's buffer
+// -----------------------------------------------------------------------------
+bool set_local_labels(bool isOperand, char* dest, size_t size){
+	if(strchr(token, '#') == NULL)
+		return true;
 
-        if(!isMnemonic)
-            ilabB = (isMacroScope) ? ++currmacro->ilabelB : ++ilabelB;
-        else
-            ilabB = (isMacroScope) ? ++currmacro->ilabelC : ++ilabelC;
+	int* ilabB = NULL;
+	bool hasFrame = isMacroScope && currmacro != NULL;
+	if(!isMnemonic)
+		ilabB = (hasFrame) ? &currmacro->ilabelB : &ilabelB;
+	else
+		ilabB = (hasFrame) ? &currmacro->ilabelC : &ilabelC;
 
-        snprintf(argument, sizeof(argument), "%d", ilabB);
-        token = replace(token, "##", argument);
-    }
+	if(!subst_args(token, dest, size, (isOperand) ? currframe : NULL, ilabB))
+		return false;
+	token = dest;
+	return true;
 }
+// -----------------------------------------------------------------------------
 
 void check_GAS_register(){
 	syntax_GAS = token[0] == '%';
@@ -2016,7 +3612,7 @@ void check_GAS_register(){
 }
 
 bool skip_directives_command(){
-	toIgnore = strcmp(token, "DEFINE") == 0 || toIgnore;
+	toIgnore = strcmp(token, "DEFINE") == 0 || strcmp(token, "PRAGMA") == 0 || toIgnore;
     toIgnore = skip_block(block[MACRO_I].begin, block[MACRO_I].end) || toIgnore;
     return toIgnore;
 }
@@ -2025,7 +3621,10 @@ bool check_mnemonic(){
 	isMnemonic = true;
     mnemonic = token;
 	mnemonic_index = get_mnemonic();
-    return (mnemonic_index != -1);
+	if(mnemonic_index == -1)
+		return false;
+	mnemonic = (char*) mnemonics[mnemonic_index];	// the token may be a tokenizer buffer
+    return true;
 }
 
 // format_operand: This function concat tokens in operands
@@ -2046,7 +3645,7 @@ bool get_operand(){
 			int new_size = strlen(operand) + strlen(token) + 1;
 			char *tmp = realloc(operand, new_size);
 	        if (!tmp) {
-	            printf("error in realloc!\n");
+	            diag_error(stdout, "error in realloc!\n");
 	            return false;
 	        }
 	        operand = tmp;
@@ -2067,13 +3666,17 @@ bool get_operand(){
 bool tokenizer()
 {
 	int count_tok = 0;
+	char name[MAX_LINE_LENGTH];
 	
-    format_line();
+	if(!lineFormatted)
+    	format_line();
+    lineFormatted = false;
     if(skip_attribs_line())
 		return true;
 		
     reset_states();
-    set_local_labels();
+	if(!set_local_labels(false, name, sizeof(name)))
+		return false;
     
 	if(get_operand_states()){
 		printerr("Invalid mnemonic");
@@ -2091,11 +3694,22 @@ bool tokenizer()
 		return true;
     if(!get_operand())
     	return true;
-    	
+    
+    return tokenize_operand();
+}
+// -----------------------------------------------------------------------------
+
+// tokenize_operand: The tokenizer step of the operand joined in the token,
+// substituting the macro arguments and the definitions
+// -----------------------------------------------------------------------------
+bool tokenize_operand(){
+	char text[MAX_LINE_LENGTH];
+	
     get_operand_states();
     
     check_GAS_register();
-    set_local_labels();
+    if(!set_local_labels(true, text, sizeof(text)))
+    	return false;
 		
     get_operand_states();
 
@@ -2104,6 +3718,7 @@ bool tokenizer()
 			return false;
 	
     operand = strdup(token);
+    token = operand;
     
     get_operand_states();
     
@@ -2111,6 +3726,43 @@ bool tokenizer()
 }
 // -----------------------------------------------------------------------------
 
+// tokenize_stmt: The tokenizer of a template instruction, with the same
+// states from its parsed mnemonic. Only the operand of the line is read, its
+// tokens joined up to the comment as get_operand does
+// -----------------------------------------------------------------------------
+bool tokenize_stmt(const MacroStmt* stmt){
+	char joined[MAX_LINE_LENGTH];
+	
+	lineFormatted = false;
+	strtok_save = &line[stmt->length];	// the line is read as the tokenizer would
+	reset_states();
+	token = (char*) mnemonics[stmt->mnemonic];
+	get_operand_states();
+	isMnemonic = true;
+	mnemonic_index = stmt->mnemonic;
+	mnemonic = token;
+	get_mnemonic_states();
+	if(stmt->operand == -1)
+		return true;
+	
+	int length = 0;
+	bool comment = false;
+	for(int i = stmt->operand; line[i] != '\0'; i++){
+		if(line[i] == ' ')
+			continue;
+		if(line[i] == ';'){
+			isLineComment = line[i-1] == ' ' || isLineComment;
+			comment = true;
+		}
+		if(!comment)
+			joined[length++] = line[i];
+	}
+	joined[length] = '\0';
+	token = joined;
+	return tokenize_operand();
+}
+// -----------------------------------------------------------------------------
+
 // parser: it's the sintatic analyzer step checking the syntax
 // -----------------------------------------------------------------------------
 bool parser(){
@@ -2173,6 +3825,8 @@ bool parse_addressing(int index){
 			
 			number = strtol(dest, &endptr, 10);
 			
+			if(region_recording && curr_refer == region_stale)
+				region_refer(isBitGetter);
 			if(curr_refer)
 				if(curr_refer->isExpression)
 					number = 0xFFFF;
@@ -2260,12 +3914,12 @@ bool parse_addressing(int index){
 }
 // -----------------------------------------------------------------------------
 
-int calls = 0;
+WR80_TLS int calls = 0;
 // generator: It's the machine code generation, can be the semantic analyzer too
 // -----------------------------------------------------------------------------
 bool generator(){
 	if(dcb_process())	
-		return true;
+		return !directive_error;
 	if(isOrg){
 		proc_org();
 		return true;
@@ -2311,6 +3965,8 @@ bool generator(){
 		
     unsigned char opcode = opcodes[mnemonic_index];
     char operand_byte1, operand_byte2;
+    if(!code_room(2))
+    	return false;
     
     if(addressing[mnemonic_index] & REG || addressing[mnemonic_index] & IMM){
 		operand_byte1 = (char) number & 0xFF;
@@ -2319,6 +3975,7 @@ bool generator(){
 	}else{
 		if(addressing[mnemonic_index] & REL && isRelative){
 			if(number != 0xFFFF){
+				memo_pure = false;
 				int PC = code_index + org_num;
 				operand_byte1 = (char) (((number - (PC + 2)) & 0xF00) >> 8);
 				operand_byte2 = (char) ((number - (PC + 2)) & 0xFF);
@@ -2356,7 +4013,7 @@ bool generator(){
 // changeExtension: switch the extension name from the source file by other extension
 // -----------------------------------------------------------------------------
 char* changeExtension(const char *filename, const char* ext){
-	char *newName = malloc(strlen(filename) + 1);
+	char *newName = malloc(strlen(filename) + strlen(ext) + 1);
 	strcpy(newName, filename);
 	
 	char *point = strrchr(newName, '.');
@@ -2370,55 +4027,143 @@ char* changeExtension(const char *filename, const char* ext){
 }
 // -----------------------------------------------------------------------------
 
-// writeHex: create the hexadecimal file logisim-compatible
+// formatHex: text of the hexadecimal file logisim-compatible
 // -----------------------------------------------------------------------------
-int writeHex(const char *filename, unsigned char *machinecode, size_t size){
-	FILE *f = fopen(filename, "w");
-	if(!f){
-		perror("Error in opening the file!\n");
-		exit(1);
-	}
-	
+char* formatHex(unsigned char *machinecode, size_t size, long *length){
 	const char* header = "v2.0 raw";
-	fprintf(f, "%s\n", header);
+	char* text = (char*) malloc(strlen(header) + size * 3 + size / 16 + 3);
+	if(text == NULL)
+		return NULL;
 	
+	long pos = sprintf(text, "%s\n", header);
 	for(size_t i = 0; i < size; i++){
-		fprintf(f, "%02X ", machinecode[i]);
+		pos += sprintf(&text[pos], "%02X ", machinecode[i]);
 		if((i + 1) % 16 == 0){
-			fprintf(f, "\n");
+			text[pos++] = '\n';
 		}
 	}
 	
 	if(size % 16 != 0){
-		fprintf(f, "\n");
+		text[pos++] = '\n';
 	}
-	
-	fclose(f);
-	return (size * 3) + ceil((double)size / 16) * 2 + strlen(header) + 2;
+	text[pos] = '\0';
+	*length = pos;
+	return text;
 }
 // -----------------------------------------------------------------------------
 
-// writeBin: create the raw binary file for possible emulators
+// openTemp: Create a temporary file with an unique name in the directory of
+// the file, to be renamed over it when complete. Returns NULL on fail
 // -----------------------------------------------------------------------------
-void writeBin(const char *filename, unsigned char *machinecode, size_t size){
-	FILE *f = fopen(filename, "wb");
+FILE* openTemp(const char *filename, char *temp, size_t size, bool text){
+	int length = snprintf(temp, size, "%s.XXXXXX", filename);
+	if(length < 0 || (size_t) length >= size){
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+#ifdef _WIN32
+	if(_mktemp_s(temp, length + 1) != 0)
+		return NULL;
+	return fopen(temp, (text) ? "w" : "wb");
+#else
+	int fd = mkstemp(temp);
+	if(fd == -1)
+		return NULL;
+	// mkstemp creates the file private, keep the mode of the replaced one
+	struct stat info;
+	fchmod(fd, (stat(filename, &info) == 0) ? (info.st_mode & 0777) : 0644);
+	FILE *f = fdopen(fd, (text) ? "w" : "wb");
 	if(!f){
-		perror("Error in opening the file!\n");
-		exit(1);
+		close(fd);
+		remove(temp);
 	}
+	return f;
+#endif
+}
+// -----------------------------------------------------------------------------
+
+// sameOutput: Check if the output file already has the content, read in text
+// mode for the hexa files as they are written
+// -----------------------------------------------------------------------------
+bool sameOutput(const char *filename, const char *data, long length, bool text){
+	char chunk[4096];
+	FILE *f = fopen(filename, (text) ? "r" : "rb");
+	if(!f)
+		return false;
 	
-	fwrite(machinecode, 1, size, f);
-	
+	long pos = 0;
+	size_t count;
+	bool same = true;
+	while(same && (count = fread(chunk, 1, sizeof(chunk), f)) > 0){
+		same = pos + (long) count <= length && memcmp(chunk, &data[pos], count) == 0;
+		pos += count;
+	}
+	same = same && !ferror(f) && pos == length;
 	fclose(f);
+	return same;
+}
+// -----------------------------------------------------------------------------
+
+// replaceOutput: Write the output file only when its content changes, in a
+// temporary file renamed over the old one. The unchanged files keep their
+// time. Returns 1 when written, 0 when unchanged and -1 on fail
+// -----------------------------------------------------------------------------
+int replaceOutput(const char *filename, const char *data, long length, bool text){
+	if(sameOutput(filename, data, length, text))
+		return 0;
+	
+	char temp[512];
+	FILE *f = openTemp(filename, temp, sizeof(temp), text);
+	if(!f){
+		diag_perror("Error in opening the file!\n");
+		return -1;
+	}
+	bool written = fwrite(data, 1, length, f) == (size_t) length;
+	written = fclose(f) == 0 && written;
+#ifdef _WIN32
+	if(written)
+		remove(filename);
+#endif
+	if(!written || rename(temp, filename) != 0){
+		remove(temp);
+		diag_perror("Error in writing the file!\n");
+		return -1;
+	}
+	return 1;
+}
+// -----------------------------------------------------------------------------
+
+// writeHex: create the hexadecimal file logisim-compatible
+// -----------------------------------------------------------------------------
+int writeHex(const char *filename, unsigned char *machinecode, size_t size){
+	long length = 0;
+	char* text = formatHex(machinecode, size, &length);
+	if(text == NULL || replaceOutput(filename, text, length, true) == -1){
+		free(text);
+		return -1;
+	}
+	free(text);
+	return (size * 3) + ceil((double)size / 16) * 2 + strlen("v2.0 raw") + 2;
+}
+// -----------------------------------------------------------------------------
+
+// writeBin: create the raw binary file for possible emulators
+// -----------------------------------------------------------------------------
+bool writeBin(const char *filename, unsigned char *machinecode, size_t size){
+	return replaceOutput(filename, (const char*) machinecode, size, false) != -1;
 }
 // -----------------------------------------------------------------------------
 
 // load_file_to_buffer: Read the file and store in a memory buffer
 // -----------------------------------------------------------------------------
 char *load_file_to_buffer(const char *filename, long *filesize) {
+    char *served = vfs_read(filename, filesize);
+    if (served != NULL)
+        return served;
+
     FILE *file = fopen(filename, "rb");
     if (!file) {
-        perror("Error in opening the file");
+        diag_perror("Error in opening the file");
         return NULL;
     }
 
@@ -2428,7 +4173,7 @@ char *load_file_to_buffer(const char *filename, long *filesize) {
 
     char *buffer = (char *)malloc(*filesize + 1);
     if (!buffer) {
-        perror("Error in allocate memory");
+        diag_perror("Error in allocate memory");
         fclose(file);
         return NULL;
     }
@@ -2437,7 +4182,7 @@ char *load_file_to_buffer(const char *filename, long *filesize) {
     fclose(file);
 
     if (read_size != *filesize) {
-        fprintf(stderr, "Error: imcomplete reading of file\n");
+        diag_error(stderr, "Error: imcomplete reading of file\n");
         free(buffer);
         return NULL;
     }
@@ -2470,6 +4215,350 @@ char *buffer_fgets(char *line, size_t maxlen, const char **bufptr) {
 // -----------------------------------------------------------------------------
 // **********************************************************************************
 
+// FUNCTIONS TO PREFETCH THE INCLUDED FILES
+// **********************************************************************************
+
+// vfs_read: Copy of the file served by the reader of the context, NULL if
+// there is no reader or it doesn't serve the path
+// -----------------------------------------------------------------------------
+char* vfs_read(const char* path, long* size){
+	if(vfs_reader == NULL)
+		return NULL;
+	long length = 0;
+	const char* content = vfs_reader(vfs_user, path, &length);
+	if(content == NULL || length < 0)
+		return NULL;
+	char* buffer = (char*) malloc(length + 1);
+	if(buffer == NULL)
+		return NULL;
+	memcpy(buffer, content, length);
+	buffer[length] = '\0';
+	*size = length;
+	return buffer;
+}
+// -----------------------------------------------------------------------------
+
+// vfs_load: Keep the copy of the included file served by the reader, false
+// when the file is read from the disk
+// -----------------------------------------------------------------------------
+bool vfs_load(IncludeList* inc){
+	long size = 0;
+	char* buffer = vfs_read(inc->path, &size);
+	if(buffer == NULL)
+		return false;
+	inc->buffer = buffer;
+	inc->size = size;
+	inc->hash = hash_text(5381 + size, buffer);
+	inc->served = true;
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// file_exists: Check if the file is served by the reader or is on the disk
+// -----------------------------------------------------------------------------
+bool file_exists(const char* path){
+	long size = 0;
+	struct stat info;
+	return (vfs_reader != NULL && vfs_reader(vfs_user, path, &size) != NULL) || stat(path, &info) == 0;
+}
+// -----------------------------------------------------------------------------
+
+// resolve_path: Get the path of the file named in the source: the name itself
+// if the file exists, or else the first search path (-I) that has it. The
+// resolutions are kept and the name is returned when no path has the file
+// -----------------------------------------------------------------------------
+const char* resolve_path(const char* name){
+	if(search_count == 0 || name[0] == '/' || name[0] == '\\' || (name[0] != '\0' && name[1] == ':'))
+		return name;
+	PathList* known = getpath(path_list, name);
+	if(known != NULL)
+		return known->path;
+	
+	char path[256];
+	snprintf(path, sizeof(path), "%s", name);
+	for(int i = 0; i < search_count && !file_exists(path); i++){
+		int length = strlen(search_paths[i]);
+		bool slash = length == 0 || search_paths[i][length - 1] == '/' || search_paths[i][length - 1] == '\\';
+		snprintf(path, sizeof(path), "%s%s%s", search_paths[i], (slash) ? "" : "/", name);
+	}
+	if(!file_exists(path))
+		snprintf(path, sizeof(path), "%s", name);
+	path_list = insertpath(path_list, name, path);
+	return path_list->path;
+}
+// -----------------------------------------------------------------------------
+
+// prefetch_load: Read the included file on its prefetch thread. The failures
+// are silent, the pass reads the file again and reports them
+// -----------------------------------------------------------------------------
+void prefetch_load(IncludeList* inc){
+	FILE* file = fopen(inc->path, "rb");
+	if(file == NULL)
+		return;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+	char* buffer = (size >= 0) ? (char*) malloc(size + 1) : NULL;
+	if(buffer != NULL && fread(buffer, 1, size, file) == (size_t) size){
+		buffer[size] = '\0';
+		inc->buffer = buffer;
+		inc->size = size;
+		inc->hash = hash_text(5381 + size, buffer);
+		fstat(fileno(file), &inc->stat);
+	}else{
+		free(buffer);
+	}
+	fclose(file);
+}
+// -----------------------------------------------------------------------------
+
+#ifdef _WIN32
+DWORD WINAPI prefetch_thread(LPVOID inc){
+	prefetch_load((IncludeList*) inc);
+	return 0;
+}
+#else
+void* prefetch_thread(void* inc){
+	prefetch_load((IncludeList*) inc);
+	return NULL;
+}
+#endif
+// -----------------------------------------------------------------------------
+
+// prefetch_scan: Find the INCLUDE directives of the source text, starting the
+// read of each new file on a background thread
+// -----------------------------------------------------------------------------
+void prefetch_scan(const char* text){
+	char path[256];
+	const char* bufptr = text;
+	while(*bufptr != '\0'){
+		const char* start = bufptr + strspn(bufptr, " \t");
+		bufptr = start + strcspn(start, "\n");
+		if(*bufptr == '\n')
+			bufptr++;
+		
+		int c = 0;
+		while(c < 7 && toupper((unsigned char) start[c]) == "INCLUDE"[c])
+			c++;
+		if(c < 7 || (start[7] != ' ' && start[7] != '\t'))
+			continue;
+		const char* name = strchr(start, '"');
+		if(name == NULL || name > bufptr)
+			continue;
+		int length = strcspn(++name, "\"\n");
+		if(length == 0 || length >= (int) sizeof(path) || name[length] != '"')
+			continue;
+		memcpy(path, name, length);
+		path[length] = '\0';
+		if(strchr(path, '#') != NULL)
+			continue;
+		const char* resolved = resolve_path(path);
+		if(getinc(include_list, resolved) != NULL)
+			continue;
+		
+		include_list = insertinc(include_list, resolved);
+		if(vfs_load(include_list))
+			continue;
+#ifdef _WIN32
+		include_list->thread = CreateThread(NULL, 0, prefetch_thread, include_list, 0, NULL);
+		include_list->started = include_list->thread != NULL;
+#else
+		include_list->started = pthread_create(&include_list->thread, NULL, prefetch_thread, include_list) == 0;
+#endif
+		if(!include_list->started)
+			prefetch_load(include_list);
+	}
+}
+// -----------------------------------------------------------------------------
+
+// join_include: Wait the prefetch thread of the file if it's running
+// -----------------------------------------------------------------------------
+bool join_include(IncludeList* inc){
+	if(!inc->started)
+		return false;
+#ifdef _WIN32
+	WaitForSingleObject(inc->thread, INFINITE);
+	CloseHandle(inc->thread);
+#else
+	pthread_join(inc->thread, NULL);
+#endif
+	inc->started = false;
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// wait_include: Get the prefetched file, waiting for its thread only when it
+// didn't finish yet. The included files of a new text are prefetched too.
+// The files kept between assemblies are read again when changed on disk
+// -----------------------------------------------------------------------------
+IncludeList* wait_include(const char* filename){
+	IncludeList* inc = getinc(include_list, filename);
+	if(inc == NULL)
+		return NULL;
+	bool loaded = join_include(inc);
+	if(!loaded && keep_caches){
+		struct stat info;
+		bool changed = inc->served || stat(inc->path, &info) != 0 || inc->buffer == NULL
+					|| info.st_mtime != inc->stat.st_mtime || info.st_size != inc->stat.st_size
+					|| info.st_ino != inc->stat.st_ino || info.st_dev != inc->stat.st_dev;
+		if(changed){
+			free(inc->buffer);
+			inc->buffer = NULL;
+			inc->size = 0;
+			inc->served = false;
+			if(!vfs_load(inc))
+				prefetch_load(inc);
+			loaded = true;
+		}
+	}
+	if(loaded && inc->buffer != NULL)
+		prefetch_scan(inc->buffer);
+	return inc;
+}
+// -----------------------------------------------------------------------------
+
+// forget_include: Drop the kept copy of a file changed on disk, read again
+// on its next use even if its time and size look the same. The resolved
+// names are dropped too, a search path may have a new file
+// -----------------------------------------------------------------------------
+void forget_include(const char* filename){
+	freepath(path_list);
+	path_list = NULL;
+	IncludeList* inc = getinc(include_list, filename);
+	if(inc == NULL)
+		return;
+	join_include(inc);
+	free(inc->buffer);
+	inc->buffer = NULL;
+	inc->size = 0;
+}
+// -----------------------------------------------------------------------------
+
+// close_includes: Wait the prefetch threads and release the files, unless
+// they are kept warm for the next assemblies
+// -----------------------------------------------------------------------------
+void close_includes(){
+	for(IncludeList* inc = include_list; inc != NULL; inc = inc->next)
+		join_include(inc);
+	if(keep_caches)
+		return;
+	freeinc(include_list);
+	include_list = NULL;
+}
+// -----------------------------------------------------------------------------
+
+// add_source: Record a file read by the assembly, once for each path
+// -----------------------------------------------------------------------------
+void add_source(const char* filename, int kind){
+	if(region_recording && kind != SRC_TEXT)
+		region_pure = false;
+	if(getsrc(source_list, filename) == NULL)
+		source_list = insertsrc(source_list, filename, kind);
+}
+// -----------------------------------------------------------------------------
+
+// open_source: Open the source file for the pass, from the prefetched copy
+// when the C library can read a memory buffer as a stream
+// -----------------------------------------------------------------------------
+FILE* open_source(const char* filename){
+	add_source(filename, SRC_TEXT);
+	IncludeList* inc = wait_include(filename);
+	if(inc == NULL){
+		inc = include_list = insertinc(include_list, filename);
+		if(!vfs_load(inc))
+			prefetch_load(inc);
+		if(inc->buffer != NULL)
+			prefetch_scan(inc->buffer);
+	}
+	region_file(inc);
+#ifndef _WIN32
+	if(inc->buffer != NULL && inc->size > 0)
+		return fmemopen(inc->buffer, inc->size, "r");
+#endif
+	if(inc->served){
+		FILE* file = tmpfile();
+		if(file != NULL){
+			fwrite(inc->buffer, 1, inc->size, file);
+			rewind(file);
+		}
+		return file;
+	}
+	return fopen(filename, "r");
+}
+// -----------------------------------------------------------------------------
+
+// load_source: Copy of the prefetched file for the buffer passes
+// -----------------------------------------------------------------------------
+char* load_source(const char* filename, long* filesize){
+	add_source(filename, SRC_TEXT);
+	IncludeList* inc = wait_include(filename);
+	region_file(inc);
+	if(inc == NULL || inc->buffer == NULL)
+		return load_file_to_buffer(filename, filesize);
+	char* buffer = (char*) malloc(inc->size + 1);
+	if(buffer == NULL)
+		return NULL;
+	memcpy(buffer, inc->buffer, inc->size + 1);
+	*filesize = inc->size;
+	return buffer;
+}
+// -----------------------------------------------------------------------------
+// **********************************************************************************
+
+// FUNCTIONS TO INCLUDE THE FILES ONCE
+// **********************************************************************************
+
+// once_file: Get the included file by the name resolved in the source, or by
+// its identity when named by another path: the inode of the file on disk or
+// the canonical path of the files served by the reader
+// -----------------------------------------------------------------------------
+OnceList* once_file(const char* name){
+	for(OnceList* file = once_list; file != NULL; file = file->next)
+		if(strcmp(file->name, name) == 0)
+			return file;
+	
+	char path[256];
+	struct stat info;
+	unsigned long long dev = 0, ino = 0;
+	if(stat(name, &info) == 0){
+		dev = info.st_dev;
+		ino = info.st_ino;
+	}
+#ifdef _WIN32
+	if(_fullpath(path, name, sizeof(path)) == NULL)
+		snprintf(path, sizeof(path), "%s", name);
+#else
+	char* real = realpath(name, NULL);
+	snprintf(path, sizeof(path), "%s", (real != NULL) ? real : name);
+	free(real);
+#endif
+	OnceList* file = getonce(once_list, path, dev, ino);
+	if(file == NULL)
+		file = once_list = insertonce(once_list, name, path, dev, ino);
+	return file;
+}
+// -----------------------------------------------------------------------------
+
+// once_skip: Mark the file as included by the current pass, returning true
+// if it was included before in this pass by an INCLUDE ONCE or a file with
+// PRAGMA ONCE. The first include reads the pragma, so the passes skip the same
+// -----------------------------------------------------------------------------
+bool once_skip(const char* name, bool once){
+	OnceList* file = once_file(name);
+	int pass = (isInclude) ? ONCE_ASSEMBLY : ONCE_PREPROCESS;
+	bool skip = (file->passes & pass) && (once || file->pragma);
+	file->passes |= pass;
+	if(!skip)
+		return false;
+	if(region_recording)
+		region_pure = false;
+	if(isVerbose)
+		diag_printf("Include skipped, already included: %s\n", name);
+	return true;
+}
+// -----------------------------------------------------------------------------
+// **********************************************************************************
+
 // FUNCTIONS TO PREPROCESS AND ASSEMBLE THE FILE OR BUFFER
 // **********************************************************************************
 
@@ -2480,9 +4569,9 @@ char *buffer_fgets(char *line, size_t maxlen, const char **bufptr) {
 bool preprocess_file(char *filename, bool verbose){
 	
 	isVerbose = verbose;
-	FILE *file = fopen(filename, "r");
+	FILE *file = open_source(filename);
     if (file == NULL) {
-        perror("Error in opening the file");
+        diag_perror("Error in opening the file");
         return false;
     }
     
@@ -2490,6 +4579,11 @@ bool preprocess_file(char *filename, bool verbose){
     isBuffer = false;
     currentfile = filename;
     
+    BlockIndex index;
+    BlockIndex* blockstmp = file_blocks;
+    open_blocks(&index, NULL, file);
+    file_blocks = &index;
+    
     if(!listInitialized){
 	    define_list = begin_def();
 	    dcb_list = begin_dcb();
@@ -2512,11 +4606,11 @@ bool preprocess_file(char *filename, bool verbose){
 		
 		format_line();
 		
-    	if(verbose) printf("Preprocessor Line: %s\n", line);
+    	if(verbose) diag_printf("Preprocessor Line: %s\n", line);
     	
     	int i = 0;
     	int length = strcspn(&line[i], ":");
-		token = strtok(line, " ");
+		token = strtok_r(line, " ", &strtok_save);
 		
 		if(token == NULL || token[0] == ';') {
 			linenum++;
@@ -2560,18 +4654,26 @@ bool preprocess_file(char *filename, bool verbose){
 		if(get_directive() == -1){	// LEAK: Fluxo
 			if(get_mnemonic() == -1){
 				label = token;
-				if(!get_label(length))
+				if(!get_label(length)){
+					file_blocks = blockstmp;
+					freeblocks(&index);
 					return false;
+				}
 			}	
 		}else{
-			if(directive_error)
+			if(directive_error){
+				file_blocks = blockstmp;
+				freeblocks(&index);
 				return false;
+			}
 		} 
 			
 		token = NULL;
 		linenum++;
 	}
 
+	file_blocks = blockstmp;
+	freeblocks(&index);
 	fclose(file);
 	return true;
 }
@@ -2592,9 +4694,9 @@ bool assemble_file(char *filename, unsigned char **compiled, bool verbose) {
 	//showdef(define_list);
 	
 	if(memory == NULL){
-		memory = (unsigned char *) malloc(MEMORY_EMULATOR * sizeof(unsigned char));
+		memory = (unsigned char *) malloc((MEMORY_EMULATOR + 1) * sizeof(unsigned char));	// 64K of the emulator
 		if (memory == NULL) {
-	        printf("Error in allocate memory.");
+	        diag_error(stdout, "Error in allocate memory.");
 	        return 0;
 	    }
     	code_address = memory;
@@ -2605,9 +4707,9 @@ bool assemble_file(char *filename, unsigned char **compiled, bool verbose) {
     	    code_address[3] = (char) wll_counter;
     	    wll_table_alloc = 4;
 			if(verbose){
-	    	    printf("\nExport Symbol Table: \n");
+	    	    diag_printf("\nExport Symbol Table: \n");
 	    	    for(int i = 0; i < wll_counter; i++)
-	    	    	printf("Symbol %d : '%s'\n", i, label_pointer[i]);				
+	    	    	diag_printf("Symbol %d : '%s'\n", i, label_pointer[i]);				
 			}
 		}
 	}
@@ -2616,15 +4718,21 @@ bool assemble_file(char *filename, unsigned char **compiled, bool verbose) {
     isBuffer = false;
     currentfile = filename;
 
-    FILE *file = fopen(filename, "r");
+    FILE *file = open_source(filename);
     if (file == NULL) {
-        perror("Error in opening the file");
-        exit(EXIT_FAILURE);
+        diag_perror("Error in opening the file");
+        return false;
     }
+    
+    BlockIndex index;
+    BlockIndex* blockstmp = file_blocks;
+    open_blocks(&index, NULL, file);
+    index.quiet = true;
+    file_blocks = &index;
 	
     while (fgets(line, sizeof(line), file)) {
     	fileopened = file;
-    	if(verbose) printf("Assembly line: %s", line);
+    	if(verbose) diag_printf("Assembly line: %s", line);
     	int x = 0;
     	for(; line[x] == 0x20 || line[x] == 0x09; x++);
     	if(strcmp(&line[x], "\n") == 0){
@@ -2664,11 +4772,8 @@ bool assemble_file(char *filename, unsigned char **compiled, bool verbose) {
 	
 	
 	
-	if(code_index > 4096){
-		perror("Error: The maximum program size is 4096 bytes.");
-        exit(EXIT_FAILURE);
-	}
-	
+	file_blocks = blockstmp;
+	freeblocks(&index);
     fclose(file);
 	
 	*compiled = code_address;
@@ -2685,6 +4790,10 @@ bool preprocess_buffer(const char *buffer, bool verbose){
     const char *bufptr = buffer;
     linenum = linebegin;
     
+    BlockIndex index;
+    open_blocks(&index, buffer, NULL);
+    push_blocks(&index);
+    
     if(!listInitialized){
 	    define_list = begin_def();
 	    dcb_list = begin_dcb();
@@ -2701,7 +4810,7 @@ bool preprocess_buffer(const char *buffer, bool verbose){
 		}
 		format_line();
     	
-    	if(verbose) printf("Preprocessor Line: %s\n", line);
+    	if(verbose) diag_printf("Preprocessor Line: %s\n", line);
     	
     	int i = 0;
     	for(; line[i] == ' '; i++);
@@ -2713,7 +4822,7 @@ bool preprocess_buffer(const char *buffer, bool verbose){
 		}
 		
     	int length = strcspn(&line[i], ":");
-		token = strtok(line, " ");
+		token = strtok_r(line, " ", &strtok_save);
 			
 		if(token == NULL || token[0] == ';') {
 			linenum++;
@@ -2740,12 +4849,14 @@ bool preprocess_buffer(const char *buffer, bool verbose){
 		
 		bool isExp = strcmp(token, "EXPORT") == 0;
 		if(isExp){
-			token = strtok(NULL, " ");
+			token = strtok_r(NULL, " ", &strtok_save);
 			if(token != NULL){
 				wll_table_alloc += strlen(token) + 1 + 6;
 			    wll_counter++;	
 			}else{
 				directive_error = true;
+				pop_blocks();
+				freeblocks(&index);
 				return !directive_error;	
 			}
 		}
@@ -2758,7 +4869,7 @@ bool preprocess_buffer(const char *buffer, bool verbose){
 		while (token != NULL) {
 	    	isLineComment = token[0] == ';' || isLineComment;
 	    	if(isLineComment){
-	    		token = strtok(NULL, " ");
+	    		token = strtok_r(NULL, " ", &strtok_save);
 	    		continue;
 			}
 			
@@ -2768,24 +4879,105 @@ bool preprocess_buffer(const char *buffer, bool verbose){
 			if(get_directive() == -1){
 				if(get_mnemonic() == -1){
 					label = token;
-					if(!get_label(length))
+					if(!get_label(length)){
+						pop_blocks();
+						freeblocks(&index);
 						return false;
+					}
 				}
 				break;	
-			}else if(directive_error)
-					return false;
+			}else if(directive_error){
+				pop_blocks();
+				freeblocks(&index);
+				return false;
+			}
 					
-			token = strtok(NULL, " ");
+			token = strtok_r(NULL, " ", &strtok_save);
 		}
 
 		linenum++;
 	}
 	
+	pop_blocks();
+	freeblocks(&index);
 	isBuffer = false;
 	return true;
 }
 // -----------------------------------------------------------------------------
 
+// assemble_template: Assembler for the compiled macro or REP body
+// run the formatted statements, preprocessing only the lines that need it
+// -----------------------------------------------------------------------------
+bool assemble_template(MacroTemplate *tmpl, bool verbose) {
+	isVerbose = verbose;
+	bool isValid = true;
+	
+	if(tmpl->prep != NULL){
+		isValid = preprocess_buffer(tmpl->prep, verbose);
+		if(!isValid) return false;
+	}
+	
+	linenum = linebegin;
+	if(tmpl->blocks != NULL)
+		push_blocks(tmpl->blocks);
+	int i = 0;
+	while (i < tmpl->count) {
+		MacroStmt *stmt = &tmpl->stmts[i++];
+		const char *text = &tmpl->body[stmt->offset];
+		bufferget = text + stmt->length + 2;
+		
+		isBuffer = true;
+		if(verbose) diag_printf("Assembly line Buffer: %.*s\n", stmt->length, text);
+		if(stmt->flags & STMT_BLANK){
+			linenum++;
+			continue;
+		}
+		if(stmt->flags & STMT_IGNORE){
+			toIgnore = true;
+			linenum++;
+			continue;
+		}
+		memcpy(line, text, stmt->length);
+		line[stmt->length] = '\0';
+		lineFormatted = true;
+		
+        // Lexycal Analyze and tokenization
+		isValid = (stmt->mnemonic != -1) ? tokenize_stmt(stmt) : tokenizer();
+        if(!isValid)
+        	break;
+        if(toIgnore){	linenum++;	continue;	} 
+		
+		// Sintatic analyze
+		isValid = parser();
+		if(!isValid)
+        	break;
+        if(toIgnore){	linenum++;	continue;	} 
+        
+		// Semantic analyze and generation
+		isValid = generator();
+		if(!isValid)
+        	break;
+		
+		if(repstate || hasif || macroret){
+			i = find_stmt(tmpl, bufferget - tmpl->body);
+		}
+		if(repstate) repstate = false;
+		if(hasif) hasif = false;
+		if(macroret) {
+			macroret = false;
+			isMacro = false;
+		}
+        
+        linenum++;
+	}
+	if(tmpl->blocks != NULL)
+		pop_blocks();
+	
+	isBuffer = false;
+	return isValid;
+}
+// -----------------------------------------------------------------------------
+
 // assemble_buffer: Assembler for the buffer loading method
 // read the buffer and assembler writing the machine code memory to compiled param
 // presenting assembler detail from the verbose state.
@@ -2799,9 +4991,9 @@ bool assemble_buffer(const char *buffer, unsigned char **compiled, bool verbose)
 	}
 
 	if(memory == NULL){
-		memory = (unsigned char *) malloc(MEMORY_EMULATOR * sizeof(unsigned char));
+		memory = (unsigned char *) malloc((MEMORY_EMULATOR + 1) * sizeof(unsigned char));	// 64K of the emulator
 		if (memory == NULL) {
-	        printf("Error in allocate memory");
+	        diag_error(stdout, "Error in allocate memory");
 	        return 0;
 	    }
     	code_address = memory;
@@ -2812,9 +5004,9 @@ bool assemble_buffer(const char *buffer, unsigned char **compiled, bool verbose)
     	    code_address[3] = (char) wll_counter;
     	    wll_table_alloc = 4;
 			if(verbose){
-	    	    printf("\nExport Symbol Table: \n");
+	    	    diag_printf("\nExport Symbol Table: \n");
 	    	    for(int i = 0; i < wll_counter; i++)
-	    	    	printf("Symbol %d : '%s'\n", i, label_pointer[i]);				
+	    	    	diag_printf("Symbol %d : '%s'\n", i, label_pointer[i]);				
 			}
 		}
 	}
@@ -2823,12 +5015,17 @@ bool assemble_buffer(const char *buffer, unsigned char **compiled, bool verbose)
 	//const char *buffertmp = bufferget;
     linenum = linebegin;
     
+    BlockIndex index;
+    open_blocks(&index, buffer, NULL);
+    index.quiet = true;
+    push_blocks(&index);
+    
     while (buffer_fgets(line, sizeof(line), &bufptr)) {
     	bufferget = bufptr;
     	const char* buftmp = bufptr;
     	
     	isBuffer = true;
-    	if(verbose) printf("Assembly line Buffer: %s", line);
+    	if(verbose) diag_printf("Assembly line Buffer: %s", line);
         if (line[0] == 0x0D && line[1] == 0x0A) {
             linenum++;
             continue;
@@ -2865,11 +5062,8 @@ bool assemble_buffer(const char *buffer, unsigned char **compiled, bool verbose)
     }
 
 	//bufferget = buffertmp;
-	
-    if(code_index > 4096){
-		perror("Error: The maximum program size is 4096 bytes.");
-        exit(EXIT_FAILURE);
-	}
+	pop_blocks();
+	freeblocks(&index);
 
 	isBuffer = false;
 	*compiled = code_address;
@@ -2885,17 +5079,26 @@ bool assemble_buffer(const char *buffer, unsigned char **compiled, bool verbose)
 // -----------------------------------------------------------------------------
 void hex_dump(unsigned char* code){
 	unsigned short address = 0x000;
-	printf("\nCode Length: %d\n", code_index);
+	diag_printf("\nCode Length: %d\n", code_index);
 	for(int i = 0; i < code_index; i++){
 		if(i % 16 == 0)
-			printf("\n0x%03X:", address);
+			diag_printf("\n0x%03X:", address);
 
-		printf(" %02X", code[i]);
+		diag_printf(" %02X", code[i]);
 		address++;
 	}
 }
 // -----------------------------------------------------------------------------
 
+// show_stats: Print the assembler statistics in verbose mode
+// -----------------------------------------------------------------------------
+void show_stats(){
+	diag_printf("\nMacro expansion cache: %d hits, %d misses\n", memo_hits, memo_misses);
+	if(region_hits + region_misses > 0)
+		diag_printf("Included regions: %d copied, %d reassembled\n", region_hits, region_misses);
+}
+// -----------------------------------------------------------------------------
+
 // get_code_size: Get the machine code length
 // -----------------------------------------------------------------------------
 int get_code_size(){
@@ -2919,6 +5122,27 @@ void close_lists(){
 	if(macro_list != NULL){
 		free_macrolist(macro_list);
 	}
+	pch_release();
+	if(cond_list != NULL && !keep_caches){
+		freecond(cond_list);
+		cond_list = NULL;
+	}
+	if(!keep_caches){
+		freereg(region_list);
+		region_list = NULL;
+	}
+	free(context_stack);
+	context_stack = NULL;
+	context_top = context_size = 0;
+	close_includes();
+	freesrc(source_list);
+	source_list = NULL;
+	if(!keep_caches){
+		freepath(path_list);
+		path_list = NULL;
+	}
+	freeonce(once_list);
+	once_list = NULL;
 	if(label_pointer != NULL){
 		for(int i = 0; i < wll_counter; i++)
 			free(label_pointer[i]);
@@ -2956,4 +5180,708 @@ void reset_states(){
 // -----------------------------------------------------------------------------
 // **********************************************************************************
 
+// FUNCTIONS OF THE PRECOMPILED INCLUDES
+// **********************************************************************************
+
+// pch_map: Map the snapshot file for reading, or read it on the systems
+// without mapped files. NULL if the file can't be read
+// -----------------------------------------------------------------------------
+char* pch_map(const char* path, size_t size){
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+#ifndef _WIN32
+	char* data = (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if(data == MAP_FAILED)
+		data = NULL;
+#else
+	char* data = (char*) malloc(size);
+	if(data != NULL && fread(data, 1, size, file) != size){
+		free(data);
+		data = NULL;
+	}
+#endif
+	fclose(file);
+	return data;
+}
+
+void pch_unmap(char* data, size_t size){
+#ifndef _WIN32
+	munmap(data, size);
+#else
+	free(data);
+#endif
+}
+// -----------------------------------------------------------------------------
+
+// pch_keep: Keep the snapshot mapped, its macros point into it
+// pch_release: Unmap the snapshots kept, after the macros were freed
+// -----------------------------------------------------------------------------
+void pch_keep(char* data, size_t size){
+	PchMap* map = (PchMap*) malloc(sizeof(PchMap));
+	map->data = data;
+	map->size = size;
+	map->next = pch_maps;
+	pch_maps = map;
+}
+
+void pch_release(){
+	while(pch_maps != NULL){
+		PchMap* next = pch_maps->next;
+		pch_unmap(pch_maps->data, pch_maps->size);
+		free(pch_maps);
+		pch_maps = next;
+	}
+}
+// -----------------------------------------------------------------------------
+
+// pch_nsec: Nanoseconds of the modification time, 0 on the systems that only
+// give the seconds
+// -----------------------------------------------------------------------------
+long long pch_nsec(const struct stat* info){
+#if defined(__APPLE__)
+	return info->st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+	return info->st_mtim.tv_nsec;
+#else
+	return 0;
+#endif
+}
+// -----------------------------------------------------------------------------
+
+// pch_string: Get the string at the offset of the snapshot, NULL if it is out
+// of the file. The file ends with a null byte, bounding the last string
+// -----------------------------------------------------------------------------
+const char* pch_string(const char* data, size_t size, int offset){
+	return (offset >= 0 && (size_t) offset < size) ? &data[offset] : NULL;
+}
+
+bool pch_table(size_t size, int offset, int count, size_t item){
+	return offset >= 0 && count >= 0 && (size_t) offset + count * item <= size;
+}
+// -----------------------------------------------------------------------------
+
+// pch_open: Map the snapshot of the include, only if it was precompiled from
+// the same path and it is newer than every file read by the precompiling
+// -----------------------------------------------------------------------------
+char* pch_open(const char* filename, size_t* size){
+	char* path = changeExtension(filename, ".wpch");
+	struct stat info;
+	char* data = NULL;
+	if(stat(path, &info) == 0 && info.st_size > (off_t) sizeof(PchHeader))
+		data = pch_map(path, info.st_size);
+	free(path);
+	if(data == NULL)
+		return NULL;
+	*size = info.st_size;
+
+	PchHeader* header = (PchHeader*) data;
+	const char* source = pch_string(data, *size, header->source);
+	bool valid = memcmp(header->magic, PCH_MAGIC, sizeof(PCH_MAGIC)) == 0 && header->version == PCH_VERSION
+			&& data[*size - 1] == '\0' && source != NULL && strcmp(source, filename) == 0
+			&& pch_table(*size, header->files, header->nfiles, sizeof(PchFile))
+			&& pch_table(*size, header->symbols, header->nsymbols, sizeof(PchSymbol));
+	PchFile* files = (PchFile*) &data[header->files];
+	for(int i = 0; valid && i < header->nfiles; i++){
+		struct stat src;
+		const char* file = pch_string(data, *size, files[i].path);
+		valid = file != NULL && stat(file, &src) == 0 && src.st_mtime == files[i].mtime
+				&& pch_nsec(&src) == files[i].nsec && src.st_size == files[i].size
+				&& (src.st_mtime < info.st_mtime
+				|| (src.st_mtime == info.st_mtime && pch_nsec(&src) <= pch_nsec(&info)));
+	}
+	if(!valid){
+		pch_unmap(data, *size);
+		return NULL;
+	}
+	return data;
+}
+// -----------------------------------------------------------------------------
+
+// pch_macro: Create the macro of the snapshot with its compiled template,
+// without formatting its body again. The template points into the mapping
+// -----------------------------------------------------------------------------
+bool pch_macro(const char* data, size_t size, const PchSymbol* sym, char* name){
+	if(macro_conflict(name, sym->pcount))
+		return false;
+	char** pnames = NULL;
+	if(sym->pcount > 0){
+		if(!pch_table(size, sym->pnames, sym->pcount, sizeof(int)))
+			return false;
+		const int* offsets = (const int*) &data[sym->pnames];
+		pnames = (char**) malloc(sym->pcount * sizeof(char*));
+		for(int i = 0; i < sym->pcount; i++){
+			const char* param = pch_string(data, size, offsets[i]);
+			pnames[i] = strdup((param != NULL) ? param : "");
+		}
+	}
+	macro_list = insertmac(macro_list, sym->pcount, name, pnames, NULL, sym->line);
+	if(macro_list == NULL)
+		return false;
+	symbol_created(name);
+	memo_pure = false;
+	if(pch_recording)
+		pch_list = insertpch(pch_list, PCH_MACRO, sym->line, name, NULL, macro_list);
+
+	MacroTemplate* tmpl = &macro_list->tmpl;
+	const char* body = pch_string(data, size, sym->value);
+	if(body == NULL)
+		return true;
+	if(!pch_table(size, sym->stmts, sym->count, sizeof(MacroStmt)))
+		return false;
+	tmpl->body = (char*) body;
+	tmpl->prep = (char*) pch_string(data, size, sym->prep);
+	tmpl->stmts = (sym->count > 0) ? (MacroStmt*) &data[sym->stmts] : NULL;
+	tmpl->count = sym->count;
+	tmpl->mapped = true;
+	tmpl->blocks = (BlockIndex*) malloc(sizeof(BlockIndex));
+	if(tmpl->blocks != NULL)
+		open_blocks(tmpl->blocks, tmpl->body, NULL);
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// pch_load: Create the symbols of the snapshot in the order that the
+// preprocessing of the include created them. Returns false on a conflict
+// -----------------------------------------------------------------------------
+bool pch_load(const char* data, size_t size, const char* filename){
+	const PchHeader* header = (const PchHeader*) data;
+	const PchFile* files = (const PchFile*) &data[header->files];
+	const PchSymbol* symbols = (const PchSymbol*) &data[header->symbols];
+	char name[MAX_LINE_LENGTH];
+
+	char* path = changeExtension(filename, ".wpch");
+	add_source(path, SRC_SNAPSHOT);
+	free(path);
+	for(int i = 0; i < header->nfiles; i++)
+		add_source(&data[files[i].path], files[i].kind);
+	if(isVerbose)
+		diag_printf("Precompiled include: %s (%d symbols)\n", filename, header->nsymbols);
+
+	currentfile = (char*) filename;
+	for(int i = 0; i < header->nsymbols; i++){
+		const PchSymbol* sym = &symbols[i];
+		const char* text = pch_string(data, size, sym->name);
+		if(text == NULL)
+			return false;
+		snprintf(name, sizeof(name), "%s", text);
+		linenum = sym->line;
+		if(sym->kind == PCH_DEFINE){
+			const char* value = pch_string(data, size, sym->value);
+			define_symbol(strdup(name), strdup((value != NULL) ? value : ""));
+			if(directive_error)
+				return false;
+		}else if(sym->kind == PCH_MACRO){
+			if(!pch_macro(data, size, sym, name))
+				return false;
+		}else if(sym->kind == PCH_LABEL){
+			if(!create_label(name, 0xFFFF))
+				return false;
+		}
+	}
+	ilabelA += header->counters[0];
+	ilabelB += header->counters[1];
+	ilabelC += header->counters[2];
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// pch_nested: Check that no nested include of the snapshot would be skipped
+// now, by an INCLUDE ONCE or a PRAGMA ONCE of a file already preprocessed
+// -----------------------------------------------------------------------------
+bool pch_nested(const char* data, size_t size){
+	const PchHeader* header = (const PchHeader*) data;
+	const PchSymbol* symbols = (const PchSymbol*) &data[header->symbols];
+	for(int i = 0; i < header->nsymbols; i++){
+		const char* name = pch_string(data, size, symbols[i].name);
+		if(symbols[i].kind != PCH_INCLUDE || name == NULL)
+			continue;
+		OnceList* file = once_file(name);
+		if((file->passes & ONCE_PREPROCESS) && (symbols[i].value != -1 || file->pragma))
+			return false;
+	}
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// pch_once: Mark the nested includes of the snapshot as included by the pass
+// and its files with PRAGMA ONCE, the precompiled file by the name used now
+// -----------------------------------------------------------------------------
+void pch_once(const char* data, size_t size, const char* filename, int pass){
+	const PchHeader* header = (const PchHeader*) data;
+	const PchSymbol* symbols = (const PchSymbol*) &data[header->symbols];
+	const char* source = pch_string(data, size, header->source);
+	for(int i = 0; i < header->nsymbols; i++){
+		if(symbols[i].kind != PCH_INCLUDE && symbols[i].kind != PCH_ONCE)
+			continue;
+		const char* name = pch_string(data, size, symbols[i].name);
+		if(name == NULL)
+			continue;
+		if(source != NULL && strcmp(name, source) == 0)
+			name = filename;
+		if(symbols[i].kind == PCH_INCLUDE)
+			once_file(name)->passes |= pass;
+		else
+			once_file(name)->pragma = true;
+		if(pch_recording)
+			pch_list = insertpch(pch_list, symbols[i].kind, symbols[i].line, name, pch_string(data, size, symbols[i].value), NULL);
+	}
+}
+// -----------------------------------------------------------------------------
+
+// pch_include: Use the precompiled snapshot of the include, if there is a
+// valid one. The preprocessor loads its symbols and the assembler skips the
+// includes without code. The text is read when a nested include is skipped
+// now. The loaded snapshot stays mapped for its macros. Returns -1 to read
+// the text, 0 on fail, 1 on success
+// -----------------------------------------------------------------------------
+int pch_include(const char* filename, bool assembling){
+	size_t size = 0;
+	char* data = pch_open(filename, &size);
+	if(data == NULL)
+		return -1;
+	int result = -1;
+	if(!assembling && pch_nested(data, size)){
+		result = pch_load(data, size, filename);
+		if(result == 1)
+			pch_once(data, size, filename, ONCE_PREPROCESS);
+		pch_keep(data, size);
+		return result;
+	}
+	if(assembling && !(((PchHeader*) data)->flags & PCH_CODE)){
+		result = 1;
+		pch_once(data, size, filename, ONCE_ASSEMBLY);
+	}
+	pch_unmap(data, size);
+	return result;
+}
+// -----------------------------------------------------------------------------
+
+// pch_put: Append the bytes to the snapshot at an aligned offset, zeros if
+// bytes is NULL. Returns the offset
+// -----------------------------------------------------------------------------
+int pch_put(PchBuffer* buffer, const void* bytes, int length){
+	int offset = (buffer->size + 7) & ~7;
+	if(offset + length > buffer->alloc){
+		buffer->alloc = (offset + length) * 2;
+		buffer->data = (char*) realloc(buffer->data, buffer->alloc);
+	}
+	memset(&buffer->data[buffer->size], 0, offset - buffer->size);
+	if(bytes != NULL)
+		memcpy(&buffer->data[offset], bytes, length);
+	else
+		memset(&buffer->data[offset], 0, length);
+	buffer->size = offset + length;
+	return offset;
+}
+
+int pch_text(PchBuffer* buffer, const char* text){
+	return (text != NULL) ? pch_put(buffer, text, strlen(text) + 1) : -1;
+}
+// -----------------------------------------------------------------------------
+
+// pch_write: Write the snapshot of the recorded symbols, in a temporary file
+// renamed when complete
+// -----------------------------------------------------------------------------
+bool pch_write(const char* filename, const char* output, PchList* symbols, int nsymbols, int* counters, bool code){
+	PchBuffer buffer = {NULL, 0, 0};
+	int nfiles = 0;
+	for(SourceList* src = source_list; src != NULL; src = src->next)
+		nfiles++;
+
+	PchHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PCH_MAGIC, sizeof(PCH_MAGIC));
+	header.version = PCH_VERSION;
+	header.flags = (code) ? PCH_CODE : 0;
+	memcpy(header.counters, counters, sizeof(header.counters));
+	pch_put(&buffer, NULL, sizeof(PchHeader));
+	header.files = pch_put(&buffer, NULL, nfiles * sizeof(PchFile));
+	header.symbols = pch_put(&buffer, NULL, nsymbols * sizeof(PchSymbol));
+	header.source = pch_text(&buffer, filename);
+
+	for(SourceList* src = source_list; src != NULL; src = src->next){
+		struct stat info;
+		if(stat(src->path, &info) != 0)
+			continue;
+		PchFile file = {info.st_mtime, pch_nsec(&info), info.st_size, pch_text(&buffer, src->path), src->kind};
+		memcpy(&buffer.data[header.files + header.nfiles++ * sizeof(PchFile)], &file, sizeof(file));
+	}
+
+	for(PchList* rec = symbols; rec != NULL; rec = rec->next){
+		PchSymbol sym = {rec->kind, rec->line, pch_text(&buffer, rec->name), pch_text(&buffer, rec->value), -1, -1, 0, 0, -1};
+		if(rec->kind == PCH_MACRO){
+			MacroTemplate* tmpl = &rec->macro->tmpl;
+			sym.value = pch_text(&buffer, tmpl->body);
+			sym.prep = pch_text(&buffer, tmpl->prep);
+			sym.count = tmpl->count;
+			if(tmpl->count > 0)
+				sym.stmts = pch_put(&buffer, tmpl->stmts, tmpl->count * sizeof(MacroStmt));
+			sym.pcount = rec->macro->pcount;
+			if(sym.pcount > 0){
+				int offsets[sym.pcount];
+				for(int i = 0; i < sym.pcount; i++)
+					offsets[i] = pch_text(&buffer, rec->macro->pnames[i]);
+				sym.pnames = pch_put(&buffer, offsets, sizeof(offsets));
+			}
+		}
+		memcpy(&buffer.data[header.symbols + header.nsymbols++ * sizeof(PchSymbol)], &sym, sizeof(sym));
+	}
+	pch_put(&buffer, "", 1);
+	memcpy(buffer.data, &header, sizeof(header));
+
+	char temp[512];
+	FILE* file = openTemp(output, temp, sizeof(temp), false);
+	bool written = file != NULL && fwrite(buffer.data, 1, buffer.size, file) == (size_t) buffer.size;
+	written = file != NULL && fclose(file) == 0 && written;
+	free(buffer.data);
+#ifdef _WIN32
+	if(written)
+		remove(output);
+#endif
+	if(!written || rename(temp, output) != 0){
+		if(file != NULL)
+			remove(temp);
+		diag_perror("Error in writing the precompiled include");
+		return false;
+	}
+	return true;
+}
+// -----------------------------------------------------------------------------
+// **********************************************************************************
+
+// FUNCTIONS OF THE ASSEMBLER CONTEXT
+// **********************************************************************************
+
+// reset_assembler: Release the lists and the memory left by the last assembly
+// of this thread, restoring every state to its initial value
+// -----------------------------------------------------------------------------
+void reset_assembler(){
+	close_lists();
+	free(memory);
+	if(memo_deps != NULL)
+		freedep(memo_deps);
+	
+	memory = NULL;
+	code_address = NULL;
+	token = directive = mnemonic = operand = label = endptr = NULL;
+	currentfile = NULL;
+	bufferget = NULL;
+	fileopened = NULL;
+	line[0] = dest[0] = '\0';
+	invoked_frame = currframe = NULL;
+	currmacro = NULL;
+	frame_top = 0;
+	expansion_depth = EXPANSION_DEPTH;
+	
+	linenum = linebegin = linesrc = 1;
+	number = len = bit_shift = 0;
+	mnemonic_index = code_index = dcb_index = reg_index = org_num = 0;
+	ilabelA = ilabelB = ilabelC = 0;
+	ifdepth = 0;
+	
+	isDirective = isMnemonic = isHexadecimal = listInitialized = false;
+	isLabel = isRelative = isAllocator = isOrg = isInclude = isIncB = false;
+	isExport = isImport = isEndx = isExportCurr = isRepeat = isHigh = false;
+	isDecimal = isReferenced = isMacro = isIF = isELSE = isMacroScope = false;
+	toIgnore = isLineComment = lineFormatted = directive_error = false;
+	syntax_6502 = syntax_PIC = syntax_Intel = syntax_GAS = false;
+	isBuffer = isVerbose = alloc = false;
+	repstate = ifstate = elsestate = hasif = macroret = false;
+	
+	wll_table_alloc = 4;
+	wll_counter = 0;
+	wll_str_pointer = 4;
+	wll_index = 0;
+	wll_code_start = 0;
+	label_pointer = NULL;
+	
+	define_list = NULL;
+	dcb_list = NULL;
+	label_list = NULL;
+	curr_refer = NULL;
+	macro_list = NULL;
+	file_blocks = NULL;
+	blocks_depth = 0;
+	macro_depth = 0;
+	
+	memo_recording = false;
+	memo_pure = true;
+	memo_deps = NULL;
+	symbol_version = 0;
+	for(int i = 0; i < VERSION_BUCKETS; i++){
+		freeversion(name_versions[i]);
+		name_versions[i] = NULL;
+	}
+	memo_hits = memo_misses = 0;
+	region_recording = false;
+	region_pure = true;
+	region_deps = region_defs = NULL;
+	region_files = NULL;
+	region_stale = NULL;
+	region_hits = region_misses = 0;
+	pch_recording = false;
+	search_paths = NULL;
+	search_count = 0;
+	vfs_reader = NULL;
+	vfs_user = NULL;
+	
+	tokentmp = saveptr = NULL;
+	calls = 0;
+	input = input_save = NULL;
+	is_asm_proc = is_cond_parse = parse_failed = false;
+}
+// -----------------------------------------------------------------------------
+
+// wr80_create: Create an assembler context with the default options. The
+// assembly states belong to the thread, so it fails while the thread has
+// another context alive
+// -----------------------------------------------------------------------------
+Wr80Assembler* wr80_create(){
+	if(live_assembler != NULL)
+		return NULL;
+	Wr80Assembler* assembler = (Wr80Assembler*) calloc(1, sizeof(Wr80Assembler));
+	if(assembler != NULL)
+		assembler->depth = EXPANSION_DEPTH;
+	live_assembler = assembler;
+#ifdef WR80_BUILD_LIB
+	if(assembler != NULL)
+		assembler->capture = true;	// the library never prints
+#endif
+	return assembler;
+}
+// -----------------------------------------------------------------------------
+
+// wr80_configure: Set the options of the next assemblies of the context. The
+// depth is used up to EXPANSION_DEPTH_MAX
+// -----------------------------------------------------------------------------
+void wr80_configure(Wr80Assembler* assembler, bool alloc, int depth){
+	assembler->alloc = alloc;
+	assembler->depth = (depth > 0) ? depth : EXPANSION_DEPTH;
+}
+// -----------------------------------------------------------------------------
+
+// wr80_set_reader: Serve the files of the next assemblies from the reader,
+// the files that it doesn't serve are read from the disk
+// -----------------------------------------------------------------------------
+void wr80_set_reader(Wr80Assembler* assembler, Wr80Reader reader, void* user){
+	assembler->reader = reader;
+	assembler->user = user;
+}
+// -----------------------------------------------------------------------------
+
+// wr80_add_path: Append a directory to the search paths of the included files
+// -----------------------------------------------------------------------------
+void wr80_add_path(Wr80Assembler* assembler, const char* directory){
+	assembler->paths = (char**) realloc(assembler->paths, (assembler->npaths + 1) * sizeof(char*));
+	assembler->paths[assembler->npaths++] = strdup(directory);
+}
+// -----------------------------------------------------------------------------
+
+// wr80_clear: Release the results of the last assembly of the context
+// -----------------------------------------------------------------------------
+void wr80_clear(Wr80Assembler* assembler){
+	free(assembler->code);
+	assembler->code = NULL;
+	assembler->size = 0;
+	for(int i = 0; i < assembler->nsymbols; i++)
+		free((char*) assembler->symbols[i].name);
+	free(assembler->symbols);
+	assembler->symbols = NULL;
+	assembler->nsymbols = 0;
+	for(int i = 0; i < assembler->ndiags; i++){
+		free((char*) assembler->diags[i].file);
+		free((char*) assembler->diags[i].message);
+	}
+	free(assembler->diags);
+	assembler->diags = NULL;
+	assembler->ndiags = 0;
+}
+// -----------------------------------------------------------------------------
+
+// wr80_collect: Copy the labels and then the numeric defines of the assembly
+// to the context, each in the order they were created
+// -----------------------------------------------------------------------------
+void wr80_collect(Wr80Assembler* assembler){
+	int count = 0;
+	for(LabelList* lab = label_list; lab != NULL; lab = lab->next)
+		count++;
+	for(DefineList* def = define_list; def != NULL; def = def->next)
+		if(def->refs[0] == '\0')
+			count++;
+	assembler->symbols = (Wr80Symbol*) malloc(count * sizeof(Wr80Symbol) + 1);
+	assembler->nsymbols = count;
+	
+	int i = count;
+	for(DefineList* def = define_list; def != NULL; def = def->next){
+		if(def->refs[0] != '\0')
+			continue;
+		Wr80Symbol symbol = {strdup(def->name), atoi(def->value), def->line, WR80_DEFINE};
+		assembler->symbols[--i] = symbol;
+	}
+	for(LabelList* lab = label_list; lab != NULL; lab = lab->next){
+		Wr80Symbol symbol = {strdup(lab->name), lab->addr, lab->line, WR80_LABEL};
+		assembler->symbols[--i] = symbol;
+	}
+}
+// -----------------------------------------------------------------------------
+
+// wr80_begin: Start a new assembly on the calling thread with the context
+// options, releasing the results of the last one
+// -----------------------------------------------------------------------------
+void wr80_begin(Wr80Assembler* assembler){
+	wr80_clear(assembler);
+	reset_assembler();
+	isVerbose = assembler->verbose;
+	alloc = assembler->alloc;
+	expansion_depth = (assembler->depth > 0) ? assembler->depth : EXPANSION_DEPTH;
+	if(expansion_depth > EXPANSION_DEPTH_MAX)
+		expansion_depth = EXPANSION_DEPTH_MAX;
+	search_paths = assembler->paths;
+	search_count = assembler->npaths;
+	vfs_reader = assembler->reader;
+	vfs_user = assembler->user;
+	if(assembler->capture){
+		diag_begin();
+		diag_records = true;
+	}
+}
+// -----------------------------------------------------------------------------
+
+// wr80_end: Move the machine code of the assembly to the context. The lists
+// stay readable until the next assembly of the thread. The program size is
+// checked here once, after the includes and the expansions it holds
+// -----------------------------------------------------------------------------
+bool wr80_end(Wr80Assembler* assembler, bool assembled){
+	if(assembled && code_index > 4096){
+		diag_error(stderr, "Error: The maximum program size is 4096 bytes.\n");
+		assembled = false;
+	}
+	assembler->code = memory;
+	assembler->size = code_index;
+	assembler->memo_hits = memo_hits;
+	assembler->memo_misses = memo_misses;
+	memory = NULL;
+	if(assembler->capture){
+		wr80_collect(assembler);
+		free(diag_end());
+		diag_records = false;
+		assembler->diags = diag_list;
+		assembler->ndiags = diag_count;
+		diag_list = NULL;
+		diag_count = diag_room = 0;
+	}
+	return assembled;
+}
+// -----------------------------------------------------------------------------
+
+// wr80_assemble_file: Assemble the source file in the context
+// -----------------------------------------------------------------------------
+bool wr80_assemble_file(Wr80Assembler* assembler, const char* filename){
+	unsigned char* compiled = NULL;
+	wr80_begin(assembler);
+	return wr80_end(assembler, assemble_file((char*) filename, &compiled, assembler->verbose));
+}
+// -----------------------------------------------------------------------------
+
+// wr80_assemble_buffer: Assemble the source code buffer in the context
+// -----------------------------------------------------------------------------
+bool wr80_assemble_buffer(Wr80Assembler* assembler, const char* source){
+	unsigned char* compiled = NULL;
+	wr80_begin(assembler);
+	return wr80_end(assembler, assemble_buffer(source, &compiled, assembler->verbose));
+}
+// -----------------------------------------------------------------------------
+
+// wr80_precompile: Preprocess the include in the context and write the
+// snapshot of its symbols. The include is assembled alone to know if the
+// includers can skip its assembly, its messages are dropped
+// -----------------------------------------------------------------------------
+bool wr80_precompile(Wr80Assembler* assembler, const char* filename, const char* output){
+	wr80_begin(assembler);
+	pch_recording = true;
+	bool preprocessed = preprocess_file((char*) filename, assembler->verbose);
+	pch_recording = false;
+	int counters[3] = {ilabelA, ilabelB, ilabelC};
+	int version = symbol_version;
+
+	// the recorded list is reversed to the preprocessing order
+	PchList* symbols = NULL;
+	int nsymbols = 0;
+	bool exported = false, labeled = false;
+	while(pch_list != NULL){
+		PchList* next = pch_list->next;
+		pch_list->next = symbols;
+		symbols = pch_list;
+		pch_list = next;
+		exported = symbols->kind == PCH_EXPORT || exported;
+		labeled = symbols->kind == PCH_LABEL || labeled;
+		nsymbols++;
+	}
+	if(exported)
+		diag_error(stderr, "Error: the include '%s' exports labels and can't be precompiled\n", filename);
+
+	bool alone = false;
+	if(preprocessed && !exported){
+		bool outer = diag_capture;
+		long from = diag_size;
+		if(!outer)
+			diag_begin();
+		unsigned char* compiled = NULL;
+		isInclude = true;
+		alone = assemble_file((char*) filename, &compiled, false);
+		isInclude = false;
+		if(!outer){
+			free(diag_end());
+		}else if(diag_text != NULL){
+			diag_size = from;
+			diag_text[from] = '\0';
+		}
+	}
+	bool code = !alone || labeled || code_index > 0 || org_num != 0 || symbol_version != version
+			|| ilabelA != counters[0] || ilabelB != counters[1] || ilabelC != counters[2];
+
+	bool written = preprocessed && !exported && pch_write(filename, output, symbols, nsymbols, counters, code);
+	freepch(symbols);
+	return wr80_end(assembler, written);
+}
+// -----------------------------------------------------------------------------
+
+// wr80_destroy: Release the context and the states of its thread, allowing
+// a new context in the thread
+// -----------------------------------------------------------------------------
+void wr80_destroy(Wr80Assembler* assembler){
+	if(assembler == NULL)
+		return;
+	if(assembler == live_assembler)
+		live_assembler = NULL;
+	wr80_clear(assembler);
+	reset_assembler();
+	for(int i = 0; i < assembler->npaths; i++)
+		free(assembler->paths[i]);
+	free(assembler->paths);
+	free(assembler);
+}
+// -----------------------------------------------------------------------------
+
+// wr80_image / wr80_symbols / wr80_diagnostics: Results of the last assembly,
+// valid until the next assembly or the destroy of the context
+// -----------------------------------------------------------------------------
+Wr80Image wr80_image(const Wr80Assembler* assembler){
+	Wr80Image image = {assembler->code, assembler->size};
+	return image;
+}
+
+const Wr80Symbol* wr80_symbols(const Wr80Assembler* assembler, int* count){
+	*count = assembler->nsymbols;
+	return assembler->symbols;
+}
+
+const Wr80Diagnostic* wr80_diagnostics(const Wr80Assembler* assembler, int* count){
+	*count = assembler->ndiags;
+	return assembler->diags;
+}
+// -----------------------------------------------------------------------------
+// **********************************************************************************
+
 #endif
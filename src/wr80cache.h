@@ -0,0 +1,415 @@
+/*
+	WR80 Assembler Build Cache Library
+	Created by Wender Francis (KiddieOS.Community)
+	Date: 20/08/2025
+
+*/
+
+#ifndef __WR80CACHE_H__
+#define __WR80CACHE_H__
+
+/*
+	The build cache keeps the machine code of the assembled sources in a
+	directory, so the unchanged programs aren't assembled again. An entry is
+	named by the hash of the assembler version, the options and the source
+	text. It lists the files read by the assembly with their content hashes,
+	checked again before the entry is used, followed by the machine code and
+	the messages printed by the assembly:
+
+		"WR80 CACHE <version>\n<files count>\n"
+		"<kind> <hash> <path>\n" for each file
+		"<code size> <messages size>\n<code><messages>"
+
+	The used entries are touched, and the least recently used ones are
+	removed while the entries are over the size limit of the cache.
+*/
+// -----------------------------------------------------------------------------
+#include <dirent.h>
+#include <utime.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#define cache_mkdir(path) _mkdir(path)
+#else
+#include <unistd.h>
+#include <sys/file.h>
+#define cache_mkdir(path) mkdir(path, 0777)
+#endif
+
+#define CACHE_MAX_SIZE 65536		// DEFAULT KBYTES OF THE CACHE ENTRIES
+#define CACHE_EXTENSION ".wr80"
+#define CACHE_STATS "stats.txt"
+#define CACHE_LOCK "stats.lock"
+
+// Build cache of a directory with the counters of this run
+typedef struct {
+	const char* dir;
+	long max;				// max bytes of the entries
+	volatile int hits;
+	volatile int misses;
+	volatile int stores;
+	int evictions;
+} BuildCache;
+
+// Entry of the cache directory, sorted to remove the least recently used
+typedef struct {
+	char name[64];
+	time_t used;
+	long size;
+} CacheFile;
+
+// cache_hash: Continue the 64-bit FNV-1a hash with the data
+// -----------------------------------------------------------------------------
+unsigned long long cache_hash(unsigned long long hash, const void* data, size_t size){
+	const unsigned char* bytes = (const unsigned char*) data;
+	for(size_t i = 0; i < size; i++){
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+// -----------------------------------------------------------------------------
+
+// cache_hash_file: Hash the content of a file, false if it can't be read
+// -----------------------------------------------------------------------------
+bool cache_hash_file(const char* path, unsigned long long* hash){
+	char data[8192];
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return false;
+	*hash = 0xCBF29CE484222325ULL;
+	size_t size;
+	while((size = fread(data, 1, sizeof(data), file)) > 0)
+		*hash = cache_hash(*hash, data, size);
+	bool read = !ferror(file);
+	fclose(file);
+	return read;
+}
+// -----------------------------------------------------------------------------
+
+// cache_path: Get the path of the entry named by the key, false if too long
+// -----------------------------------------------------------------------------
+bool cache_path(BuildCache* cache, unsigned long long key, char* path, size_t size){
+	int length = snprintf(path, size, "%s/%016llx%s", cache->dir, key, CACHE_EXTENSION);
+	return length >= 0 && (size_t) length < size;
+}
+// -----------------------------------------------------------------------------
+
+// cache_file: Get the path of a file of the cache directory, false if too long
+// -----------------------------------------------------------------------------
+bool cache_file(BuildCache* cache, const char* name, char* path, size_t size){
+	int length = snprintf(path, size, "%s/%s", cache->dir, name);
+	return length >= 0 && (size_t) length < size;
+}
+// -----------------------------------------------------------------------------
+
+// cache_lock: Open and lock the lock file of the statistics, so the builds
+// sharing the cache add their counters one at a time. Returns -1 on fail
+// -----------------------------------------------------------------------------
+int cache_lock(BuildCache* cache){
+	char path[512];
+	if(!cache_file(cache, CACHE_LOCK, path, sizeof(path)))
+		return -1;
+	int fd = open(path, O_RDWR | O_CREAT, 0666);
+	if(fd == -1)
+		return -1;
+#ifdef _WIN32
+	OVERLAPPED overlapped = {0};
+	bool locked = LockFileEx((HANDLE) _get_osfhandle(fd), LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+#else
+	bool locked = flock(fd, LOCK_EX) == 0;
+#endif
+	if(!locked){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+// -----------------------------------------------------------------------------
+
+void cache_unlock(int fd){
+#ifdef _WIN32
+	OVERLAPPED overlapped = {0};
+	UnlockFileEx((HANDLE) _get_osfhandle(fd), 0, 1, 0, &overlapped);
+#else
+	flock(fd, LOCK_UN);
+#endif
+	close(fd);
+}
+// -----------------------------------------------------------------------------
+
+// cache_key: Get the key of the source with the version and the options that
+// change the assembly, the search paths in their order included. The files
+// served by a reader aren't on the disk to check, so they aren't cached
+// -----------------------------------------------------------------------------
+bool cache_key(const char* source, Wr80Assembler* assembler, bool bin, unsigned long long* key){
+	char options[64];
+	unsigned long long hash;
+	if(assembler->reader != NULL || !cache_hash_file(source, &hash))
+		return false;
+	int length = snprintf(options, sizeof(options), "%d %d %d %d ", assembler->alloc, bin, assembler->depth, assembler->npaths);
+	*key = cache_hash(0xCBF29CE484222325ULL, VER_STRING, strlen(VER_STRING) + 1);
+	*key = cache_hash(*key, options, length);
+	for(int i = 0; i < assembler->npaths; i++)
+		*key = cache_hash(*key, assembler->paths[i], strlen(assembler->paths[i]) + 1);
+	*key = cache_hash(*key, &hash, sizeof(hash));
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// cache_load: Restore the machine code of the entry when the files read by
+// its assembly are unchanged, printing again their messages. The files are
+// restored as the ones read by the assembly, for the dependency files
+// -----------------------------------------------------------------------------
+bool cache_load(BuildCache* cache, unsigned long long key, Wr80Assembler* assembler){
+	char path[512];
+	char header[MAX_LINE_LENGTH];
+	char version[64];
+	if(!cache_path(cache, key, path, sizeof(path)))
+		return false;
+	FILE* file = fopen(path, "rb");
+	if(file == NULL)
+		return false;
+
+	int files = 0, kind = 0, size = 0, length = 0;
+	freesrc(source_list);
+	source_list = NULL;
+	SourceList** last = &source_list;
+	bool valid = fgets(header, sizeof(header), file) && sscanf(header, "WR80 CACHE %63s", version) == 1
+				&& strcmp(version, VER_STRING) == 0
+				&& fgets(header, sizeof(header), file) && sscanf(header, "%d", &files) == 1;
+	for(int i = 0; valid && i < files; i++){
+		unsigned long long stored = 0, hash = 0;
+		int offset = 0;
+		valid = fgets(header, sizeof(header), file) && sscanf(header, "%d %llx %n", &kind, &stored, &offset) == 2;
+		if(valid){
+			header[strcspn(header, "\n")] = '\0';
+			valid = cache_hash_file(&header[offset], &hash) && hash == stored;
+		}
+		if(valid){
+			*last = insertsrc(NULL, &header[offset], kind);
+			last = &(*last)->next;
+		}
+	}
+	valid = valid && fgets(header, sizeof(header), file) && sscanf(header, "%d %d", &size, &length) == 2
+			&& size >= 0 && size <= MEMORY_EMULATOR && length >= 0;
+
+	unsigned char* code = (valid) ? (unsigned char*) malloc(size + 1) : NULL;
+	char* messages = (valid) ? (char*) malloc(length + 1) : NULL;
+	valid = valid && code != NULL && messages != NULL
+			&& fread(code, 1, size, file) == (size_t) size && fread(messages, 1, length, file) == (size_t) length;
+	fclose(file);
+	if(!valid){
+		free(code);
+		free(messages);
+		return false;
+	}
+
+	messages[length] = '\0';
+	diag_printf("%s", messages);
+	free(messages);
+	free(assembler->code);
+	assembler->code = code;
+	assembler->size = size;
+	utime(path, NULL);
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// cache_store: Write the entry of the assembly, with the files that it read.
+// The entry is renamed when complete, so a reader never sees a partial one
+// -----------------------------------------------------------------------------
+bool cache_store(BuildCache* cache, unsigned long long key, Wr80Assembler* assembler, const char* messages){
+	char path[512];
+	char temp[sizeof(path) + 8];
+	if(!cache_path(cache, key, path, sizeof(path)))
+		return false;
+	cache_mkdir(cache->dir);
+
+	FILE* file = openTemp(path, temp, sizeof(temp), false);
+	if(file == NULL)
+		return false;
+	int files = 0;
+	for(SourceList* src = source_list; src != NULL; src = src->next)
+		files++;
+	bool written = fprintf(file, "WR80 CACHE %s\n%d\n", VER_STRING, files) > 0;
+	for(SourceList* src = source_list; written && src != NULL; src = src->next){
+		unsigned long long hash;
+		written = cache_hash_file(src->path, &hash) && fprintf(file, "%d %016llx %s\n", src->kind, hash, src->path) > 0;
+	}
+	int length = strlen(messages);
+	written = written && fprintf(file, "%d %d\n", assembler->size, length) > 0
+			&& fwrite(assembler->code, 1, assembler->size, file) == (size_t) assembler->size
+			&& fwrite(messages, 1, length, file) == (size_t) length;
+	written = fclose(file) == 0 && written;
+
+#ifdef _WIN32
+	remove(path);
+#endif
+	if(!written || rename(temp, path) != 0){
+		remove(temp);
+		return false;
+	}
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// cache_assemble: Get the machine code of the source from the cache, or
+// assemble it and keep the result. The messages go to the capture of the
+// batch when there is one
+// -----------------------------------------------------------------------------
+bool cache_assemble(BuildCache* cache, Wr80Assembler* assembler, const char* source, bool bin){
+	unsigned long long key = 0;
+	bool keyed = cache_key(source, assembler, bin, &key);
+	if(keyed && cache_load(cache, key, assembler)){
+		__sync_fetch_and_add(&cache->hits, 1);
+		return true;
+	}
+	__sync_fetch_and_add(&cache->misses, 1);
+
+	bool outer = diag_capture;
+	long from = diag_size;
+	if(!outer)
+		diag_begin();
+	bool mounted = wr80_assemble_file(assembler, source);
+	const char* messages = (diag_text != NULL) ? &diag_text[from] : "";
+	if(mounted && keyed && cache_store(cache, key, assembler, messages))
+		__sync_fetch_and_add(&cache->stores, 1);
+	if(!outer){
+		char* text = diag_end();
+		fputs(text, stdout);
+		free(text);
+	}
+	return mounted;
+}
+// -----------------------------------------------------------------------------
+
+int cache_compare(const void* a, const void* b){
+	time_t x = ((const CacheFile*) a)->used, y = ((const CacheFile*) b)->used;
+	return (x > y) - (x < y);
+}
+// -----------------------------------------------------------------------------
+
+// cache_scan: Get the entries of the cache directory, returning their count
+// -----------------------------------------------------------------------------
+int cache_scan(BuildCache* cache, CacheFile** entries, long* total){
+	char path[512];
+	int count = 0, capacity = 0;
+	*entries = NULL;
+	*total = 0;
+	DIR* dir = opendir(cache->dir);
+	if(dir == NULL)
+		return 0;
+	struct dirent* ent;
+	while((ent = readdir(dir)) != NULL){
+		size_t length = strlen(ent->d_name);
+		size_t ext = strlen(CACHE_EXTENSION);
+		if(length <= ext || length >= sizeof((*entries)->name) || strcmp(&ent->d_name[length - ext], CACHE_EXTENSION) != 0)
+			continue;
+		struct stat info;
+		if(!cache_file(cache, ent->d_name, path, sizeof(path)) || stat(path, &info) != 0)
+			continue;
+		if(count == capacity){
+			capacity = (capacity) ? capacity * 2 : 64;
+			*entries = (CacheFile*) realloc(*entries, capacity * sizeof(CacheFile));
+		}
+		snprintf((*entries)[count].name, sizeof((*entries)[count].name), "%s", ent->d_name);
+		(*entries)[count].used = info.st_mtime;
+		(*entries)[count].size = info.st_size;
+		*total += info.st_size;
+		count++;
+	}
+	closedir(dir);
+	return count;
+}
+// -----------------------------------------------------------------------------
+
+// cache_evict: Remove the least recently used entries while the cache is over
+// its size limit
+// -----------------------------------------------------------------------------
+void cache_evict(BuildCache* cache){
+	char path[512];
+	CacheFile* entries = NULL;
+	long total = 0;
+	int count = cache_scan(cache, &entries, &total);
+	if(total > cache->max){
+		qsort(entries, count, sizeof(CacheFile), cache_compare);
+		for(int i = 0; i < count && total > cache->max; i++){
+			if(cache_file(cache, entries[i].name, path, sizeof(path)) && remove(path) == 0){
+				total -= entries[i].size;
+				cache->evictions++;
+			}
+		}
+	}
+	free(entries);
+}
+// -----------------------------------------------------------------------------
+
+// cache_finish: Add the counters of this run to the statistics of the cache
+// and evict the entries over the limit. The builds that share the cache add
+// them under the lock, and write them in a temporary file renamed over the
+// statistics, so a reader never sees a partial one
+// -----------------------------------------------------------------------------
+void cache_finish(BuildCache* cache){
+	char path[512];
+	char temp[sizeof(path) + 8];
+	long hits = 0, misses = 0, stores = 0, evictions = 0;
+	cache_evict(cache);
+	if(cache->hits + cache->misses + cache->evictions == 0)
+		return;
+
+	if(!cache_file(cache, CACHE_STATS, path, sizeof(path)))
+		return;
+	cache_mkdir(cache->dir);
+	int lock = cache_lock(cache);
+	if(lock == -1)
+		return;
+	FILE* file = fopen(path, "r");
+	if(file != NULL){
+		if(fscanf(file, "%ld %ld %ld %ld", &hits, &misses, &stores, &evictions) != 4)
+			hits = misses = stores = evictions = 0;
+		fclose(file);
+	}
+	file = openTemp(path, temp, sizeof(temp), true);
+	if(file != NULL){
+		bool written = fprintf(file, "%ld %ld %ld %ld\n", hits + cache->hits, misses + cache->misses, stores + cache->stores, evictions + cache->evictions) > 0;
+		written = fclose(file) == 0 && written;
+#ifdef _WIN32
+		if(written)
+			remove(path);
+#endif
+		if(!written || rename(temp, path) != 0)
+			remove(temp);
+	}
+	cache_unlock(lock);
+}
+// -----------------------------------------------------------------------------
+
+// cache_stats: Print the statistics and the use of the cache directory
+// -----------------------------------------------------------------------------
+void cache_stats(BuildCache* cache){
+	char path[512];
+	long hits = 0, misses = 0, stores = 0, evictions = 0;
+	FILE* file = (cache_file(cache, CACHE_STATS, path, sizeof(path))) ? fopen(path, "r") : NULL;
+	if(file != NULL){
+		if(fscanf(file, "%ld %ld %ld %ld", &hits, &misses, &stores, &evictions) != 4)
+			hits = misses = stores = evictions = 0;
+		fclose(file);
+	}
+	CacheFile* entries = NULL;
+	long total = 0;
+	int count = cache_scan(cache, &entries, &total);
+	free(entries);
+
+	long lookups = hits + misses;
+	printf("\nBuild cache: %s\n", cache->dir);
+	printf("  Entries:   %d (%ld of %ld KB)\n", count, (total + 1023) / 1024, cache->max / 1024);
+	printf("  Hits:      %ld (%.1f%%)\n", hits, (lookups) ? 100.0 * hits / lookups : 0.0);
+	printf("  Misses:    %ld\n", misses);
+	printf("  Stores:    %ld\n", stores);
+	printf("  Evictions: %ld\n", evictions);
+}
+// -----------------------------------------------------------------------------
+
+#endif
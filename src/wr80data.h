@@ -8,6 +8,23 @@
 #ifndef __WR80DATA_H__
 #define __WR80DATA_H__
 
+// The assembler states are per thread, so each thread can assemble its own
+// source at the same time. The tokens are read by strtok_r on a per thread
+// position where strtok keeps a shared one (strtok_s on Windows)
+// -----------------------------------------------------------------------------
+#ifndef WR80_TLS
+#ifdef _MSC_VER
+#define WR80_TLS __declspec(thread)
+#else
+#define WR80_TLS __thread
+#endif
+#endif
+
+#ifdef _WIN32
+#define strtok_r strtok_s
+#endif
+WR80_TLS char *strtok_save = NULL;
+
 // FUNCTIONS PROTOTYPE FOR PREPROCESSOR AND ASSEMBLER
 // -----------------------------------------------------------------------------
 bool tokenizer(void);
@@ -17,6 +34,7 @@ bool generator();
 bool dcb_process(void);
 
 void format_line(void);
+void format_text(char*, bool);
 void format_operand(void);
 void reset_states(void);
 
@@ -25,6 +43,17 @@ bool assemble_file(char*, unsigned char **, bool);
 char *load_file_to_buffer(const char*, long*);
 bool preprocess_buffer(const char*, bool);
 bool assemble_buffer(const char*, unsigned char**, bool);
+bool compile_template(MacroTemplate*, const char*, MacroList*);
+void compile_params(char*, MacroList*);
+bool assemble_template(MacroTemplate*, bool);
+bool tokenize_operand(void);
+ExpansionList* memo_lookup(MacroFrame*);
+bool memo_replay(ExpansionList*);
+void memo_store(MacroFrame*, int, bool);
+void memo_begin(void);
+ExpansionList* memo_capture(int, char**, int, bool);
+void memo_label(LabelList*, RefsAddr*);
+void symbol_created(const char*);
 void proc_define(void);
 void proc_dcb(void);
 void proc_org(void);
@@ -36,7 +65,8 @@ void proc_if(void);
 void proc_export(void);
 void proc_import(void);
 void proc_endx(void);
-void (*func_ptr)();
+void proc_pragma(void);
+WR80_TLS void (*func_ptr)();
 
 void printerr(const char*);
 void printwarn(const char*);
@@ -45,9 +75,29 @@ char* replace(const char*, const char*, const char*);
 void hex_dump(unsigned char* code);
 int replace_name(char* name);
 char** parse_parameters(int *);
-int get_named_arg(const char*);
-int get_enum_arg(const char*, int);
-int get_arg(const char*);
+char** parse_arguments(int *);
+void* frame_alloc(size_t);
+bool push_context(int);
+void pop_context(void);
+void close_lists(void);
+FILE* open_source(const char*);
+char* load_source(const char*, long*);
+void close_includes(void);
+IncludeList* wait_include(const char*);
+void add_source(const char*, int);
+char* vfs_read(const char*, long*);
+const char* resolve_path(const char*);
+OnceList* once_file(const char*);
+bool once_skip(const char*, bool);
+void region_file(IncludeList*);
+void region_refer(bool);
+bool region_enter(const char*, RegionMark*);
+void region_leave(const char*, RegionMark*, bool);
+unsigned int hash_text(unsigned int, const char*);
+void reset_assembler(void);
+bool subst_args(const char*, char*, size_t, MacroFrame*, int*);
+int get_arg(const char*, char*, size_t);
+bool set_local_labels(bool, char*, size_t);
 char* get_code(const char*, const char*);
 char *buffer_fgets(char*, size_t, const char**);
 bool skip_block(const char*, const char*);
@@ -55,10 +105,88 @@ bool skip_block_buffer(const char*, const char*, const char**);
 char* get_code_buffer(const char*, const char*, const char**);
 int getArgIndex(const char*);
 bool create_label(char*, int);
+void define_symbol(char*, char*);
+int pch_include(const char*, bool);
+void pch_release(void);
 // -----------------------------------------------------------------------------
 
 #define MAX_LINE_LENGTH 1024		// MAX LENGTH OF THE LINES
 #define MEMORY_EMULATOR 65535		// MAX LENGTH OF THE EMULATOR
+#define FRAME_ARENA_SIZE 262144		// MAX LENGTH OF THE MACRO FRAMES ARENA
+#define VERSION_BUCKETS 256			// BUCKETS OF THE SYMBOL NAMES VERSIONS
+#define MAX_BLOCKS_DEPTH 256		// MAX NESTED BUFFERS WITH BLOCK INDEX
+#define EXPANSION_DEPTH 256			// DEFAULT MAX NESTED MACRO, REP AND IF EXPANSIONS
+#define EXPANSION_DEPTH_MAX 2048	// HIGHEST DEPTH, THE EXPANSIONS STILL RECURSE ON A 1MB C STACK
+
+// EXPANSION CONTEXT KINDS
+// -----------------------------------------------------
+#define CTX_MACRO	0
+#define CTX_REP		1
+#define CTX_IF		2
+
+// KINDS OF THE FILES READ BY THE ASSEMBLY
+// -----------------------------------------------------
+#define SRC_TEXT	0
+#define SRC_BINARY	1
+#define SRC_LIBRARY	2
+#define SRC_SNAPSHOT	3
+
+// PASSES THAT INCLUDED A FILE
+// -----------------------------------------------------
+#define ONCE_PREPROCESS	0x01
+#define ONCE_ASSEMBLY	0x02
+
+// PRECOMPILED INCLUDE SNAPSHOTS
+// -----------------------------------------------------
+#define PCH_MAGIC	"WR80PCH"
+#define PCH_VERSION	4			// LAYOUT VERSION OF THE SNAPSHOT FILE
+#define PCH_DEFINE	0
+#define PCH_MACRO	1
+#define PCH_LABEL	2
+#define PCH_EXPORT	3
+#define PCH_INCLUDE	4			// NESTED INCLUDE, MARKED AS INCLUDED ON LOAD
+#define PCH_ONCE	5			// FILE WITH PRAGMA ONCE
+#define PCH_CODE	0x01		// THE INCLUDE ASSEMBLES CODE OR ADDRESSED LABELS
+
+// Snapshot file: the header, the files table, the symbols table and the
+// strings, all offsets from the file beginning so the file is used mapped
+typedef struct {
+	char magic[8];
+	int version;
+	int flags;
+	int counters[3];	// local label counters added by the preprocessing
+	int source;			// path of the precompiled include
+	int nfiles;
+	int files;
+	int nsymbols;
+	int symbols;
+} PchHeader;
+
+typedef struct {
+	long long mtime;
+	long long nsec;		// nanoseconds of the mtime, 0 where not available
+	long long size;
+	int path;
+	int kind;
+} PchFile;
+
+typedef struct {
+	int kind;
+	int line;
+	int name;
+	int value;			// define value or macro formatted body, -1 if none
+	int prep;			// macro preprocessor body, -1 if none
+	int stmts;			// macro statements table
+	int count;
+	int pcount;
+	int pnames;			// macro parameter names offsets table
+} PchSymbol;
+
+typedef struct {
+	char* data;
+	int size;
+	int alloc;
+} PchBuffer;
 
 // ADRESSING TYPES
 // -----------------------------------------------------
@@ -75,101 +203,163 @@ bool create_label(char*, int);
 
 // Token Strings and Code Buffers
 // -----------------------------------------------------
-unsigned char *memory = NULL;
-unsigned char *code_address = NULL;
-char *token;
-char *directive;
-char *mnemonic;
-char *operand = NULL;
-char *label;
-char *endptr;
-char *currentfile;
-const char *bufferget = NULL;
-FILE *fileopened;
+WR80_TLS unsigned char *memory = NULL;
+WR80_TLS unsigned char *code_address = NULL;
+WR80_TLS char *token;
+WR80_TLS char *directive;
+WR80_TLS char *mnemonic;
+WR80_TLS char *operand = NULL;
+WR80_TLS char *label;
+WR80_TLS char *endptr;
+WR80_TLS char *currentfile;
+WR80_TLS const char *bufferget = NULL;
+WR80_TLS FILE *fileopened;
 
-char line[MAX_LINE_LENGTH];
-char dest[50];
-MacroList *invoked_macro = NULL;
-MacroList *currmacro = NULL;
+WR80_TLS char line[MAX_LINE_LENGTH];
+WR80_TLS char dest[50];
+WR80_TLS MacroFrame *invoked_frame = NULL;
+WR80_TLS MacroFrame *currframe = NULL;
+WR80_TLS MacroList *currmacro = NULL;
+WR80_TLS void* frame_arena[FRAME_ARENA_SIZE / sizeof(void*)];	// stack of the macro invocation frames
+WR80_TLS size_t frame_top = 0;
+WR80_TLS ExpansionContext *context_stack = NULL;	// stack of the expansions being assembled
+WR80_TLS int context_top = 0;
+WR80_TLS int context_size = 0;
+WR80_TLS int expansion_depth = EXPANSION_DEPTH;
+WR80_TLS bool diag_capture = false;		// messages kept in diag_text instead of printed
+WR80_TLS char *diag_text = NULL;
+WR80_TLS size_t diag_size = 0;
+WR80_TLS size_t diag_alloc = 0;
+WR80_TLS bool diag_records = false;		// captured messages also kept as diagnostics
+WR80_TLS Wr80Diagnostic *diag_list = NULL;
+WR80_TLS int diag_count = 0;
+WR80_TLS int diag_room = 0;
 // -----------------------------------------------------
 
 // Integer values
 // -----------------------------------------------------
-int linenum = 1;
-int linebegin = 1;
-int linesrc = 1;
-int number;
-int len;
-int bit_shift;
-int mnemonic_index = 0;
-int code_index = 0;
-int dcb_index = 0;
-int reg_index = 0;
-int org_num = 0;
-int ilabelA = 0, ilabelB = 0;
-int ilabelC = 0;
-int ifdepth = 0;
+WR80_TLS int linenum = 1;
+WR80_TLS int linebegin = 1;
+WR80_TLS int linesrc = 1;
+WR80_TLS int number;
+WR80_TLS int len;
+WR80_TLS int bit_shift;
+WR80_TLS int mnemonic_index = 0;
+WR80_TLS int code_index = 0;
+WR80_TLS int dcb_index = 0;
+WR80_TLS int reg_index = 0;
+WR80_TLS int org_num = 0;
+WR80_TLS int ilabelA = 0, ilabelB = 0;
+WR80_TLS int ilabelC = 0;
+WR80_TLS int ifdepth = 0;
 // -----------------------------------------------------
 
 // Assembler boolean states
 // -----------------------------------------------------
-bool isDirective = false;
-bool isMnemonic = false;
-bool isHexadecimal = false;
-bool listInitialized = false;
-bool isLabel = false;
-bool isRelative = false;
-bool isAllocator = false;
-bool isOrg = false;
-bool isInclude = false;
-bool isIncB = false;
-bool isExport = false;
-bool isImport = false;
-bool isEndx = false;
-bool isExportCurr = false;
-bool isRepeat = false;
-bool isHigh = false;
-bool isDecimal = false;
-bool isReferenced = false;
-bool isMacro = false;
-bool isIF = false;
-bool isELSE = false;
-bool isMacroScope = false;
-bool toIgnore = false;
-bool isLineComment = false;
-bool directive_error = false;
-
-bool syntax_6502 = false;
-bool syntax_PIC = false;
-bool syntax_Intel = false;
-bool syntax_GAS = false;
-
-bool isBuffer = false;
-bool isVerbose = false;
-bool alloc = false;
-
-bool repstate = false;
-bool ifstate = false;
-bool elsestate = false;
-bool hasif = false;
-bool macroret = false;
-
-int wll_table_alloc = 4;
-int wll_counter = 0;
-int wll_str_pointer = 4;
-int wll_index = 0;
-int wll_code_start = 0;
-char** label_pointer = NULL;
+WR80_TLS bool isDirective = false;
+WR80_TLS bool isMnemonic = false;
+WR80_TLS bool isHexadecimal = false;
+WR80_TLS bool listInitialized = false;
+WR80_TLS bool isLabel = false;
+WR80_TLS bool isRelative = false;
+WR80_TLS bool isAllocator = false;
+WR80_TLS bool isOrg = false;
+WR80_TLS bool isInclude = false;
+WR80_TLS bool isIncB = false;
+WR80_TLS bool isExport = false;
+WR80_TLS bool isImport = false;
+WR80_TLS bool isEndx = false;
+WR80_TLS bool isExportCurr = false;
+WR80_TLS bool isRepeat = false;
+WR80_TLS bool isHigh = false;
+WR80_TLS bool isDecimal = false;
+WR80_TLS bool isReferenced = false;
+WR80_TLS bool isMacro = false;
+WR80_TLS bool isIF = false;
+WR80_TLS bool isELSE = false;
+WR80_TLS bool isMacroScope = false;
+WR80_TLS bool toIgnore = false;
+WR80_TLS bool isLineComment = false;
+WR80_TLS bool lineFormatted = false;
+WR80_TLS bool directive_error = false;
+
+WR80_TLS bool syntax_6502 = false;
+WR80_TLS bool syntax_PIC = false;
+WR80_TLS bool syntax_Intel = false;
+WR80_TLS bool syntax_GAS = false;
+
+WR80_TLS bool isBuffer = false;
+WR80_TLS bool isVerbose = false;
+WR80_TLS bool alloc = false;
+
+WR80_TLS bool repstate = false;
+WR80_TLS bool ifstate = false;
+WR80_TLS bool elsestate = false;
+WR80_TLS bool hasif = false;
+WR80_TLS bool macroret = false;
+
+WR80_TLS int wll_table_alloc = 4;
+WR80_TLS int wll_counter = 0;
+WR80_TLS int wll_str_pointer = 4;
+WR80_TLS int wll_index = 0;
+WR80_TLS int wll_code_start = 0;
+WR80_TLS char** label_pointer = NULL;
 // -----------------------------------------------------
 
 // List structures for the preprocessor
 // -----------------------------------------------------
-DefineList *define_list;
-DcbList *dcb_list;
-LabelList *label_list;
-RefsAddr* curr_refer = NULL;
-MacroList *macro_list;
-int macro_depth = 0;
+WR80_TLS DefineList *define_list;
+WR80_TLS DcbList *dcb_list;
+WR80_TLS LabelList *label_list;
+WR80_TLS RefsAddr* curr_refer = NULL;
+WR80_TLS MacroList *macro_list;
+WR80_TLS CondList *cond_list = NULL;
+WR80_TLS IncludeList *include_list = NULL;	// included files prefetched by background threads
+WR80_TLS bool keep_caches = false;		// includes and IF conditions kept between assemblies
+WR80_TLS SourceList *source_list = NULL;	// files read by the assembly
+WR80_TLS PathList *path_list = NULL;		// file names resolved in the search paths
+WR80_TLS OnceList *once_list = NULL;		// files included by the assembly (INCLUDE ONCE)
+WR80_TLS Wr80Assembler *live_assembler = NULL;	// the only context alive in the thread
+WR80_TLS char **search_paths = NULL;		// search paths of the context (-I)
+WR80_TLS int search_count = 0;
+WR80_TLS Wr80Reader vfs_reader = NULL;		// files served by the embedder
+WR80_TLS void *vfs_user = NULL;
+WR80_TLS BlockIndex *file_blocks = NULL;		// block index of the file being read
+WR80_TLS BlockIndex *buffer_blocks[MAX_BLOCKS_DEPTH];	// block indexes of the buffers being read
+WR80_TLS int blocks_depth = 0;
+WR80_TLS int macro_depth = 0;
+// -----------------------------------------------------
+
+// Macro expansion memoization states
+// -----------------------------------------------------
+WR80_TLS bool memo_recording = false;	// an expansion is being recorded
+WR80_TLS bool memo_pure = true;			// recorded expansion is position independent
+WR80_TLS ExpDeps *memo_deps = NULL;
+WR80_TLS int symbol_version = 0;			// incremented on each define, label or macro created
+WR80_TLS VersionList *name_versions[VERSION_BUCKETS];	// symbol version of each created name
+WR80_TLS int memo_hits = 0;
+WR80_TLS int memo_misses = 0;
+// -----------------------------------------------------
+
+// Cache of the included regions
+// -----------------------------------------------------
+WR80_TLS RegionList *region_list = NULL;	// regions kept between assemblies
+WR80_TLS bool region_recording = false;	// an included region is being recorded
+WR80_TLS bool region_pure = true;		// recorded region can be copied again
+WR80_TLS ExpDeps *region_deps = NULL;	// labels used by the region
+WR80_TLS ExpDeps *region_defs = NULL;	// labels defined by the region
+WR80_TLS SourceList *region_files = NULL;
+WR80_TLS RefsAddr *region_stale = NULL;	// current reference before the region
+WR80_TLS int region_use = 0;				// how the region read that reference
+WR80_TLS int region_hits = 0;
+WR80_TLS int region_misses = 0;
+// -----------------------------------------------------
+
+// Precompiling of an include
+// -----------------------------------------------------
+WR80_TLS bool pch_recording = false;		// the preprocessed symbols are recorded
+WR80_TLS PchList *pch_list = NULL;
+WR80_TLS PchMap *pch_maps = NULL;			// snapshots referenced by the loaded macros
 // -----------------------------------------------------
 
 // -----------------------------------------------------
@@ -177,6 +367,7 @@ int macro_depth = 0;
 // WR80's Assembly Mnemonics Vector
 // -----------------------------------------------------
 #define MNEMONICS_SIZE 	63
+#define MNEMONICS_CODE 	50		// INSTRUCTIONS BEFORE THE DIRECTIVES
 const char* mnemonics[] = {
 	// Logical Instructions
 	"AND",
@@ -340,14 +531,15 @@ const char* directives[] = {
 	"DEFINE",
 	"INCLUDE",
 	"MACRO",
-	"EXPORT"
+	"EXPORT",
+	"PRAGMA"
 };
 // -----------------------------------------------------
 
 // Preprocessor Execution vector for directives
 // -----------------------------------------------------
 int* process[] = {
-	(int*)proc_define, (int*)proc_include, (int*)proc_macro, (int*)proc_export
+	(int*)proc_define, (int*)proc_include, (int*)proc_macro, (int*)proc_export, (int*)proc_pragma
 };
 
 // -----------------------------------------------------
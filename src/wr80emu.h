@@ -0,0 +1,604 @@
+/*
+	WR80 Assembler Emulator Library
+	Created by Wender Francis (KiddieOS.Community)
+	Date: 20/08/2025
+
+*/
+
+#ifndef __WR80EMU_H__
+#define __WR80EMU_H__
+
+/*
+	The emulator runs the WR80 machine code decoded by the same opcodes[] and
+	addressing[] tables of the assembler. Each of the 256 bytes is mapped to
+	the mnemonic that has it as opcode, with the operand in its low bits. The
+	runs of instructions up to a jump are decoded once in blocks of micro-ops
+	by the start address, threaded by the labels of their handlers, and the
+	writes in the decoded bytes flush the blocks for the programs that change
+	their own code.
+
+	Machine:	DR (the data register), R0-R7, the ports P0-P7, the flags C, Z,
+				D (direction) and I (interrupts), a 16 bits PC, and SP and BP
+				of the stack page (EMU_STACK). The image is loaded at the
+				address 0, SP starts at 0xFF and the stack grows down, with
+				the calls pushing the high byte of the return address first.
+	Ports:		P0:P1 is the memory address read and written through P2, P3
+				is the console and the others keep the last value written.
+	End:		a jump to itself halts, as the "end: jp end" of the programs,
+				and the run ends when the PC leaves the image.
+
+	AND OR XOR ADD SUB r	DR = DR op Rr, NOT r: DR = ~Rr, Z (C: carry, borrow)
+	ST n, STD n				DR low nibble = n, DR = n
+	LD r, STL r				Rr = DR, DR = Rr
+	IN p, OUT p				DR = Pp, Pp = DR
+	SHR n, SHL n			DR shifted by n, C is the last bit shifted out
+	BT r					compare DR with Rr: Z if equal, C if lower
+	JC JZ JP, CALL, RET		relative jumps of 12 bits, from the next opcode
+	EI DI, ED DD, EC DC		set and clear the flags I, D and C
+	CDR, CLR				DR = 0, DR and R0-R7 = 0
+	PUSHB POPB PUSHS POPS	push and pop BP, SP
+	PUSHD POPD PUSH POP		push and pop DR, Rr
+	PUSHA POPA				push and pop R0-R7
+	SBP SSP, SCR SCS		BP = DR, SP = DR, DR = BP, DR = SP
+	ABP, SBW				DR = stack[BP + DR], stack[BP + R0] = DR
+	IRET					pop the flags and the return address
+	MUL r, DIV r			DR = DR * Rr with the high byte in R0,
+							DR = DR / Rr with the remainder in R0
+	INCR DECR IDC			DR + 1, DR - 1, DR + 1 or - 1 by the flag D
+*/
+// -----------------------------------------------------------------------------
+#include <time.h>
+
+#define EMU_MEMORY	0x10000		// ADDRESS SPACE OF THE EMULATOR
+#define EMU_STACK	0xFF00		// PAGE OF THE STACK, ADDRESSED BY SP AND BP
+
+// PORTS OF THE DEVICES
+// -----------------------------------------------------
+#define EMU_PORT_HIGH		0	// high byte of the memory address
+#define EMU_PORT_LOW		1	// low byte of the memory address
+#define EMU_PORT_DATA		2	// memory byte at the address
+#define EMU_PORT_CONSOLE	3	// character written or read
+
+// STATES OF THE END OF A RUN
+// -----------------------------------------------------
+#define EMU_HALT	0			// jump to itself
+#define EMU_END		1			// PC out of the image
+#define EMU_LIMIT	2			// steps limit reached
+#define EMU_INVALID	3			// byte without mnemonic
+#define EMU_DIVIDE	4			// division by zero
+
+// CACHE OF THE DECODED BLOCKS
+// -----------------------------------------------------
+#define EMU_BLOCK	32			// MAX INSTRUCTIONS OF A BLOCK
+#define EMU_OPS		0x20000		// MICRO-OPS OF THE CACHE, FLUSHED WHEN FULL
+#define EMU_FALL	50			// INDEX OF THE MICRO-OP AFTER A BLOCK
+
+const char* emu_states[] = {
+	"Halted by a jump to itself",
+	"Ended out of the image",
+	"Stopped by the steps limit",
+	"Stopped by an invalid opcode",
+	"Stopped by a division by zero"
+};
+
+// States of the emulated processor
+typedef struct {
+	unsigned char* memory;	// address space of EMU_MEMORY bytes
+	long size;				// length of the image loaded at the address 0
+	unsigned short pc;
+	unsigned char dr;
+	unsigned char r[8];
+	unsigned char port[8];
+	unsigned char sp;
+	unsigned char bp;
+	bool c, z, d, i;
+	unsigned long long steps;	// instructions executed
+	int state;				// EMU_HALT, EMU_END...
+	const Wr80Symbol* labels;	// symbols of the assembly (NULL for the files)
+	int nlabels;
+	unsigned long long blocks;	// blocks decoded in the cache
+	unsigned long long flushes;	// flushes of the cache by writes in the code
+} Wr80Cpu;
+
+// Instruction decoded with its operand and the addresses of its jumps
+typedef struct EmuOp {
+	void* handler;			// label of the handler in emu_run
+	struct EmuOp* link[2];	// blocks of the jump and of the next address
+	unsigned short at;		// address of the instruction
+	unsigned short next;	// address of the next instruction
+	unsigned short target;	// address of the jump or the call
+	unsigned char arg;		// register, port or immediate value
+	unsigned char index;	// index of the mnemonic (EMU_FALL after a block)
+	unsigned char length;	// instructions left in the block, with this one
+} EmuOp;
+
+// Blocks of micro-ops by the start address. A block or a decoded byte is
+// valid while its generation is the one of the cache
+typedef struct {
+	EmuOp ops[EMU_OPS];
+	EmuOp single[2];		// one instruction decoded out of the cache
+	int used;
+	unsigned int generation;
+	unsigned int valid[EMU_MEMORY];
+	unsigned int start[EMU_MEMORY];
+	unsigned int cover[EMU_MEMORY];
+	unsigned long long blocks;
+	unsigned long long flushes;
+} EmuCache;
+// -----------------------------------------------------------------------------
+
+// emu_reset: Start the processor on the image of the memory
+// -----------------------------------------------------------------------------
+void emu_reset(Wr80Cpu* cpu, unsigned char* memory, long size){
+	memset(cpu, 0, sizeof(Wr80Cpu));
+	cpu->memory = memory;
+	cpu->size = size;
+	cpu->sp = 0xFF;
+}
+// -----------------------------------------------------------------------------
+
+// emu_decoder: Map each byte to the index of the mnemonic that has it as
+// opcode. The REG operands take 3 bits and the IMM and REL ones the bits up
+// to the next opcode of the row. CALL has the back jumps 0x20 above
+// -----------------------------------------------------------------------------
+void emu_decoder(signed char* decode){
+	int count = sizeof(opcodes) / sizeof(opcodes[0]);
+	memset(decode, -1, 256);
+	for(int m = 0; m < count; m++){
+		int op = opcodes[m];
+		int end = (op & 0xF0) + 0x10;
+		for(int n = 0; n < count; n++)
+			if(opcodes[n] > op && opcodes[n] < end)
+				end = opcodes[n];
+		if((addressing[m] & REG) && end > op + 8)
+			end = op + 8;
+		if(!(addressing[m] & (REG | IMM | REL)))
+			end = op + 1;
+		bool call = strcmp(mnemonics[m], "CALL") == 0;
+		for(int b = op; b < end; b++){
+			decode[b] = m;
+			if(call)
+				decode[b + 0x20] = m;
+		}
+	}
+}
+// -----------------------------------------------------------------------------
+
+// emu_label: Name of the label at the address, or NULL
+// -----------------------------------------------------------------------------
+const char* emu_label(Wr80Cpu* cpu, unsigned short address){
+	for(int i = 0; i < cpu->nlabels; i++)
+		if(cpu->labels[i].kind == WR80_LABEL && cpu->labels[i].value == address)
+			return cpu->labels[i].name;
+	return NULL;
+}
+// -----------------------------------------------------------------------------
+
+// emu_trace: Print the instruction at the PC with the states before it
+// -----------------------------------------------------------------------------
+void emu_trace(Wr80Cpu* cpu, const signed char* decode){
+	unsigned char op = cpu->memory[cpu->pc];
+	const char* label = emu_label(cpu, cpu->pc);
+	if(label != NULL)
+		printf("%s:\n", label);
+	printf("%04X  %02X  %-6s DR=%02X R=%02X %02X %02X %02X %02X %02X %02X %02X SP=%02X BP=%02X C=%d Z=%d\n",
+			cpu->pc, op, (decode[op] >= 0) ? mnemonics[decode[op]] : "???", cpu->dr,
+			cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], cpu->r[4], cpu->r[5], cpu->r[6], cpu->r[7],
+			cpu->sp, cpu->bp, cpu->c, cpu->z);
+}
+// -----------------------------------------------------------------------------
+
+// emu_predecode: Decode the instructions from the address up to a jump, a
+// return, an invalid opcode, the end of the image or max instructions. Each
+// micro-op keeps the instructions left in its block, and the one after the
+// last falls to the next address
+// -----------------------------------------------------------------------------
+int emu_predecode(EmuOp* ops, int max, const unsigned char* mem, unsigned long size, unsigned short pc, const signed char* decode){
+	int n = 0;
+	while(n < max && pc < size && decode[mem[pc]] >= 0){
+		unsigned char b = mem[pc];
+		int m = decode[b];
+		EmuOp* op = &ops[n++];
+		op->index = m;
+		op->at = pc++;
+		op->arg = b - opcodes[m];
+		if(addressing[m] & IMM2)
+			op->arg = mem[pc++];
+		if(addressing[m] & REL){
+			int high = b - opcodes[m];
+			if(high >= 0x20)
+				high = (high - 0x20) | 0x08;	// CALL back
+			int offset = (high << 8) | mem[pc++];
+			op->target = pc + ((offset ^ 0x800) - 0x800);
+		}
+		op->next = pc;
+		if((addressing[m] & REL) || strcmp(mnemonics[m], "RET") == 0 || strcmp(mnemonics[m], "IRET") == 0)
+			break;
+	}
+	for(int i = 0; i < n; i++)
+		ops[i].length = n - i;
+	ops[n].index = EMU_FALL;
+	ops[n].at = ops[n].next = pc;
+	ops[n].length = 0;
+	for(int i = 0; i <= n; i++)
+		ops[i].link[0] = ops[i].link[1] = NULL;
+	return n;
+}
+// -----------------------------------------------------------------------------
+
+// emu_block: Decode the block of the address in the cache, marking its bytes
+// to invalidate it when they are written, and set the handlers of the engine
+// -----------------------------------------------------------------------------
+EmuOp* emu_block(EmuCache* cache, const unsigned char* mem, unsigned long size, unsigned short pc, const signed char* decode, void* const* handlers){
+	if(cache->used + EMU_BLOCK + 1 > EMU_OPS){
+		cache->generation++;
+		cache->used = 0;
+		cache->flushes++;
+	}
+	
+	EmuOp* ops = &cache->ops[cache->used];
+	int n = emu_predecode(ops, EMU_BLOCK, mem, size, pc, decode);
+	for(int i = 0; i <= n; i++)
+		ops[i].handler = handlers[ops[i].index];
+	for(unsigned int a = pc; a < ops[n].next; a++)
+		cache->cover[a] = cache->generation;
+	cache->start[pc] = cache->used;
+	cache->valid[pc] = cache->generation;
+	cache->used += n + 1;
+	cache->blocks++;
+	return ops;
+}
+// -----------------------------------------------------------------------------
+
+// emu_run: Execute the instructions until the end of the program, or until
+// limit instructions (0 to run without limit). The blocks are taken from the
+// cache, or decoded once, and their micro-ops are threaded by the labels of
+// the handlers. The jumps link the blocks they reach, until the cache is
+// flushed, to go straight to them. The states are kept in locals while running, and written
+// back when the run stops or for the trace, which runs one instruction a
+// block as the last ones before the limit
+// -----------------------------------------------------------------------------
+int emu_run(Wr80Cpu* cpu, unsigned long long limit, bool trace){
+	static void* const handlers[] = {
+		&&op_and, &&op_or, &&op_not, &&op_xor, &&op_add, &&op_sub,
+		&&op_st, &&op_ld, &&op_in, &&op_out, &&op_shr, &&op_shl,
+		&&op_bt, &&op_jc, &&op_jz, &&op_jp,
+		&&op_ei, &&op_di, &&op_ed, &&op_dd, &&op_ec, &&op_dc, &&op_cdr, &&op_clr,
+		&&op_pushb, &&op_popb, &&op_pushs, &&op_pops, &&op_sbp, &&op_abp, &&op_ssp, &&op_iret,
+		&&op_pushd, &&op_popd, &&op_sbw, &&op_scr, &&op_scs, &&op_pusha, &&op_popa, &&op_ret,
+		&&op_push, &&op_pop, &&op_call,
+		&&op_mul, &&op_div, &&op_stl, &&op_std, &&op_incr, &&op_decr, &&op_idc,
+		[EMU_FALL] = &&op_fall
+	};
+	signed char decode[256];
+	emu_decoder(decode);
+	for(int b = 0; b < 256; b++)
+		if(decode[b] >= EMU_FALL || handlers[decode[b]] == NULL)
+			decode[b] = -1;
+	
+	EmuCache* cache = (EmuCache*) calloc(1, sizeof(EmuCache));
+	if(cache == NULL){
+		perror("Error allocating the cache of the emulator");
+		return cpu->state = EMU_INVALID;
+	}
+	cache->generation = 1;
+	
+	unsigned char* mem = cpu->memory;
+	unsigned char* r = cpu->r;
+	unsigned int* cover = cache->cover;
+	unsigned int generation = cache->generation;
+	unsigned long long budget = (limit == 0) ? ~0ULL : limit;
+	unsigned long long steps = 0;
+	unsigned long size = cpu->size;
+	unsigned short pc = cpu->pc, at = pc;
+	unsigned char dr = cpu->dr, sp = cpu->sp, bp = cpu->bp;
+	unsigned char value;
+	bool c = cpu->c, z = cpu->z, d = cpu->d, i = cpu->i;
+	bool dirty = false;
+	unsigned int wide;
+	EmuOp* op;
+	EmuOp* from = NULL;		// micro-op of the jump to link to the block
+	int slot = 0;
+
+#define EMU_SAVE()		do{ cpu->pc = at; cpu->dr = dr; cpu->sp = sp; cpu->bp = bp; \
+							cpu->c = c; cpu->z = z; cpu->d = d; cpu->i = i; }while(0)
+#define EMU_STORE(a, v)	do{ unsigned int a_ = (a); mem[a_] = (v); \
+							if(cover[a_] == generation) dirty = true; }while(0)
+#define EMU_PUSH(v)		EMU_STORE(EMU_STACK | sp--, v)
+#define EMU_POP()		(mem[EMU_STACK | ++sp])
+#define EMU_JUMP(t)		do{ pc = (t); if(pc == op->at){ at = pc; cpu->state = EMU_HALT; goto stop; } }while(0)
+#define EMU_NEXT()		goto *(++op)->handler
+#define EMU_CHAIN(n)	do{ if(op->link[n] != NULL && !dirty && budget - steps >= EMU_BLOCK){ \
+							op = op->link[n]; steps += op->length; goto *op->handler; } \
+							from = op; slot = n; goto block; }while(0)
+#define EMU_WRITTEN()	do{ if(dirty){ steps -= op->length - 1; pc = op->next; goto block; } EMU_NEXT(); }while(0)
+
+block:
+	at = pc;
+	if(dirty){
+		cache->generation++;
+		cache->used = 0;
+		cache->flushes++;
+		dirty = false;
+	}
+	if(pc >= size){
+		cpu->state = EMU_END;
+		goto stop;
+	}
+	if(steps == budget){
+		cpu->state = EMU_LIMIT;
+		goto stop;
+	}
+	if(trace || budget - steps < EMU_BLOCK){
+		op = cache->single;
+		emu_predecode(op, 1, mem, size, pc, decode);
+		op[0].handler = handlers[op[0].index];
+		op[1].handler = &&op_fall;
+		from = NULL;
+	}else{
+		if(cache->valid[pc] == cache->generation)
+			op = &cache->ops[cache->start[pc]];
+		else
+			op = emu_block(cache, mem, size, pc, decode, handlers);
+		if(from != NULL && generation == cache->generation && from != cache->single && from != &cache->single[1])
+			from->link[slot] = op;
+		from = NULL;
+	}
+	generation = cache->generation;
+	if(op->length == 0){
+		cpu->state = EMU_INVALID;
+		goto stop;
+	}
+	steps += op->length;
+	if(trace){
+		EMU_SAVE();
+		emu_trace(cpu, decode);
+	}
+	goto *op->handler;
+
+	op_fall:	pc = op->next; EMU_CHAIN(1);
+	op_and:	dr &= r[op->arg]; z = dr == 0; EMU_NEXT();
+	op_or:	dr |= r[op->arg]; z = dr == 0; EMU_NEXT();
+	op_not:	dr = ~r[op->arg]; z = dr == 0; EMU_NEXT();
+	op_xor:	dr ^= r[op->arg]; z = dr == 0; EMU_NEXT();
+	op_add:	wide = dr + r[op->arg]; c = wide > 0xFF; dr = wide; z = dr == 0; EMU_NEXT();
+	op_sub:	c = dr < r[op->arg]; dr -= r[op->arg]; z = dr == 0; EMU_NEXT();
+	op_st:	dr = (dr & 0xF0) | op->arg; EMU_NEXT();
+	op_ld:	r[op->arg] = dr; EMU_NEXT();
+	op_in:
+		if(op->arg == EMU_PORT_DATA){
+			dr = mem[(cpu->port[EMU_PORT_HIGH] << 8) | cpu->port[EMU_PORT_LOW]];
+		}else if(op->arg == EMU_PORT_CONSOLE){
+			int ch = getchar();
+			dr = (ch == EOF) ? 0 : ch;
+		}else{
+			dr = cpu->port[op->arg];
+		}
+		EMU_NEXT();
+	op_out:
+		cpu->port[op->arg] = dr;
+		if(op->arg == EMU_PORT_DATA)
+			EMU_STORE((cpu->port[EMU_PORT_HIGH] << 8) | cpu->port[EMU_PORT_LOW], dr);
+		else if(op->arg == EMU_PORT_CONSOLE)
+			putchar(dr);
+		EMU_WRITTEN();
+	op_shr:
+		if(op->arg){
+			c = (dr >> (op->arg - 1)) & 1;
+			dr >>= op->arg;
+		}
+		z = dr == 0;
+		EMU_NEXT();
+	op_shl:
+		if(op->arg){
+			c = ((dr << (op->arg - 1)) & 0x80) != 0;
+			dr <<= op->arg;
+		}
+		z = dr == 0;
+		EMU_NEXT();
+	op_bt:	z = dr == r[op->arg]; c = dr < r[op->arg]; EMU_NEXT();
+	op_jc:
+		if(c){
+			EMU_JUMP(op->target);
+			EMU_CHAIN(0);
+		}
+		pc = op->next;
+		EMU_CHAIN(1);
+	op_jz:
+		if(z){
+			EMU_JUMP(op->target);
+			EMU_CHAIN(0);
+		}
+		pc = op->next;
+		EMU_CHAIN(1);
+	op_jp:	EMU_JUMP(op->target); EMU_CHAIN(0);
+	op_ei:	i = true; EMU_NEXT();
+	op_di:	i = false; EMU_NEXT();
+	op_ed:	d = true; EMU_NEXT();
+	op_dd:	d = false; EMU_NEXT();
+	op_ec:	c = true; EMU_NEXT();
+	op_dc:	c = false; EMU_NEXT();
+	op_cdr:	dr = 0; EMU_NEXT();
+	op_clr:	dr = 0; memset(r, 0, 8); EMU_NEXT();
+	op_pushb:	EMU_PUSH(bp); EMU_WRITTEN();
+	op_popb:	bp = EMU_POP(); EMU_NEXT();
+	op_pushs:	value = sp; EMU_PUSH(value); EMU_WRITTEN();
+	op_pops:	value = EMU_POP(); sp = value; EMU_NEXT();
+	op_sbp:	bp = dr; EMU_NEXT();
+	op_abp:	dr = mem[EMU_STACK | (unsigned char) (bp + dr)]; EMU_NEXT();
+	op_ssp:	sp = dr; EMU_NEXT();
+	op_iret:
+		value = EMU_POP();
+		c = value & 1; z = (value >> 1) & 1; d = (value >> 2) & 1; i = (value >> 3) & 1;
+		pc = EMU_POP();
+		pc |= EMU_POP() << 8;
+		goto block;
+	op_pushd:	EMU_PUSH(dr); EMU_WRITTEN();
+	op_popd:	dr = EMU_POP(); EMU_NEXT();
+	op_sbw:	EMU_STORE(EMU_STACK | (unsigned char) (bp + r[0]), dr); EMU_WRITTEN();
+	op_scr:	dr = bp; EMU_NEXT();
+	op_scs:	dr = sp; EMU_NEXT();
+	op_pusha:
+		for(value = 0; value < 8; value++)
+			EMU_PUSH(r[value]);
+		EMU_WRITTEN();
+	op_popa:
+		for(value = 8; value > 0; value--)
+			r[value - 1] = EMU_POP();
+		EMU_NEXT();
+	op_ret:
+		pc = EMU_POP();
+		pc |= EMU_POP() << 8;
+		goto block;
+	op_push:	EMU_PUSH(r[op->arg]); EMU_WRITTEN();
+	op_pop:	r[op->arg] = EMU_POP(); EMU_NEXT();
+	op_call:
+		EMU_PUSH(op->next >> 8);
+		EMU_PUSH(op->next & 0xFF);
+		EMU_JUMP(op->target);
+		EMU_CHAIN(0);
+	op_mul:
+		wide = dr * r[op->arg];
+		dr = wide;
+		r[0] = wide >> 8;
+		c = wide > 0xFF;
+		z = dr == 0;
+		EMU_NEXT();
+	op_div:
+		value = r[op->arg];
+		if(value == 0){
+			steps -= op->length;
+			at = op->at;
+			cpu->state = EMU_DIVIDE;
+			goto stop;
+		}
+		r[0] = dr % value;
+		dr /= value;
+		z = dr == 0;
+		EMU_NEXT();
+	op_stl:	dr = r[op->arg]; EMU_NEXT();
+	op_std:	dr = op->arg; EMU_NEXT();
+	op_incr:	dr++; z = dr == 0; EMU_NEXT();
+	op_decr:	dr--; z = dr == 0; EMU_NEXT();
+	op_idc:	dr += (d) ? -1 : 1; z = dr == 0; EMU_NEXT();
+
+stop:
+	EMU_SAVE();
+	cpu->steps += steps;
+	cpu->blocks += cache->blocks;
+	cpu->flushes += cache->flushes;
+	free(cache);
+	fflush(stdout);
+	return cpu->state;
+
+#undef EMU_SAVE
+#undef EMU_STORE
+#undef EMU_PUSH
+#undef EMU_POP
+#undef EMU_JUMP
+#undef EMU_NEXT
+#undef EMU_CHAIN
+#undef EMU_WRITTEN
+}
+// -----------------------------------------------------------------------------
+
+// emu_load: Read the binary file or the hexa file (v2.0 raw, with the N*XX
+// repetitions of logisim) in the memory, returning the size of the image
+// -----------------------------------------------------------------------------
+long emu_load(const char* filename, unsigned char* memory){
+	FILE* file = fopen(filename, "rb");
+	if(file == NULL){
+		perror("Error opening the binary file");
+		return -1;
+	}
+	
+	char header[9] = {0};
+	long size = 0;
+	if(fread(header, 1, 8, file) == 8 && strcmp(header, "v2.0 raw") == 0){
+		char word[32];
+		while(fscanf(file, "%31s", word) == 1){
+			char* star = strchr(word, '*');
+			long repeat = (star != NULL) ? strtol(word, NULL, 10) : 1;
+			long value = strtol((star != NULL) ? star + 1 : word, NULL, 16);
+			while(repeat-- > 0 && size < EMU_MEMORY)
+				memory[size++] = value;
+		}
+	}else{
+		rewind(file);
+		size = fread(memory, 1, EMU_MEMORY, file);
+	}
+	
+	bool failed = ferror(file);
+	fclose(file);
+	if(failed){
+		fprintf(stderr, "Error reading the binary file '%s'\n", filename);
+		return -1;
+	}
+	return size;
+}
+// -----------------------------------------------------------------------------
+
+// emu_report: Print the end of the run with the instructions per second
+// -----------------------------------------------------------------------------
+void emu_report(Wr80Cpu* cpu, double seconds){
+	const char* label = emu_label(cpu, cpu->pc);
+	printf("\n%s at %04X", emu_states[cpu->state], cpu->pc);
+	if(label != NULL)
+		printf(" (%s)", label);
+	printf(" after %llu instructions", cpu->steps);
+	if(seconds > 0)
+		printf(" in %.3f s (%.2f MIPS)", seconds, cpu->steps / seconds / 1e6);
+	printf("\n%llu blocks decoded, %llu flushes by writes in the code", cpu->blocks, cpu->flushes);
+	printf("\nDR=%02X R=%02X %02X %02X %02X %02X %02X %02X %02X SP=%02X BP=%02X C=%d Z=%d D=%d I=%d\n",
+			cpu->dr, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], cpu->r[4], cpu->r[5], cpu->r[6], cpu->r[7],
+			cpu->sp, cpu->bp, cpu->c, cpu->z, cpu->d, cpu->i);
+}
+// -----------------------------------------------------------------------------
+
+// emu_main: Emulate the binary file, tracing each instruction with debug
+// -----------------------------------------------------------------------------
+int emu_main(const char* filename, bool debug, unsigned long long limit){
+	unsigned char* memory = (unsigned char*) calloc(EMU_MEMORY, 1);
+	if(memory == NULL){
+		perror("Error allocating the memory of the emulator");
+		return EXIT_FAILURE;
+	}
+	
+	long size = emu_load(filename, memory);
+	if(size < 0){
+		free(memory);
+		return EXIT_FAILURE;
+	}
+	
+	Wr80Cpu cpu;
+	emu_reset(&cpu, memory, size);
+	clock_t start = clock();
+	int state = emu_run(&cpu, limit, debug);
+	emu_report(&cpu, (double) (clock() - start) / CLOCKS_PER_SEC);
+	free(memory);
+	return (state == EMU_HALT || state == EMU_END) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+// -----------------------------------------------------------------------------
+
+// emu_assembly: Emulate the machine code of the last assembly in the memory
+// of the assembler, without copying it, with its labels in the trace
+// -----------------------------------------------------------------------------
+int emu_assembly(Wr80Assembler* assembler, bool debug, unsigned long long limit){
+	if(assembler->code == NULL || assembler->size > EMU_MEMORY)
+		return EXIT_FAILURE;
+	if(assembler->symbols == NULL)
+		wr80_collect(assembler);
+	memset(&assembler->code[assembler->size], 0, EMU_MEMORY - assembler->size);
+	
+	Wr80Cpu cpu;
+	emu_reset(&cpu, assembler->code, assembler->size);
+	cpu.labels = assembler->symbols;
+	cpu.nlabels = assembler->nsymbols;
+	clock_t start = clock();
+	int state = emu_run(&cpu, limit, debug);
+	emu_report(&cpu, (double) (clock() - start) / CLOCKS_PER_SEC);
+	return (state == EMU_HALT || state == EMU_END) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+// -----------------------------------------------------------------------------
+
+#endif
@@ -8,6 +8,8 @@
 #ifndef __WR80LIST_H__
 #define __WR80LIST_H__
 
+void memo_name(const char*);	// records the names read by a memoized expansion
+
 // 1st list node for defines
 struct node_def {
 	int line;
@@ -52,23 +54,292 @@ struct node_lab {
 };
 typedef struct node_lab LabelList;
 
+// Compiled statement of a macro body
+#define STMT_BLANK	0x01	// raw empty line, only counts the line number
+#define STMT_IGNORE	0x02	// spaces or comments, ignored by the tokenizer
+#define STMT_PREP	0x04	// line that the preprocessor acts on (labels, defines...)
+
+typedef struct {
+	int offset;		// statement offset in the formatted body
+	int length;		// statement length without the line break
+	int flags;
+	int mnemonic;	// instruction parsed once, its mnemonic index (-1 to tokenize)
+	int operand;	// operand offset in the statement (-1 if none)
+} MacroStmt;
+
+// Block index: lines of a source and the matching end of each block begun
+typedef struct {
+	long offset;		// line offset in the indexed text
+	long pos;			// file position of the line (file sources)
+	int length;
+	int span;			// block begun by this line (-1 if none)
+	bool stored;		// line kept in the captured bodies
+} BlockLine;
+
+typedef struct {
+	int type;			// index in block[]
+	int first;			// first line of the body
+	int last;			// end line (count of lines if unbalanced)
+	bool reported;
+} BlockSpan;
+
+struct node_blocks {
+	const char* base;	// indexed buffer (NULL for files)
+	long length;
+	FILE* file;			// indexed file (NULL for buffers)
+	char* text;			// lines read from the file
+	BlockLine* lines;
+	int count;
+	BlockSpan* spans;
+	int nspans;
+	long eof;			// file position after the last line
+	bool built;
+	bool quiet;			// unbalanced blocks already reported by the preprocessor
+};
+typedef struct node_blocks BlockIndex;
+
+// included file read ahead of the passes by a prefetch thread
+struct node_inc {
+	char path[256];
+	char* buffer;
+	long size;
+	struct stat stat;	// file identity and time of the read copy
+	unsigned int hash;	// hash of the read copy
+	bool served;		// copy served by the reader of the context
+	bool started;
+	Wr80Thread thread;
+	struct node_inc * next;
+};
+typedef struct node_inc IncludeList;
+
+// file read by the assembly: sources, included binaries and imported libraries
+struct node_src {
+	char path[256];
+	int kind;			// SRC_TEXT, SRC_BINARY or SRC_LIBRARY
+	unsigned int hash;	// content hash (files of the kept regions)
+	struct node_src * next;
+};
+typedef struct node_src SourceList;
+
+// file name of the sources resolved in the search paths
+struct node_path {
+	char name[256];
+	char path[256];
+	struct node_path * next;
+};
+typedef struct node_path PathList;
+
+// file included by the assembly, identified by its device and inode or by
+// its canonical path when the file isn't on the disk
+struct node_once {
+	char name[256];		// name resolved in the source
+	char path[256];		// canonical path
+	unsigned long long dev;
+	unsigned long long ino;
+	bool pragma;		// the file has PRAGMA ONCE
+	int passes;			// ONCE_PREPROCESS and ONCE_ASSEMBLY: passes that included it
+	struct node_once * next;
+};
+typedef struct node_once OnceList;
+
+// Template: a macro or REP body formatted once and splitted in statements,
+// the instructions parsed in their mnemonic and operand
+typedef struct {
+	char* body;			// formatted body (NULL if empty)
+	char* prep;			// body with only the preprocessor lines (NULL if none)
+	MacroStmt* stmts;
+	int count;
+	BlockIndex* blocks;	// blocks of the body
+	bool mapped;		// body, prep and stmts point into a mapped snapshot
+} MacroTemplate;
+
+// 5th list node for label and name dependencies of a memoized macro expansion
+struct node_dep {
+	LabelList* label;	// NULL for a name dependency
+	char* name;			// symbol name read by the expansion
+	int version;		// version of the name when the expansion was assembled
+	int addr;			// label address when the expansion was assembled
+	bool hasRef;		// the expansion inserted a forward reference
+	RefsAddr* live;		// reference inserted while recording
+	RefsAddr ref;		// its copy, with the address relative to the expansion
+	struct node_dep * next;
+};
+typedef struct node_dep ExpDeps;
+
+// 6th list node for memoized macro expansions
+struct node_exp {
+	int argc;
+	char** args;
+	int version;		// symbol version when its names were last checked
+	bool ifstate;
+	int length;
+	unsigned char* code;
+	ExpDeps* deps;
+	ExpDeps* refer;		// dependency left in the current reference (NULL if none)
+	struct node_exp * next;
+};
+typedef struct node_exp ExpansionList;
+
 struct node_mac {
 	int line;
 	int pcount;
-	int argsc;
 	char id[256];
 	char name[256];
 	char** pnames;
-	char** pvalues;
 	char* content;
-	int indexp;
 	int ilabelA;
 	int ilabelB;
 	int ilabelC;
+	MacroTemplate tmpl;
+	ExpansionList* cache;
 	struct node_mac * next;
 };
 typedef struct node_mac MacroList;
 
+// label used or defined by a kept region
+struct node_rlab {
+	char name[256];
+	int addr;			// label address when used, or the address defined
+	bool defined;		// defined inside the region
+	bool hasRef;		// the region inserted a forward reference
+	bool refer;			// its reference was the current one at the region end
+	RefsAddr ref;		// its copy, with the address relative to the region
+	struct node_rlab * next;
+};
+typedef struct node_rlab RegionLabels;
+
+// region of the image assembled by an included file, kept between the
+// assemblies to be copied again while its inputs are unchanged
+struct node_reg {
+	char path[256];
+	int start;			// code index where the region begins
+	int org;
+	bool ifstate;
+	unsigned int symbols;	// hash of the symbols and label counters before it
+	SourceList* files;	// text files read by the region
+	RegionLabels* labels;
+	int* counters;		// increments of the local label counters
+	int ncounters;
+	bool keepRefer;		// the current reference at the end was the one before
+	int staleUse;		// how the reference before was read (0 if it wasn't)
+	int length;
+	unsigned char* code;
+	struct node_reg * next;
+};
+typedef struct node_reg RegionList;
+
+// states at the beginning of a region in recording
+typedef struct {
+	bool recording;
+	int start;
+	int org;
+	bool ifstate;
+	unsigned int symbols;
+	int* counters;		// local label counters at the beginning
+	int ncounters;
+	LabelList* labels;	// heads of the symbol lists at the beginning
+	DefineList* defines;
+	MacroList* macros;
+} RegionMark;
+
+// symbol recorded by the precompiling of an include, in preprocessing order
+struct node_pch {
+	int kind;			// PCH_DEFINE, PCH_MACRO, PCH_LABEL or PCH_EXPORT
+	int line;
+	char* name;
+	char* value;		// raw value of the define
+	MacroList* macro;
+	struct node_pch * next;
+};
+typedef struct node_pch PchList;
+
+// snapshot kept mapped while the macros loaded from it are defined
+struct node_pchmap {
+	char* data;
+	size_t size;
+	struct node_pchmap * next;
+};
+typedef struct node_pchmap PchMap;
+
+// version of the last symbol created with a name, in hashed buckets
+struct node_version {
+	char* name;
+	int version;
+	struct node_version * next;
+};
+typedef struct node_version VersionList;
+
+// macro invocation frame: the arguments are views on the frames arena
+struct node_frame {
+	MacroList* macro;
+	int argc;
+	char** args;
+	int indexp;
+	size_t mark;
+};
+typedef struct node_frame MacroFrame;
+
+// expansion context: reading states saved when a macro, REP or IF body is
+// expanded and restored when the body ends
+struct node_context {
+	int kind;
+	int linenum;
+	const char* bufferget;
+	bool ifstate;
+	bool isIF;
+	bool isELSE;
+	MacroFrame* frame;
+	MacroList* macro;
+};
+typedef struct node_context ExpansionContext;
+
+// assembler context: options and results of an assembly. The states of the
+// assembly belong to the thread that runs it and are reset on each assembly
+struct wr80_assembler {
+	bool verbose;
+	bool alloc;
+	int depth;
+	bool capture;		// messages kept as diagnostics instead of printed
+	unsigned char* code;
+	int size;
+	int memo_hits;
+	int memo_misses;
+	Wr80Symbol* symbols;
+	int nsymbols;
+	Wr80Diagnostic* diags;
+	int ndiags;
+	char** paths;		// search paths of the included files (-I)
+	int npaths;
+	Wr80Reader reader;	// files served from memory (NULL for the disk only)
+	void* user;
+};
+
+// compiled IF condition: postfix code of the astlib nodes
+typedef struct {
+	int op;
+	char* ident;
+} CondCode;
+
+// value of an IF condition operand resolved on the evaluation
+typedef struct {
+	char* text;
+	int num;
+	bool isNum;
+	bool isNaN;
+	bool defined;
+} CondValue;
+
+struct node_cond {
+	unsigned int hash;
+	char* text;
+	CondCode* code;
+	int count;
+	CondValue* stack;	// values stack of the evaluation
+	char* texts;		// texts of the stack values, one line each
+	struct node_cond * next;
+};
+typedef struct node_cond CondList;
+
 MacroList* getMacroByName(MacroList*, char[]);
 MacroList* getMacroByNameA(MacroList*, char[], int);
 // DAT/TAD: Data Abstract Type Begin
@@ -156,29 +427,22 @@ MacroList* insertmac(MacroList* list, int argc, char name[], char** params, char
     strncpy(new_node->name, name, sizeof(new_node->name) - 1);
     new_node->name[sizeof(new_node->name)-1] = '\0';
     new_node->pcount = argc;
-    new_node->argsc = 0;
     new_node->line = line;
-    new_node->indexp = 0;
     new_node->ilabelA = 0;
     new_node->ilabelB = 0;
     new_node->ilabelC = 0;
-
-    // pvalues inicia vazio (ser preenchido em insertargs)
-    new_node->pvalues = NULL;
-    if (argc > 0) {
-        // alocado como array de ponteiros inicializados a NULL
-        new_node->pvalues = calloc(argc, sizeof(char*));
-        if (!new_node->pvalues) {
-            free(new_node);
-            return NULL;
-        }
-    }
+    new_node->tmpl.body = NULL;
+    new_node->tmpl.prep = NULL;
+    new_node->tmpl.stmts = NULL;
+    new_node->tmpl.count = 0;
+    new_node->tmpl.blocks = NULL;
+    new_node->tmpl.mapped = false;
+    new_node->cache = NULL;
 
     // copia os nomes dos parmetros (pnames) e liberta os params auxiliares
     if (argc > 0 && params != NULL) {
         new_node->pnames = calloc(argc, sizeof(char*));
         if (!new_node->pnames) {
-            free(new_node->pvalues);
             free(new_node);
             return NULL;
         }
@@ -209,60 +473,123 @@ MacroList* insertmac(MacroList* list, int argc, char name[], char** params, char
     return new_node;
 }
 
-MacroList* insertargs(MacroList *list, char name[], int argc, char** args){
-    MacroList* macro = getMacroByNameA(list, name, -1);
-	if(!macro){
-		macro = getMacroByNameA(list, name, argc);
-		if (!macro || !args) {
-			if(macro) macro->argsc = 0;
-        	return macro;
-    	}	
-	}else{
-		macro->argsc = argc;
-	}
+// Insert a new node in label dependencies list
+ExpDeps* insertdep(ExpDeps* list, LabelList* label, RefsAddr* ref){
+	ExpDeps *new_node = (ExpDeps*) malloc(sizeof(ExpDeps));
+	new_node->label = label;
+	new_node->name = NULL;
+	new_node->version = 0;
+	new_node->addr = label->addr;
+	new_node->hasRef = ref != NULL;
+	new_node->live = ref;
+	new_node->ref.expression = NULL;
+	new_node->next = list;
+	return new_node;
+}
 
-    int param_count = macro->pcount;
-    macro->indexp = 0;
-
-    // garante que pvalues exista e tenha espao
-    if (!macro->pvalues && argc > 0) {
-        macro->pvalues = calloc(argc, sizeof(char*));
-        if (!macro->pvalues) {
-            // tentamos liberar args para no vazar (para manter ownership consistente)
-            for (int i = 0; i < argc; ++i) free(args[i]);
-            free(args);
-            return macro;
-        }
-    }
+// Insert a new name dependency in label dependencies list
+ExpDeps* insertname(ExpDeps* list, const char* name, int version){
+	ExpDeps *new_node = (ExpDeps*) malloc(sizeof(ExpDeps));
+	new_node->label = NULL;
+	new_node->name = strdup(name);
+	new_node->version = version;
+	new_node->addr = 0;
+	new_node->hasRef = false;
+	new_node->live = NULL;
+	new_node->ref.expression = NULL;
+	new_node->next = list;
+	return new_node;
+}
 
-    // Copia cada argumento (libera qualquer contedo anterior)
-    for (int i = 0; i < argc; ++i) {
-        // se macro->pvalues[i] j tinha algo, libera para evitar leak
-        if (macro->pvalues[i]) {
-            free(macro->pvalues[i]);
-            macro->pvalues[i] = NULL;
-        }
-        // copia do args  se args tiver menos elementos que pcount, trata NULL
-        if (i < argc && args[i] != NULL) {
-            macro->pvalues[i] = malloc(strlen(args[i]) + 1);
-			if (macro->pvalues[i])
-			    strcpy(macro->pvalues[i], args[i]);
-        } else {
-            macro->pvalues[i] = NULL;
-        }
-    }
+// Insert a new node in memoized expansions list
+ExpansionList* insertexp(ExpansionList* list, int argc, char** args, unsigned char* code, int length){
+	ExpansionList *new_node = (ExpansionList*) malloc(sizeof(ExpansionList));
+	new_node->argc = argc;
+	new_node->args = (argc > 0) ? (char**) malloc(argc * sizeof(char*)) : NULL;
+	for(int i = 0; i < argc; i++)
+		new_node->args[i] = strdup(args[i]);
+	new_node->length = length;
+	new_node->code = (unsigned char*) malloc(length + 1);
+	memcpy(new_node->code, code, length);
+	new_node->deps = NULL;
+	new_node->refer = NULL;
+	new_node->next = list;
+	return new_node;
+}
 
-    // libera array auxiliar args (ownership consumida)
-    for (int i = 0; i < argc; ++i) {
-        free(args[i]);
-        args[i] = NULL;
-    }
-    free(args);
-    args = NULL;
+// insert a compiled IF condition
+CondList* insertcond(CondList* list, unsigned int hash, const char* text, CondCode* code, int count){
+	CondList *new_node = (CondList*) malloc(sizeof(CondList));
+	new_node->hash = hash;
+	new_node->text = strdup(text);
+	new_node->code = code;
+	new_node->count = count;
+	new_node->stack = NULL;
+	new_node->texts = NULL;
+	new_node->next = list;
+	return new_node;
+}
+
+// free the label dependencies list
+void freedep(ExpDeps *list){
+	ExpDeps *aux = list;
+	
+	while(aux != NULL){
+		ExpDeps *next_node = aux->next;
+		free(aux->ref.expression);
+		free(aux->name);
+		free(aux);
+		aux = next_node;
+	}
+}
 
-    return macro;
+// free the memoized expansions list
+void freeexp(ExpansionList *list){
+	ExpansionList *aux = list;
+	
+	while(aux != NULL){
+		ExpansionList *next_node = aux->next;
+		for(int i = 0; i < aux->argc; i++)
+			free(aux->args[i]);
+		free(aux->args);
+		free(aux->code);
+		freedep(aux->deps);
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// free the block index lines and spans
+void freeblocks(BlockIndex *index){
+	if(index == NULL)
+		return;
+	free(index->text);
+	free(index->lines);
+	free(index->spans);
+	index->text = NULL;
+	index->lines = NULL;
+	index->spans = NULL;
+	index->count = 0;
+	index->nspans = 0;
+	index->built = false;
 }
 
+// free the template statements
+void freetmpl(MacroTemplate *tmpl){
+	freeblocks(tmpl->blocks);
+	free(tmpl->blocks);
+	tmpl->blocks = NULL;
+	if(!tmpl->mapped){
+		free(tmpl->body);
+		free(tmpl->prep);
+		free(tmpl->stmts);
+	}
+	tmpl->mapped = false;
+	tmpl->body = NULL;
+	tmpl->prep = NULL;
+	tmpl->stmts = NULL;
+	tmpl->count = 0;
+}
 
 void free_macrolist(MacroList *list) {
     MacroList *cur = list;
@@ -275,13 +602,9 @@ void free_macrolist(MacroList *list) {
             }
             free(cur->pnames);
         }
-        if (cur->pvalues) {
-            for (int i = 0; i < cur->pcount; ++i) {
-                free(cur->pvalues[i]);
-            }
-            free(cur->pvalues);
-        }
         if (cur->content) free(cur->content);
+        freetmpl(&cur->tmpl);
+        freeexp(cur->cache);
         // Se tiver campos adicionais, libere aqui...
         free(cur);
 
@@ -300,6 +623,7 @@ DefineList* search(DefineList *list, char* name){
 
 // get a definition by name
 DefineList* getdef(DefineList *list, char* name){
+	memo_name(name);
 	for(DefineList *li = list; li != NULL; li = li->next)
 		if(strcmp(li->name, name) == 0)
 			return li;
@@ -307,6 +631,15 @@ DefineList* getdef(DefineList *list, char* name){
 	return NULL;
 }
 
+// get a compiled IF condition by its text
+CondList* getcond(CondList *list, unsigned int hash, const char* text){
+	for(CondList *li = list; li != NULL; li = li->next)
+		if(li->hash == hash && strcmp(li->text, text) == 0)
+			return li;
+			
+	return NULL;
+}
+
 // get a allocate value by line
 DcbList* getdcb(DcbList *list, int line){
 	for(DcbList *li = list; li != NULL; li = li->next)
@@ -327,6 +660,7 @@ LabelList* getLabelByLine(LabelList *list, int line){
 
 // get a label by name
 LabelList* getLabelByName(LabelList *list, char name[]){
+	memo_name(name);
 	for(LabelList *li = list; li != NULL; li = li->next)
 		if(strcmp(li->name, name) == 0)
 			return li;
@@ -336,6 +670,7 @@ LabelList* getLabelByName(LabelList *list, char name[]){
 
 // get a Macro by name
 MacroList* getMacroByName(MacroList *list, char name[]){
+	memo_name(name);
 	for(MacroList *li = list; li != NULL; li = li->next)
 		if(strcmp(li->name, name) == 0)
 			return li;
@@ -345,6 +680,7 @@ MacroList* getMacroByName(MacroList *list, char name[]){
 
 // get a Macro by name and argc
 MacroList* getMacroByNameA(MacroList *list, char name[], int argc){
+	memo_name(name);
 	for(MacroList *li = list; li != NULL; li = li->next)
 		if(strcmp(li->name, name) == 0 && li->pcount == argc)
 			return li;
@@ -440,11 +776,8 @@ void showmac(MacroList *list){
 		if(li->pnames != NULL)
 			for(size_t i = 0; i < li->pcount; i++)
 				printf(" pnames[%zu] = '%s'\n", i, li->pnames[i]);
-		if(li->pvalues != NULL)
-			for(size_t i = 0; i < li->pcount; i++)
-				printf(" pvalues[%zu] = '%s'\n", i, li->pvalues[i]);
-		if(li->content != NULL)
-			printf("%s", li->content);
+		if(li->tmpl.body != NULL)
+			printf("%s", li->tmpl.body);
 		printf("\n");
 	}
 }
@@ -502,8 +835,227 @@ void freemac(MacroList *list){
 		MacroList *next_node = aux->next;
 		if(aux->pnames != NULL)
 			free(aux->pnames);
-		free(aux->pvalues);
 		free(aux->content);
+		freetmpl(&aux->tmpl);
+		freeexp(aux->cache);
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// insert a prefetched included file
+IncludeList* insertinc(IncludeList *list, const char* path){
+	IncludeList *new_node = (IncludeList*) calloc(1, sizeof(IncludeList));
+	snprintf(new_node->path, sizeof(new_node->path), "%s", path);
+	new_node->next = list;
+	return new_node;
+}
+
+// get the prefetched file by its path
+IncludeList* getinc(IncludeList *list, const char* path){
+	for(IncludeList *aux = list; aux != NULL; aux = aux->next)
+		if(strcmp(aux->path, path) == 0)
+			return aux;
+	return NULL;
+}
+
+// free the prefetched files list
+void freeinc(IncludeList *list){
+	IncludeList *aux = list;
+	
+	while(aux != NULL){
+		IncludeList *next_node = aux->next;
+		free(aux->buffer);
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// insert a file read by the assembly
+SourceList* insertsrc(SourceList *list, const char* path, int kind){
+	SourceList *new_node = (SourceList*) calloc(1, sizeof(SourceList));
+	snprintf(new_node->path, sizeof(new_node->path), "%s", path);
+	new_node->kind = kind;
+	new_node->next = list;
+	return new_node;
+}
+
+// get the file read by its path
+SourceList* getsrc(SourceList *list, const char* path){
+	for(SourceList *aux = list; aux != NULL; aux = aux->next)
+		if(strcmp(aux->path, path) == 0)
+			return aux;
+	return NULL;
+}
+
+// free the files read list
+void freesrc(SourceList *list){
+	SourceList *aux = list;
+	
+	while(aux != NULL){
+		SourceList *next_node = aux->next;
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// insert a resolved file name
+PathList* insertpath(PathList *list, const char* name, const char* path){
+	PathList *new_node = (PathList*) calloc(1, sizeof(PathList));
+	snprintf(new_node->name, sizeof(new_node->name), "%s", name);
+	snprintf(new_node->path, sizeof(new_node->path), "%s", path);
+	new_node->next = list;
+	return new_node;
+}
+
+// get the resolution of the file name
+PathList* getpath(PathList *list, const char* name){
+	for(PathList *aux = list; aux != NULL; aux = aux->next)
+		if(strcmp(aux->name, name) == 0)
+			return aux;
+	return NULL;
+}
+
+// free the resolved file names list
+void freepath(PathList *list){
+	PathList *aux = list;
+	
+	while(aux != NULL){
+		PathList *next_node = aux->next;
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// insert an included file
+OnceList* insertonce(OnceList *list, const char* name, const char* path, unsigned long long dev, unsigned long long ino){
+	OnceList *new_node = (OnceList*) calloc(1, sizeof(OnceList));
+	snprintf(new_node->name, sizeof(new_node->name), "%s", name);
+	snprintf(new_node->path, sizeof(new_node->path), "%s", path);
+	new_node->dev = dev;
+	new_node->ino = ino;
+	new_node->next = list;
+	return new_node;
+}
+
+// get the included file by its inode, or by its canonical path without one
+OnceList* getonce(OnceList *list, const char* path, unsigned long long dev, unsigned long long ino){
+	for(OnceList *aux = list; aux != NULL; aux = aux->next){
+		if(ino != 0 && aux->ino != 0){
+			if(aux->ino == ino && aux->dev == dev)
+				return aux;
+		}else if(strcmp(aux->path, path) == 0){
+			return aux;
+		}
+	}
+	return NULL;
+}
+
+// free the included files list
+void freeonce(OnceList *list){
+	OnceList *aux = list;
+	
+	while(aux != NULL){
+		OnceList *next_node = aux->next;
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// insert a label used or defined by a region
+RegionLabels* insertrlab(RegionLabels* list, const char* name, int addr, bool defined){
+	RegionLabels *new_node = (RegionLabels*) calloc(1, sizeof(RegionLabels));
+	snprintf(new_node->name, sizeof(new_node->name), "%s", name);
+	new_node->addr = addr;
+	new_node->defined = defined;
+	new_node->next = list;
+	return new_node;
+}
+
+// get the kept region of an included file
+RegionList* getreg(RegionList *list, const char* path){
+	for(RegionList *aux = list; aux != NULL; aux = aux->next)
+		if(strcmp(aux->path, path) == 0)
+			return aux;
+	return NULL;
+}
+
+// free the region labels list
+void freerlab(RegionLabels *list){
+	RegionLabels *aux = list;
+	
+	while(aux != NULL){
+		RegionLabels *next_node = aux->next;
+		free(aux->ref.expression);
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// free the kept regions list
+void freereg(RegionList *list){
+	RegionList *aux = list;
+	
+	while(aux != NULL){
+		RegionList *next_node = aux->next;
+		freesrc(aux->files);
+		freerlab(aux->labels);
+		free(aux->counters);
+		free(aux->code);
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// insert a symbol recorded by the precompiling
+PchList* insertpch(PchList *list, int kind, int line, const char* name, const char* value, MacroList* macro){
+	PchList *new_node = (PchList*) calloc(1, sizeof(PchList));
+	new_node->kind = kind;
+	new_node->line = line;
+	new_node->name = (name != NULL) ? strdup(name) : NULL;
+	new_node->value = (value != NULL) ? strdup(value) : NULL;
+	new_node->macro = macro;
+	new_node->next = list;
+	return new_node;
+}
+
+// free the names versions list
+void freeversion(VersionList *list){
+	VersionList *aux = list;
+	
+	while(aux != NULL){
+		VersionList *next_node = aux->next;
+		free(aux->name);
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// free the recorded symbols list
+void freepch(PchList *list){
+	PchList *aux = list;
+	
+	while(aux != NULL){
+		PchList *next_node = aux->next;
+		free(aux->name);
+		free(aux->value);
+		free(aux);
+		aux = next_node;
+	}
+}
+
+// free the compiled IF conditions list
+void freecond(CondList *list){
+	CondList *aux = list;
+	
+	while(aux != NULL){
+		CondList *next_node = aux->next;
+		for(int i = 0; i < aux->count; i++)
+			free(aux->code[i].ident);
+		free(aux->code);
+		free(aux->stack);
+		free(aux->texts);
+		free(aux->text);
 		free(aux);
 		aux = next_node;
 	}
@@ -0,0 +1,303 @@
+/*
+	WR80 Assembler Server Library
+	Created by Wender Francis (KiddieOS.Community)
+	Date: 20/08/2025
+
+*/
+
+#ifndef __WR80SERV_H__
+#define __WR80SERV_H__
+
+/*
+	The server assembles the jobs of the clients over a Unix domain socket,
+	keeping the included files and the compiled IF conditions warm between
+	the jobs. The jobs run one by one, each in the working directory of its
+	client and in a forked worker, so a source that crashes the assembler
+	ends only its worker. The server repeats in itself the jobs that its
+	workers completed, after the client has the response, to keep warm the
+	caches that the workers can't give back.
+
+	Request:	"WR80 <alloc> <depth>\n<client directory>\n<source file>\n"
+	Response:	"WR80 <assembled> <code size> <messages size> <files size>\n"
+				"<code><messages><files>"
+
+	The files are the ones read by the assembly, "<kind> <path>\n" each.
+*/
+// -----------------------------------------------------------------------------
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+
+#define SERVER_HEADER_SIZE 4096		// MAX LENGTH OF THE REQUEST HEADER
+
+#ifndef _WIN32
+
+// server_socket: Get a socket on the path, bound for listening in the server
+// or connected in the client. Returns -1 on fail
+// -----------------------------------------------------------------------------
+int server_socket(const char* path, bool listening){
+	struct sockaddr_un address;
+	if(strlen(path) >= sizeof(address.sun_path)){
+		fprintf(stderr, "Error: socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock == -1){
+		perror("Error in creating the socket");
+		return -1;
+	}
+	if(listening){
+		unlink(path);
+		if(bind(sock, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(sock, 16) == -1){
+			perror("Error in listening the socket");
+			close(sock);
+			return -1;
+		}
+	}else if(connect(sock, (struct sockaddr*) &address, sizeof(address)) == -1){
+		perror("Error in connecting the server");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+// -----------------------------------------------------------------------------
+
+// send_all / recv_all: Transfer the whole data, false if the peer is closed
+// -----------------------------------------------------------------------------
+bool send_all(int sock, const void* data, size_t size){
+	const char* bytes = (const char*) data;
+	while(size > 0){
+		ssize_t sent = send(sock, bytes, size, 0);
+		if(sent <= 0)
+			return false;
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool recv_all(int sock, void* data, size_t size){
+	char* bytes = (char*) data;
+	while(size > 0){
+		ssize_t received = recv(sock, bytes, size, 0);
+		if(received <= 0)
+			return false;
+		bytes += received;
+		size -= received;
+	}
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// recv_lines: Read the header lines of the message, one byte at a time so
+// the data after the header stays in the socket
+// -----------------------------------------------------------------------------
+bool recv_lines(int sock, char* header, size_t size, int lines){
+	size_t length = 0;
+	while(lines > 0 && length + 1 < size){
+		if(recv(sock, &header[length], 1, 0) != 1)
+			return false;
+		if(header[length++] == '\n')
+			lines--;
+	}
+	header[length] = '\0';
+	return lines == 0;
+}
+// -----------------------------------------------------------------------------
+
+// server_assemble: Assemble the source in the client directory, capturing
+// its messages. Returns the messages
+// -----------------------------------------------------------------------------
+char* server_assemble(Wr80Assembler* assembler, const char* workdir, const char* source, bool* mounted){
+	char directory[SERVER_HEADER_SIZE];
+	diag_begin();
+	*mounted = false;
+	if(getcwd(directory, sizeof(directory)) != NULL && chdir(workdir) == 0){
+		*mounted = wr80_assemble_file(assembler, source);
+		if(chdir(directory) != 0)
+			diag_perror("Error in restoring the server directory");
+	}else{
+		diag_perror("Error in changing to the client directory");
+	}
+	return diag_end();
+}
+// -----------------------------------------------------------------------------
+
+// server_reply: Send back to the client the machine code of the assembly
+// with its messages and the files that it read
+// -----------------------------------------------------------------------------
+void server_reply(int client, Wr80Assembler* assembler, bool mounted, const char* messages){
+	char header[SERVER_HEADER_SIZE];
+
+	long used = 0;
+	for(SourceList* src = source_list; src != NULL; src = src->next)
+		used += strlen(src->path) + 16;
+	char* files = (char*) malloc(used + 1);
+	int flength = 0;
+	for(SourceList* src = source_list; files != NULL && src != NULL; src = src->next)
+		flength += sprintf(&files[flength], "%d %s\n", src->kind, src->path);
+
+	int size = (mounted) ? assembler->size : 0;
+	int length = snprintf(header, sizeof(header), "WR80 %d %d %d %d\n", mounted, size, (int) strlen(messages), flength);
+	if(send_all(client, header, length) && send_all(client, assembler->code, size) && send_all(client, messages, strlen(messages)))
+		send_all(client, files, flength);
+	free(files);
+}
+// -----------------------------------------------------------------------------
+
+// server_job: Assemble the request of a client in a forked worker, which
+// sends the response. The server answers with an error if the worker
+// crashes, or else repeats the job to keep its caches warm
+// -----------------------------------------------------------------------------
+void server_job(int client, Wr80Assembler* assembler, int sock){
+	char header[SERVER_HEADER_SIZE];
+	int alloc_flag = 0, depth = EXPANSION_DEPTH;
+
+	if(!recv_lines(client, header, sizeof(header), 3))
+		return;
+	char* save = NULL;
+	char* request = strtok_r(header, "\n", &save);
+	char* workdir = strtok_r(NULL, "\n", &save);
+	char* source = strtok_r(NULL, "\n", &save);
+	if(request == NULL || workdir == NULL || source == NULL || sscanf(request, "WR80 %d %d", &alloc_flag, &depth) != 2)
+		return;
+	assembler->alloc = alloc_flag != 0;
+	assembler->depth = depth;
+
+	bool mounted = false;
+	pid_t worker = fork();
+	if(worker == 0){
+		close(sock);
+		char* messages = server_assemble(assembler, workdir, source, &mounted);
+		server_reply(client, assembler, mounted, messages);
+		_exit(EXIT_SUCCESS);
+	}
+	int status = 0;
+	if(worker == -1 || waitpid(worker, &status, 0) == -1){
+		perror("Error in running the job worker");
+		return;
+	}
+	if(!WIFEXITED(status)){
+		char messages[SERVER_HEADER_SIZE];
+		snprintf(messages, sizeof(messages), "%s -> Error: the assembly crashed the server worker (signal %d)\n",
+				source, WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+		wr80_clear(assembler);
+		reset_assembler();
+		server_reply(client, assembler, false, messages);
+		return;
+	}
+	free(server_assemble(assembler, workdir, source, &mounted));
+}
+// -----------------------------------------------------------------------------
+
+// server_main: Listen the socket assembling the jobs until the process ends
+// -----------------------------------------------------------------------------
+int server_main(const char* path){
+	int sock = server_socket(path, true);
+	if(sock == -1)
+		return EXIT_FAILURE;
+	signal(SIGPIPE, SIG_IGN);
+	printf("WR80 assembler server listening on %s\n", path);
+	fflush(stdout);
+
+	Wr80Assembler* assembler = wr80_create();
+	keep_caches = true;
+	while(true){
+		int client = accept(sock, NULL, NULL);
+		if(client == -1){
+			if(errno == EINTR)
+				continue;
+			perror("Error in accepting the client");
+			break;
+		}
+		server_job(client, assembler, sock);
+		close(client);
+	}
+	keep_caches = false;
+	wr80_destroy(assembler);
+	close(sock);
+	unlink(path);
+	return EXIT_FAILURE;
+}
+// -----------------------------------------------------------------------------
+
+// client_main: Submit the source to the server, printing its messages. The
+// machine code received is returned in the assembler context, and the files
+// read by the server as the ones read by the assembly
+// -----------------------------------------------------------------------------
+bool client_main(const char* path, const char* source, Wr80Assembler* assembler){
+	char header[SERVER_HEADER_SIZE];
+	char directory[SERVER_HEADER_SIZE];
+	int mounted = 0, size = 0, length = 0, flength = 0;
+
+	if(getcwd(directory, sizeof(directory)) == NULL){
+		perror("Error in reading the directory");
+		return false;
+	}
+	int sock = server_socket(path, false);
+	if(sock == -1)
+		return false;
+
+	int request = snprintf(header, sizeof(header), "WR80 %d %d\n%s\n%s\n", assembler->alloc, assembler->depth, directory, source);
+	bool received = request < (int) sizeof(header) && send_all(sock, header, request)
+				&& recv_lines(sock, header, sizeof(header), 1)
+				&& sscanf(header, "WR80 %d %d %d %d", &mounted, &size, &length, &flength) == 4;
+
+	free(assembler->code);
+	assembler->code = (unsigned char*) malloc(size + 1);
+	assembler->size = size;
+	char* messages = (char*) malloc(length + 1);
+	char* files = (char*) malloc(flength + 1);
+	received = received && assembler->code != NULL && messages != NULL && files != NULL
+			&& recv_all(sock, assembler->code, size) && recv_all(sock, messages, length)
+			&& recv_all(sock, files, flength);
+	close(sock);
+
+	if(received){
+		messages[length] = '\0';
+		fputs(messages, stdout);
+		files[flength] = '\0';
+		freesrc(source_list);
+		source_list = NULL;
+		SourceList** last = &source_list;
+		int kind = 0, offset = 0;
+		char* save = NULL;
+		for(char* file = strtok_r(files, "\n", &save); file != NULL; file = strtok_r(NULL, "\n", &save)){
+			if(sscanf(file, "%d %n", &kind, &offset) != 1)
+				continue;
+			*last = insertsrc(NULL, &file[offset], kind);
+			last = &(*last)->next;
+		}
+	}else{
+		fprintf(stderr, "Error: incomplete response of the server %s\n", path);
+	}
+	free(messages);
+	free(files);
+	return received && mounted;
+}
+// -----------------------------------------------------------------------------
+
+#else
+
+int server_main(const char* path){
+	fprintf(stderr, "Error: the server mode needs Unix domain sockets\n");
+	return EXIT_FAILURE;
+}
+
+bool client_main(const char* path, const char* source, Wr80Assembler* assembler){
+	fprintf(stderr, "Error: the client mode needs Unix domain sockets\n");
+	return false;
+}
+
+#endif
+// -----------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,226 @@
+/*
+	WR80 Assembler Watch Library
+	Created by Wender Francis (KiddieOS.Community)
+	Date: 20/08/2025
+
+*/
+
+#ifndef __WR80WATCH_H__
+#define __WR80WATCH_H__
+
+/*
+	The watch mode assembles the sources once and waits the changes of the
+	files read by each one: the source, its INCLUDE and INCLUDEB files and the
+	imported WLL libraries. The directories of these files are watched, so the
+	editors that save by renaming a new file are seen too. A burst of saves is
+	joined in one rebuild, and only the sources that read a changed file are
+	assembled again, with the unchanged includes kept warm in memory.
+*/
+// -----------------------------------------------------------------------------
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#define WATCH_DEBOUNCE 100			// QUIET MILLISECONDS BEFORE A REBUILD
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+// Source of the watch mode with the files read by its last assembly
+typedef struct {
+	const char* source;
+	const char* output;		// output file (NULL to name as the source)
+	SourceList* files;
+	bool dirty;
+} WatchTarget;
+
+// Directory watched, by the name used in the source paths
+typedef struct {
+	char path[256];
+	int wd;
+} WatchDir;
+
+#ifdef __linux__
+
+// watch_split: Get the directory and the name of a file path
+// -----------------------------------------------------------------------------
+void watch_split(const char* path, char* dir, size_t size, const char** name){
+	const char* slash = strrchr(path, '/');
+	if(slash == NULL){
+		snprintf(dir, size, ".");
+		*name = path;
+	}else{
+		snprintf(dir, size, "%.*s", (slash == path) ? 1 : (int)(slash - path), path);
+		*name = slash + 1;
+	}
+}
+// -----------------------------------------------------------------------------
+
+// watch_build: Assemble the source of the target, keeping the files read by
+// the assembly to watch. The source itself is watched even if it failed
+// -----------------------------------------------------------------------------
+bool watch_build(WatchTarget* target, Wr80Assembler* assembler, bool bin){
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool mounted = wr80_assemble_file(assembler, target->source);
+	if(mounted)
+		write_output(target->source, target->output, assembler, bin);
+	else
+		printf("%s -> Error: the source was not assembled\n", target->source);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	freesrc(target->files);
+	target->files = insertsrc(NULL, target->source, SRC_TEXT);
+	for(SourceList* src = source_list; src != NULL; src = src->next)
+		if(getsrc(target->files, src->path) == NULL)
+			target->files = insertsrc(target->files, src->path, src->kind);
+	target->dirty = false;
+
+	long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+	printf("[watch] %s rebuilt in %ld ms (%d of %d included regions copied)\n", target->source, ms, region_hits, region_hits + region_misses);
+	fflush(stdout);
+	return mounted;
+}
+// -----------------------------------------------------------------------------
+
+// watch_dirs: Add the watches of the directories not watched yet, the kernel
+// returns the same descriptor for a directory named by two paths
+// -----------------------------------------------------------------------------
+int watch_dirs(int fd, WatchTarget* targets, int count, WatchDir** dirs, int ndirs){
+	char dir[256];
+	const char* name;
+	for(int t = 0; t < count; t++){
+		for(SourceList* src = targets[t].files; src != NULL; src = src->next){
+			watch_split(src->path, dir, sizeof(dir), &name);
+			int d = 0;
+			while(d < ndirs && strcmp((*dirs)[d].path, dir) != 0)
+				d++;
+			if(d < ndirs)
+				continue;
+			int wd = inotify_add_watch(fd, dir, WATCH_EVENTS);
+			if(wd == -1){
+				fprintf(stderr, "Error: can't watch the directory '%s': %s\n", dir, strerror(errno));
+				continue;
+			}
+			*dirs = (WatchDir*) realloc(*dirs, (ndirs + 1) * sizeof(WatchDir));
+			snprintf((*dirs)[ndirs].path, sizeof((*dirs)[ndirs].path), "%s", dir);
+			(*dirs)[ndirs++].wd = wd;
+		}
+	}
+	return ndirs;
+}
+// -----------------------------------------------------------------------------
+
+// watch_event: Mark the targets that read the file of the event, dropping its
+// kept copy. Returns true if any target was marked
+// -----------------------------------------------------------------------------
+bool watch_event(struct inotify_event* event, WatchTarget* targets, int count, WatchDir* dirs, int ndirs){
+	char dir[256];
+	const char* name;
+	bool marked = false;
+	if(event->len == 0)
+		return false;
+	for(int t = 0; t < count; t++){
+		for(SourceList* src = targets[t].files; src != NULL; src = src->next){
+			watch_split(src->path, dir, sizeof(dir), &name);
+			if(strcmp(name, event->name) != 0)
+				continue;
+			for(int d = 0; d < ndirs; d++){
+				if(dirs[d].wd == event->wd && strcmp(dirs[d].path, dir) == 0){
+					forget_include(src->path);
+					targets[t].dirty = marked = true;
+					break;
+				}
+			}
+		}
+	}
+	return marked;
+}
+// -----------------------------------------------------------------------------
+
+// watch_read: Read the pending events, returning false if the read failed
+// -----------------------------------------------------------------------------
+bool watch_read(int fd, WatchTarget* targets, int count, WatchDir* dirs, int ndirs, bool* marked){
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length = read(fd, events, sizeof(events));
+	if(length <= 0)
+		return length == -1 && errno == EINTR;
+	for(char* ptr = events; ptr < events + length; ){
+		struct inotify_event* event = (struct inotify_event*) ptr;
+		if(watch_event(event, targets, count, dirs, ndirs))
+			*marked = true;
+		ptr += sizeof(struct inotify_event) + event->len;
+	}
+	return true;
+}
+// -----------------------------------------------------------------------------
+
+// watch_main: Assemble the sources and rebuild them on each change until the
+// process ends
+// -----------------------------------------------------------------------------
+int watch_main(char** sources, int count, const char* output, Wr80Assembler* assembler, bool bin){
+	int fd = inotify_init1(IN_CLOEXEC);
+	if(fd == -1){
+		perror("Error in starting the watch");
+		return EXIT_FAILURE;
+	}
+	WatchTarget* targets = (WatchTarget*) calloc(count, sizeof(WatchTarget));
+	WatchDir* dirs = NULL;
+	int ndirs = 0;
+
+	keep_caches = true;
+	for(int t = 0; t < count; t++){
+		targets[t].source = sources[t];
+		targets[t].output = (count == 1) ? output : NULL;
+		watch_build(&targets[t], assembler, bin);
+	}
+	ndirs = watch_dirs(fd, targets, count, &dirs, ndirs);
+	printf("[watch] waiting for changes of %d source(s)...\n", count);
+	fflush(stdout);
+
+	struct pollfd pfd = {fd, POLLIN, 0};
+	while(true){
+		bool marked = false;
+		if(poll(&pfd, 1, -1) == -1){
+			if(errno == EINTR)
+				continue;
+			perror("Error in waiting the changes");
+			break;
+		}
+		if(!watch_read(fd, targets, count, dirs, ndirs, &marked))
+			break;
+		if(!marked)
+			continue;
+
+		// the burst of saves ends after a quiet interval
+		while(poll(&pfd, 1, WATCH_DEBOUNCE) > 0)
+			if(!watch_read(fd, targets, count, dirs, ndirs, &marked))
+				break;
+		for(int t = 0; t < count; t++)
+			if(targets[t].dirty)
+				watch_build(&targets[t], assembler, bin);
+		ndirs = watch_dirs(fd, targets, count, &dirs, ndirs);
+	}
+
+	keep_caches = false;
+	for(int t = 0; t < count; t++)
+		freesrc(targets[t].files);
+	free(targets);
+	free(dirs);
+	close(fd);
+	return EXIT_FAILURE;
+}
+// -----------------------------------------------------------------------------
+
+#else
+
+int watch_main(char** sources, int count, const char* output, Wr80Assembler* assembler, bool bin){
+	fprintf(stderr, "Error: the watch mode needs Linux inotify\n");
+	return EXIT_FAILURE;
+}
+
+#endif
+// -----------------------------------------------------------------------------
+
+#endif